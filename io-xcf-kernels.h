@@ -0,0 +1,570 @@
+/*
+ * Vector compositing kernels for the xcf pixbuf loader
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * This file is included by io-xcf.c once per instruction set, with
+ * - ISA, the target attribute string,
+ * - F(name), decorating the function names with the instruction set,
+ * - V, a vector of 16 bits lanes, V_PIXELS the number of pixels in a V,
+ * - and the V_* operations below.
+ *
+ * Each iteration loads 2*V_PIXELS pixels, widens the 8 bits ones to 16 bits
+ * per channel (the 16 bits ones of high bit depth layers are loaded as they
+ * are), and stores them to the 16 bits working buffer (or narrows them back,
+ * for unpremultiply_row). The kernels produce the exact same
+ * bytes as the scalar functions:
+ * - x / 255 is (x + 1 + (x >> 8)) >> 8, exact for x <= 65280, and every
+ *   product is kept below that,
+ * - the divisions by a pixel value are done in float and truncated, which
+ *   is exact as long as the quotient is below 256 (and clamped to 255).
+ */
+
+#define KERNEL static inline __attribute__((always_inline, target(ISA)))
+
+KERNEL V F(v_minu) (V a, V b) { return V_SUB (a, V_SUBS (a, b)); }
+KERNEL V F(v_maxu) (V a, V b) { return V_ADD (b, V_SUBS (a, b)); }
+KERNEL V F(v_select) (V mask, V a, V b) { return V_OR (V_AND (mask, a), V_ANDNOT (mask, b)); }
+KERNEL V F(v_div255) (V x) { return V_SRL (V_ADD (V_ADD (x, V_SET1 (1)), V_SRL (x, 8)), 8); }
+KERNEL V F(v_inv) (V x) { return V_SUB (V_SET1 (255), x); }
+
+//MIN (255, x / y), y != 0
+KERNEL V
+F(v_div_sat) (V x, V y)
+{
+	V zero = V_ZERO ();
+	V lo = V_CVTTPS (V_DIVPS (V_CVTPS (V_UNPACKLO16 (x, zero)), V_CVTPS (V_UNPACKLO16 (y, zero))));
+	V hi = V_CVTTPS (V_DIVPS (V_CVTPS (V_UNPACKHI16 (x, zero)), V_CVTPS (V_UNPACKHI16 (y, zero))));
+	return V_MIN_S (V_PACKS32 (lo, hi), V_SET1 (255));
+}
+
+/*
+ * blend () on V_PIXELS pixels: blend the colors of d and s, a0 and a1 being
+ * broadcast alphas. Pixels with both alphas null are left untouched.
+ */
+KERNEL V
+F(v_blend) (V d, V s, V a0, V a1)
+{
+	V den = F(v_inv) (F(v_div255) (V_MUL (F(v_inv) (a0), F(v_inv) (a1))));
+	V skip = V_CMPEQ (den, V_ZERO ());
+	V k = F(v_div_sat) (V_MUL (V_SET1 (255), a1), V_SUB (den, skip)); //den + 1 if skipped
+	V c = F(v_div255) (V_ADD (V_MUL (F(v_inv) (k), d), V_MUL (k, s)));
+	return F(v_select) (skip, d, c);
+}
+
+KERNEL V F(v_multiply) (V d, V s) { return F(v_div255) (V_MUL (d, s)); }
+KERNEL V F(v_screen) (V d, V s) { return F(v_inv) (F(v_div255) (V_MUL (F(v_inv) (d), F(v_inv) (s)))); }
+KERNEL V F(v_difference) (V d, V s) { return V_OR (V_SUBS (d, s), V_SUBS (s, d)); }
+KERNEL V F(v_addition) (V d, V s) { return F(v_minu) (V_ADD (d, s), V_SET1 (255)); }
+KERNEL V F(v_subtract) (V d, V s) { return V_SUBS (d, s); }
+KERNEL V F(v_min) (V d, V s) { return F(v_minu) (d, s); }
+KERNEL V F(v_max) (V d, V s) { return F(v_maxu) (d, s); }
+
+KERNEL V
+F(v_divide) (V d, V s)
+{
+	V zero = V_CMPEQ (s, V_ZERO ());
+	V q = F(v_div_sat) (V_MUL (V_SET1 (255), d), V_SUB (s, zero));
+	return F(v_select) (zero, V_ANDNOT (V_CMPEQ (d, V_ZERO ()), V_SET1 (255)), q);
+}
+
+KERNEL V
+F(v_dodge) (V d, V s)
+{
+	V full = V_CMPEQ (s, V_SET1 (255));
+	V q = F(v_div_sat) (V_MUL (V_SET1 (255), d), V_SUB (F(v_inv) (s), full));
+	return F(v_select) (full, V_ANDNOT (V_CMPEQ (d, V_ZERO ()), V_SET1 (255)), q);
+}
+
+KERNEL V
+F(v_burn) (V d, V s)
+{
+	V zero = V_CMPEQ (s, V_ZERO ());
+	V q = F(v_inv) (F(v_div_sat) (V_MUL (V_SET1 (255), F(v_inv) (d)), V_SUB (s, zero)));
+	return F(v_select) (zero, V_AND (V_CMPEQ (d, V_SET1 (255)), V_SET1 (255)), q);
+}
+
+KERNEL V
+F(v_hardlight) (V d, V s)
+{
+	V low = V_CMPGT_S (V_SET1 (0x80), s);
+	V dark = F(v_div255) (V_SLL (V_MUL (d, s), 1));
+	V light = F(v_inv) (F(v_div255) (V_SLL (V_MUL (F(v_inv) (d), F(v_inv) (s)), 1)));
+	return F(v_select) (low, dark, light);
+}
+
+// (p * x) / 255 for p <= 65025 and x <= 255, without overflowing 16 bits
+KERNEL V
+F(v_mul_div255) (V p, V x)
+{
+	V q = F(v_div255) (p);
+	V r = V_SUB (p, V_MUL (q, V_SET1 (255)));
+	return V_ADD (V_MUL (q, x), F(v_div255) (V_MUL (r, x)));
+}
+
+KERNEL V
+F(v_overlay) (V d, V s)
+{
+	V t1 = F(v_mul_div255) (V_MUL (F(v_inv) (s), d), d);
+	V t2 = V_MUL (d, F(v_inv) (F(v_div255) (V_MUL (F(v_inv) (s), F(v_inv) (s)))));
+	//MIN (255, (t1 + t2) / 255)
+	return F(v_div255) (F(v_minu) (V_ADDS (t1, t2), V_SET1 (65025)));
+}
+
+KERNEL V
+F(v_softlight) (V d, V s)
+{
+	V t1 = F(v_mul_div255) (V_MUL (F(v_inv) (d), d), s);
+	V t2 = V_MUL (d, F(v_inv) (V_SRL (V_MUL (F(v_inv) (s), F(v_inv) (d)), 8)));
+	return V_SRL (V_ADD (t1, t2), 8);
+}
+
+KERNEL V
+F(v_grainextract) (V d, V s)
+{
+	V v = V_ADD (V_SUB (d, s), V_SET1 (0x80));
+	return V_MIN_S (V_MAX_S (v, V_ZERO ()), V_SET1 (255));
+}
+
+KERNEL V
+F(v_grainmerge) (V d, V s)
+{
+	V v = V_SUB (V_ADD (d, s), V_SET1 (0x80));
+	return V_MIN_S (V_MAX_S (v, V_ZERO ()), V_SET1 (255));
+}
+
+/*
+ * over_row_scalar () on V_PIXELS pixels: s, the straight 8 bits pixels
+ * widened to 16 bits, is premultiplied by its alpha and the opacity o (times
+ * 257), and composited over d, premultiplied 16 bits pixels of the working
+ * buffer. v_premultiply () replaces the colors of d with the straight 16 bits
+ * colors of s, premultiplied by the alpha of d.
+ */
+
+//mul16 (), on unsigned lanes
+KERNEL V
+F(v_mul16) (V x, V y)
+{
+	V lo = V_MUL (x, y);
+	V t = V_ADD (V_MULHI (x, y), V_SRL (lo, 15)); //(x * y + 0x8000) >> 16
+	//plus one if adding t to the low bits of x * y + 0x8000 carries
+	V no_carry = V_CMPEQ (V_SUBS (t, V_SUB (V_SET1 (0x7fff), lo)), V_ZERO ());
+	return V_ADD (V_ADD (t, V_SET1 (1)), no_carry);
+}
+
+//the alpha of s, times the opacity o
+KERNEL V
+F(v_opacity) (V s, V o)
+{
+	return F(v_select) (V_COLOR_MASK, s, F(v_div255) (V_MUL (s, o)));
+}
+
+//the 2*V_PIXELS pixels at src widened to 16 bits lanes, their alphas times their mask values if masked
+KERNEL void
+F(v_load_src) (const guchar *src, const guchar *mask, gboolean masked, V *s0, V *s1)
+{
+	V s8 = V_SPREAD (V_LOAD (src));
+	*s0 = V_UNPACKLO8 (s8, V_ZERO ());
+	*s1 = V_UNPACKHI8 (s8, V_ZERO ());
+	if (masked) {
+		V m8 = V_SPREAD (V_LOAD_MASK (mask));
+		*s0 = F(v_opacity) (*s0, V_UNPACKLO8 (m8, V_ZERO ()));
+		*s1 = F(v_opacity) (*s1, V_UNPACKHI8 (m8, V_ZERO ()));
+	}
+}
+
+/*
+ * The variants of the row template F(name), see COMPOSITE_ROW_VARIANTS, and
+ * their slots in a table of the modes.
+ */
+#define ROW_KERNEL_VARIANT(name, suffix, type, masked, opaque)				\
+__attribute__((target(ISA))) static void						\
+F(name##suffix) (guint16 *dest, type *src, const type *mask, int count, guint32 opacity, guint32 key) \
+{											\
+	F(name) (dest, src, mask, count, opacity, key, masked, opaque);			\
+}
+
+#define ROW_KERNEL_VARIANTS_OF(name, type)						\
+ROW_KERNEL_VARIANT (name, _plain, type, FALSE, FALSE)					\
+ROW_KERNEL_VARIANT (name, _opaque, type, FALSE, TRUE)					\
+ROW_KERNEL_VARIANT (name, _masked, type, TRUE, FALSE)					\
+ROW_KERNEL_VARIANT (name, _masked_opaque, type, TRUE, TRUE)
+
+#define ROW_KERNEL_VARIANTS(name)	ROW_KERNEL_VARIANTS_OF (name, guchar)
+#define ROW16_KERNEL_VARIANTS(name)	ROW_KERNEL_VARIANTS_OF (name, guint16)
+
+#define ROW_KERNEL_FUNCS(funcs, name)							\
+	funcs[0][0] = F(name##_plain);							\
+	funcs[0][1] = F(name##_opaque);							\
+	funcs[1][0] = F(name##_masked);							\
+	funcs[1][1] = F(name##_masked_opaque);
+
+//over_row16_scalar () on V_PIXELS straight 16 bits pixels s
+KERNEL V
+F(v_over16) (V d, V s, V o, gboolean opaque)
+{
+	V a = opaque ? V_ALPHA (s) : F(v_mul16) (V_ALPHA (s), o);
+	V p = F(v_select) (V_COLOR_MASK, F(v_mul16) (a, s), a);
+	return V_ADD (p, F(v_mul16) (d, V_SUB (V_SET1 (0xffff), a)));
+}
+
+KERNEL V
+F(v_over) (V d, V s, V o, gboolean opaque)
+{
+	return F(v_over16) (d, V_OR (V_SLL (s, 8), s), o, opaque);
+}
+
+KERNEL void
+F(over_row) (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	V o = V_SET1 (opacity * 257);
+	int i;
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS) {
+		V s0, s1;
+		F(v_load_src) (src + 4*i, masked ? mask + i : NULL, masked, &s0, &s1);
+		V_STORE (dest + 4*i, F(v_over) (V_LOAD (dest + 4*i), s0, o, opaque));
+		V_STORE (dest + 4*i + 4*V_PIXELS, F(v_over) (V_LOAD (dest + 4*i + 4*V_PIXELS), s1, o, opaque));
+	}
+	over_row_scalar (dest + 4*i, src + 4*i, masked ? mask + i : NULL, count - i, opacity, key, masked, opaque);
+}
+ROW_KERNEL_VARIANTS (over_row)
+
+//hash32 (), on 32 bits lanes
+KERNEL V
+F(v_hash32) (V x)
+{
+	x = V_XOR (x, V_SRL32 (x, 16));
+	x = V_MUL32 (x, V_SET1_32 (0x7feb352d));
+	x = V_XOR (x, V_SRL32 (x, 15));
+	x = V_MUL32 (x, V_SET1_32 (0x846ca68b));
+	return V_XOR (x, V_SRL32 (x, 16));
+}
+
+/*
+ * dissolve_row_scalar () on V_PIXELS pixels: h holds the hash of each
+ * pixel twice, in 32 bits lanes, its low 16 bits are broadcast to the
+ * channels.
+ */
+KERNEL V
+F(v_dissolve) (V d, V s, V h, V o, gboolean opaque)
+{
+	V draw = V_MULHI (V_SHUFFLE16 (h, 0x00), V_SET1 (255));
+	V a = opaque ? V_ALPHA (s) : F(v_div255) (V_MUL (V_ALPHA (s), o));
+	V keep = V_CMPGT_S (a, draw);
+	V p = F(v_select) (V_COLOR_MASK, V_OR (V_SLL (s, 8), s), V_SET1 (-1));
+	return F(v_select) (keep, p, d);
+}
+
+KERNEL void
+F(dissolve_row) (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	V o = V_SET1 (opacity);
+	V keys = V_ADD32 (V_SET1_32 (key), V_PIXEL_ORDER);
+	int i;
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS, keys = V_ADD32 (keys, V_SET1_32 (2*V_PIXELS))) {
+		V h = F(v_hash32) (keys);
+		V s0, s1;
+		F(v_load_src) (src + 4*i, masked ? mask + i : NULL, masked, &s0, &s1);
+		V_STORE (dest + 4*i, F(v_dissolve) (V_LOAD (dest + 4*i), s0, V_UNPACKLO32 (h, h), o, opaque));
+		V_STORE (dest + 4*i + 4*V_PIXELS, F(v_dissolve) (V_LOAD (dest + 4*i + 4*V_PIXELS), s1, V_UNPACKHI32 (h, h), o, opaque));
+	}
+	dissolve_row_scalar (dest + 4*i, src + 4*i, masked ? mask + i : NULL, count - i, opacity, key + i, masked, opaque);
+}
+ROW_KERNEL_VARIANTS (dissolve_row)
+
+/*
+ * The rows of 16 bits src pixels, loaded as they are: their alphas are
+ * times their mask values if masked, V_LOAD_MASK16 () repeating each value
+ * to the 4 channels of its pixel.
+ */
+KERNEL void
+F(v_load_src16) (const guint16 *src, const guint16 *mask, gboolean masked, V *s0, V *s1)
+{
+	*s0 = V_LOAD (src);
+	*s1 = V_LOAD (src + 4*V_PIXELS);
+	if (masked) {
+		*s0 = F(v_select) (V_COLOR_MASK, *s0, F(v_mul16) (*s0, V_LOAD_MASK16 (mask)));
+		*s1 = F(v_select) (V_COLOR_MASK, *s1, F(v_mul16) (*s1, V_LOAD_MASK16 (mask + V_PIXELS)));
+	}
+}
+
+KERNEL void
+F(over_row16) (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	V o = V_SET1 (opacity * 257);
+	int i;
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS) {
+		V s0, s1;
+		F(v_load_src16) (src + 4*i, masked ? mask + i : NULL, masked, &s0, &s1);
+		V_STORE (dest + 4*i, F(v_over16) (V_LOAD (dest + 4*i), s0, o, opaque));
+		V_STORE (dest + 4*i + 4*V_PIXELS, F(v_over16) (V_LOAD (dest + 4*i + 4*V_PIXELS), s1, o, opaque));
+	}
+	over_row16_scalar (dest + 4*i, src + 4*i, masked ? mask + i : NULL, count - i, opacity, key, masked, opaque);
+}
+ROW16_KERNEL_VARIANTS (over_row16)
+
+//dissolve_row16_scalar (), as v_dissolve (): s is drawn where its alpha is above the draw, unsigned
+KERNEL V
+F(v_dissolve16) (V d, V s, V h, V o, gboolean opaque)
+{
+	V draw = V_MULHI (V_SHUFFLE16 (h, 0x00), V_SET1 (0xffff));
+	V a = opaque ? V_ALPHA (s) : F(v_mul16) (V_ALPHA (s), o);
+	V skip = V_CMPEQ (V_SUBS (a, draw), V_ZERO ());
+	return F(v_select) (skip, d, F(v_select) (V_COLOR_MASK, s, V_SET1 (-1)));
+}
+
+//s0 and s1 hold the same pixels as the widened 8 bits ones, the keys go the same way
+KERNEL void
+F(dissolve_row16) (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	V o = V_SET1 (opacity * 257);
+	V keys = V_ADD32 (V_SET1_32 (key), V_PIXEL_ORDER);
+	int i;
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS, keys = V_ADD32 (keys, V_SET1_32 (2*V_PIXELS))) {
+		V h = F(v_hash32) (keys);
+		V s0, s1;
+		F(v_load_src16) (src + 4*i, masked ? mask + i : NULL, masked, &s0, &s1);
+		V_STORE (dest + 4*i, F(v_dissolve16) (V_LOAD (dest + 4*i), s0, V_UNPACKLO32 (h, h), o, opaque));
+		V_STORE (dest + 4*i + 4*V_PIXELS, F(v_dissolve16) (V_LOAD (dest + 4*i + 4*V_PIXELS), s1, V_UNPACKHI32 (h, h), o, opaque));
+	}
+	dissolve_row16_scalar (dest + 4*i, src + 4*i, masked ? mask + i : NULL, count - i, opacity, key + i, masked, opaque);
+}
+ROW16_KERNEL_VARIANTS (dissolve_row16)
+
+KERNEL V
+F(v_premultiply) (V d, V s)
+{
+	return F(v_select) (V_COLOR_MASK, F(v_mul16) (V_ALPHA (d), V_OR (V_SLL (s, 8), s)), d);
+}
+
+/*
+ * unpremultiply_row_scalar () on p, a pixel of 32 bits channels per 128 bits
+ * lane, in float as well. k is 255 / alpha, broadcast to the lanes.
+ */
+KERNEL V
+F(v_unpremultiply) (V p, VF k)
+{
+	VF f = V_CVTPS (p);
+	VF c = V_ADDPS (V_MULPS (f, k), V_SET1PS (0.5f));
+	VF a = V_ADDPS (V_MULPS (f, V_SET1PS (255.0f / 0xffff)), V_SET1PS (0.5f));
+	return F(v_select) (V_COLOR32_MASK, V_CVTTPS (c), V_CVTTPS (a));
+}
+
+//v_unpremultiply () on the 2*V_PIXELS pixels of p0 and p1, to 16 bits lanes
+KERNEL void
+F(v_unpremultiply2) (V p0, V p1, V *q0, V *q1)
+{
+	//a single division for all the pixels, in the order the unpacks take them
+	VF a = V_SHUFFLEPS (V_CVTPS (V_SRL64 (p0, 48)), V_CVTPS (V_SRL64 (p1, 48)), 0x88);
+	VF k = V_DIVPS (V_SET1PS (255.0f), V_MAXPS (a, V_SET1PS (1.0f)));
+	*q0 = V_PACKS32 (F(v_unpremultiply) (V_UNPACKLO16 (p0, V_ZERO ()), V_SHUFFLEPS (k, k, 0x00)),
+			 F(v_unpremultiply) (V_UNPACKHI16 (p0, V_ZERO ()), V_SHUFFLEPS (k, k, 0x55)));
+	*q1 = V_PACKS32 (F(v_unpremultiply) (V_UNPACKLO16 (p1, V_ZERO ()), V_SHUFFLEPS (k, k, 0xaa)),
+			 F(v_unpremultiply) (V_UNPACKHI16 (p1, V_ZERO ()), V_SHUFFLEPS (k, k, 0xff)));
+}
+
+__attribute__((target(ISA))) static void
+F(unpremultiply_row) (const guint16 *src, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS) {
+		V q0, q1;
+		F(v_unpremultiply2) (V_LOAD (src + 4*i), V_LOAD (src + 4*i + 4*V_PIXELS), &q0, &q1);
+		V_STORE (dest + 4*i, V_SPREAD (V_PACKUS16 (q0, q1)));
+	}
+	unpremultiply_row_scalar (src + 4*i, dest + 4*i, count - i);
+}
+
+/*
+ * composite_row_scalar () on 2*V_PIXELS pixels at a time: the pixels of the
+ * working buffer are unpremultiplied to straight 16 bits lanes, blended
+ * with the src pixels, times the opacity o, by f, and premultiplied back,
+ * without going through memory in between.
+ */
+#define COMPOSITE_ROW_KERNEL(mode, f)							\
+KERNEL void										\
+F(composite_row_##mode) (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque) \
+{											\
+	V o = V_SET1 (opacity);								\
+	int i;										\
+	for (i = 0; i + 2*V_PIXELS <= count; i += 2*V_PIXELS) {				\
+		V p0 = V_LOAD (dest + 4*i);						\
+		V p1 = V_LOAD (dest + 4*i + 4*V_PIXELS);				\
+		V d0, d1, s0, s1;							\
+		F(v_unpremultiply2) (p0, p1, &d0, &d1);					\
+		F(v_load_src) (src + 4*i, masked ? mask + i : NULL, masked, &s0, &s1);			\
+		if (!opaque) {								\
+			s0 = F(v_opacity) (s0, o);					\
+			s1 = F(v_opacity) (s1, o);					\
+		}									\
+		V_STORE (dest + 4*i, F(v_premultiply) (p0, f (d0, s0)));		\
+		V_STORE (dest + 4*i + 4*V_PIXELS, F(v_premultiply) (p1, f (d1, s1)));	\
+	}										\
+	composite_row_##mode (dest + 4*i, src + 4*i, masked ? mask + i : NULL, count - i, opacity, key, masked, opaque); \
+}											\
+ROW_KERNEL_VARIANTS (composite_row_##mode)
+
+/*
+ * The hsv modes, on the 3 color channels of each pixel. min and max are
+ * broadcast to them, and the quotients are computed in float: a product of
+ * 9 bits values is exact, and so is its quotient by a 9 bits one, truncated.
+ */
+KERNEL V F(v_min3) (V x) { return V_MIN_S (x, V_MIN_S (V_SHUFFLE16 (x, 0xc9), V_SHUFFLE16 (x, 0xd2))); }
+KERNEL V F(v_max3) (V x) { return V_MAX_S (x, V_MAX_S (V_SHUFFLE16 (x, 0xc9), V_SHUFFLE16 (x, 0xd2))); }
+
+//div_round (a * b + c * e, d), on 32 bits lanes
+KERNEL V
+F(v_div_round32) (V a, V b, V c, V e, V d)
+{
+	VF n = V_ADDPS (V_MULPS (V_CVTPS (a), V_CVTPS (b)), V_MULPS (V_CVTPS (c), V_CVTPS (e)));
+	n = V_ADDPS (n, V_CVTPS (V_SRL32 (d, 1)));
+	return V_CVTTPS (V_DIVPS (n, V_CVTPS (d)));
+}
+
+//div_round (a * b + c * e, d), d != 0
+KERNEL V
+F(v_div_round) (V a, V b, V c, V e, V d)
+{
+	V z = V_ZERO ();
+	V lo = F(v_div_round32) (V_UNPACKLO16 (a, z), V_UNPACKLO16 (b, z), V_UNPACKLO16 (c, z),
+				 V_UNPACKLO16 (e, z), V_UNPACKLO16 (d, z));
+	V hi = F(v_div_round32) (V_UNPACKHI16 (a, z), V_UNPACKHI16 (b, z), V_UNPACKHI16 (c, z),
+				 V_UNPACKHI16 (e, z), V_UNPACKHI16 (d, z));
+	return V_PACKS32 (lo, hi);
+}
+
+KERNEL V
+F(v_hue) (V d, V s)
+{
+	V min0 = F(v_min3) (d), min1 = F(v_min3) (s);
+	V den = V_SUB (F(v_max3) (s), min1);
+	V gray = V_CMPEQ (den, V_ZERO ());
+	V q = F(v_div_round) (V_SUB (s, min1), V_SUB (F(v_max3) (d), min0), V_ZERO (), V_ZERO (), V_SUB (den, gray));
+	return F(v_select) (gray, d, V_ADD (min0, q));
+}
+
+KERNEL V
+F(v_saturation) (V d, V s)
+{
+	V max0 = F(v_max3) (d), max1 = F(v_max3) (s);
+	V span = F(v_div_round) (max0, V_SUB (max1, F(v_min3) (s)), V_ZERO (), V_ZERO (), V_MAX_S (max1, V_SET1 (1)));
+	V den = V_SUB (max0, F(v_min3) (d));
+	V gray = V_CMPEQ (den, V_ZERO ());
+	V q = F(v_div_round) (V_SUB (max0, d), span, V_ZERO (), V_ZERO (), V_SUB (den, gray));
+	V red = V_SUB (max0, V_ANDNOT (V_RED_MASK, span));
+	return F(v_select) (gray, red, V_SUB (max0, q));
+}
+
+KERNEL V
+F(v_value) (V d, V s)
+{
+	V max0 = F(v_max3) (d);
+	V black = V_AND (V_CMPEQ (max0, V_ZERO ()), V_SET1 (1));
+	return F(v_div_round) (V_ADD (d, black), F(v_max3) (s), V_ZERO (), V_ZERO (), V_ADD (max0, black));
+}
+
+KERNEL V
+F(v_color) (V d, V s)
+{
+	V sum0 = V_ADD (F(v_min3) (d), F(v_max3) (d));
+	V sum1 = V_ADD (F(v_min3) (s), F(v_max3) (s));
+	V range0 = V_MIN_S (sum0, V_SUB (V_SET1 (510), sum0));
+	V range1 = V_MAX_S (V_MIN_S (sum1, V_SUB (V_SET1 (510), sum1)), V_SET1 (1));
+	return F(v_div_round) (V_SUB (sum0, range0), range1, V_SUB (V_ADD (V_ADD (s, s), range1), sum1), range0,
+			       V_ADD (range1, range1));
+}
+
+// 3<=mode<=10 || 15<=mode<=21
+// a0 = a0
+// rgba0 = blend (rgba0, F(rgb0, rgb1), MIN(a0, a1)
+#define COMPOSITE_MODE_KERNEL(mode)							\
+KERNEL V										\
+F(v_composite_##mode) (V d, V s)							\
+{											\
+	V a0 = V_ALPHA (d);								\
+	V a1 = F(v_minu) (a0, V_ALPHA (s));						\
+	V c = F(v_blend) (d, F(v_##mode) (d, s), a0, a1);				\
+	return F(v_select) (V_COLOR_MASK, c, d);					\
+}											\
+COMPOSITE_ROW_KERNEL (mode, F(v_composite_##mode))
+
+COMPOSITE_MODE_KERNEL (multiply)
+COMPOSITE_MODE_KERNEL (screen)
+COMPOSITE_MODE_KERNEL (overlay)
+COMPOSITE_MODE_KERNEL (difference)
+COMPOSITE_MODE_KERNEL (addition)
+COMPOSITE_MODE_KERNEL (subtract)
+COMPOSITE_MODE_KERNEL (min)
+COMPOSITE_MODE_KERNEL (max)
+COMPOSITE_MODE_KERNEL (hue)
+COMPOSITE_MODE_KERNEL (saturation)
+COMPOSITE_MODE_KERNEL (color)
+COMPOSITE_MODE_KERNEL (value)
+COMPOSITE_MODE_KERNEL (divide)
+COMPOSITE_MODE_KERNEL (dodge)
+COMPOSITE_MODE_KERNEL (burn)
+COMPOSITE_MODE_KERNEL (hardlight)
+COMPOSITE_MODE_KERNEL (softlight)
+COMPOSITE_MODE_KERNEL (grainextract)
+COMPOSITE_MODE_KERNEL (grainmerge)
+
+//the [mode][masked][opaque] table of the kernels
+static void
+F(composite_row_funcs) (composite_row_func funcs[][2][2])
+{
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_NORMAL], over_row)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DISSOLVE], dissolve_row)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_MULTIPLY], composite_row_multiply)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_SCREEN], composite_row_screen)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_OVERLAY], composite_row_overlay)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DIFFERENCE], composite_row_difference)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_ADDITION], composite_row_addition)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_SUBTRACT], composite_row_subtract)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DARKENONLY], composite_row_min)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_LIGHTENONLY], composite_row_max)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_HUE], composite_row_hue)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_SATURATION], composite_row_saturation)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_COLOR], composite_row_color)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_VALUE], composite_row_value)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DIVIDE], composite_row_divide)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DODGE], composite_row_dodge)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_BURN], composite_row_burn)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_HARDLIGHT], composite_row_hardlight)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_SOFTLIGHT], composite_row_softlight)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_GRAINEXTRACT], composite_row_grainextract)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_GRAINMERGE], composite_row_grainmerge)
+}
+
+//the normal and dissolve kernels of 16 bits src pixels, the blend modes stay scalar
+static void
+F(composite_row16_funcs) (composite_row16_func funcs[][2][2])
+{
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_NORMAL], over_row16)
+	ROW_KERNEL_FUNCS (funcs[LAYERMODE_DISSOLVE], dissolve_row16)
+}
+
+#undef KERNEL
+#undef COMPOSITE_ROW_KERNEL
+#undef COMPOSITE_MODE_KERNEL
+#undef ROW_KERNEL_VARIANT
+#undef ROW_KERNEL_VARIANTS_OF
+#undef ROW_KERNEL_VARIANTS
+#undef ROW16_KERNEL_VARIANTS
+#undef ROW_KERNEL_FUNCS
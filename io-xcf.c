@@ -28,8 +28,6 @@
 
 /*
  * TODO:
- * - fix the spots/stains (where are they coming from) ?
- * - indexed mode
  * - if the bg layer mode is not Normal or Dissolve, change it to Normal
  * - file an enhancement request to gdk-pixbuf
  */
@@ -42,15 +40,28 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <gio/gio.h>
 #if GIO_2_23
-#include <gio/gunixoutputstream.h>
-#include <gio/gunixinputstream.h>
 #include "yelp-bz2-decompressor.h"
+#include "xcf-bz2-decompressor.h"
+#if HAVE_LZMA
+#include "xcf-xz-decompressor.h"
+#endif
+#if HAVE_ZSTD
+#include "xcf-zstd-decompressor.h"
+#endif
 #endif
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <bzlib.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 //#define LOG(...) printf (__VA_ARGS__);
 #define LOG(...)
@@ -73,11 +84,27 @@
 #define PROP_PATHS 		23
 #define PROP_USER_UNIT 		24
 #define PROP_VECTORS		25
+#define PROP_GROUP_ITEM		29
+#define PROP_ITEM_PATH		30
 //FIXME Find the real maximum property
 #define PROP_MAX		1000
 
+//image parasite holding a preview of the image, in any format gdk-pixbuf loads
+#define THUMBNAIL_PARASITE	"gimp-image-thumbnail"
+
 #define COMPRESSION_NONE	0
 #define COMPRESSION_RLE		1
+#define COMPRESSION_ZLIB	2
+
+//component formats, from the precision of v004+ files
+#define PRECISION_U8		0
+#define PRECISION_U16		1
+#define PRECISION_U32		2
+#define PRECISION_HALF		3
+#define PRECISION_FLOAT		4
+
+//the largest decoded tile: 64x64 pixels of 4 channels of 4 bytes
+#define TILE_BUFFER_SIZE	(64 * 64 * 4 * 4)
 
 #define LAYERTYPE_RGB		0
 #define LAYERTYPE_RGBA		1
@@ -114,24 +141,201 @@ enum {
 	FILETYPE_UNKNOWN      = 0,
 	FILETYPE_XCF,
 	FILETYPE_XCF_BZ2,
-	FILETYPE_XCF_GZ
+	FILETYPE_XCF_GZ,
+	FILETYPE_XCF_XZ,
+	FILETYPE_XCF_ZST
 };
 
-typedef struct _XcfContext XcfContext;
-struct _XcfContext {
-	GdkPixbufModuleSizeFunc size_func;
-	GdkPixbufModulePreparedFunc prepare_func;
-	GdkPixbufModuleUpdatedFunc update_func;
-	gpointer user_data;
-	gint type;
-	bz_stream *bz_stream;
+/*
+ * Instrumentation. When IO_XCF_STATS is set, each load collects counters and
+ * per stage times, and reports them as a single JSON line, on stderr if
+ * IO_XCF_STATS is 1, appended to the IO_XCF_STATS file otherwise. The line
+ * is also attached to the pixbuf as the "xcf-stats" option.
+ *
+ * Every thread counts in its own XcfStats (the one of its reader), they're
+ * merged when the rendering is done. Stage times are summed over the
+ * threads, render and total are wall clock times.
+ */
 
-#if GIO_2_23
-	GInputStream *input, *stream;
-#endif
+enum {
+	STAGE_NONE = -1,
+	STAGE_DECOMPRESS,
+	STAGE_PARSE,
+	STAGE_DECODE,
+	STAGE_MASK,
+	STAGE_COMPOSITE,
+	STAGE_RENDER,
+	STAGE_TOTAL,
+	STAGE_COUNT
+};
 
-	gchar *tempname;
+static const gchar *stage_names[STAGE_COUNT] = {
+	"decompress", "parse", "decode", "mask", "composite", "render", "total"
+};
+
+static const gchar *layer_mode_names[LAYERMODE_GRAINMERGE + 2] = {
+	"normal", "dissolve", "behind", "multiply", "screen", "overlay",
+	"difference", "addition", "subtract", "darken_only", "lighten_only",
+	"hue", "saturation", "color", "value", "divide", "dodge", "burn",
+	"hardlight", "softlight", "grain_extract", "grain_merge", "unknown"
+};
+
+typedef struct _XcfStats XcfStats;
+struct _XcfStats {
+	gint64 start;
+	gint file_type;
+	guint32 width;
+	guint32 height;
+	gint threads;
+	guint64 input_bytes;		//file or stream length, compressed
+	guint64 bytes_read;		//bytes handed to the parser and the decoders
+	guint64 seeks;			//non sequential cursor moves
+	guint64 reads;			//window refills of the buffered reader
+	guint64 tiles_decoded;
+	guint64 tiles_skipped;
+	guint64 layers[LAYERMODE_GRAINMERGE + 2];	//visible layers per mode, the last one for unknown modes
+	gint64 ns[STAGE_COUNT];
+};
+
+static inline gint64
+xcf_stats_now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Add the time elapsed since since to stage, and return the current time. A
+ * no-op returning 0 if stats is NULL.
+ */
+static inline gint64
+xcf_stats_time (XcfStats *stats, int stage, gint64 since)
+{
+	gint64 now;
+
+	if (!stats)
+		return 0;
+	now = xcf_stats_now ();
+	if (stage != STAGE_NONE)
+		stats->ns[stage] += now - since;
+	return now;
+}
+
+//NULL unless IO_XCF_STATS is set
+static XcfStats*
+xcf_stats_new (void)
+{
+	const gchar *env = g_getenv ("IO_XCF_STATS");
+	XcfStats *stats;
+
+	if (!env || !*env || !strcmp (env, "0"))
+		return NULL;
+	stats = g_new0 (XcfStats, 1);
+	stats->start = xcf_stats_now ();
+	return stats;
+}
+
+//add the counters of a rendering thread to stats
+static void
+xcf_stats_merge (XcfStats *stats, XcfStats *thread)
+{
+	int i;
+
+	stats->bytes_read += thread->bytes_read;
+	stats->seeks += thread->seeks;
+	stats->reads += thread->reads;
+	stats->tiles_decoded += thread->tiles_decoded;
+	stats->tiles_skipped += thread->tiles_skipped;
+	for (i = STAGE_DECODE; i <= STAGE_COMPOSITE; i++)
+		stats->ns[i] += thread->ns[i];
+}
+
+//report and free stats. pixbuf may be NULL if the load failed
+static void
+xcf_stats_emit (XcfStats *stats, GdkPixbuf *pixbuf)
+{
+	static const gchar *file_types[] = { "unknown", "xcf", "xcf.bz2", "xcf.gz", "xcf.xz", "xcf.zst" };
+	const gchar *env = g_getenv ("IO_XCF_STATS");
+	GString *json;
+	guint i;
+
+	if (!stats)
+		return;
+	xcf_stats_time (stats, STAGE_TOTAL, stats->start);
+
+	json = g_string_new ("{");
+	g_string_append_printf (json, "\"file_type\":\"%s\",\"ok\":%s,\"width\":%u,\"height\":%u,\"threads\":%d",
+				file_types[CLAMP (stats->file_type, 0, (int)G_N_ELEMENTS (file_types) - 1)],
+				pixbuf ? "true" : "false", stats->width, stats->height, stats->threads);
+	g_string_append_printf (json, ",\"input_bytes\":%" G_GUINT64_FORMAT ",\"bytes_read\":%" G_GUINT64_FORMAT
+				",\"seeks\":%" G_GUINT64_FORMAT ",\"reads\":%" G_GUINT64_FORMAT
+				",\"tiles_decoded\":%" G_GUINT64_FORMAT ",\"tiles_skipped\":%" G_GUINT64_FORMAT,
+				stats->input_bytes, stats->bytes_read, stats->seeks, stats->reads,
+				stats->tiles_decoded, stats->tiles_skipped);
+
+	g_string_append (json, ",\"layers\":{");
+	gboolean first = TRUE;
+	for (i = 0; i < G_N_ELEMENTS (stats->layers); i++) {
+		if (!stats->layers[i])
+			continue;
+		g_string_append_printf (json, "%s\"%s\":%" G_GUINT64_FORMAT, first ? "" : ",", layer_mode_names[i], stats->layers[i]);
+		first = FALSE;
+	}
+
+	g_string_append (json, "},\"ns\":{");
+	for (i = 0; i < STAGE_COUNT; i++)
+		g_string_append_printf (json, "%s\"%s\":%" G_GINT64_FORMAT, i ? "," : "", stage_names[i], stats->ns[i]);
+	g_string_append (json, "}}");
+
+	if (pixbuf)
+		gdk_pixbuf_set_option (pixbuf, "xcf-stats", json->str);
+
+	g_string_append_c (json, '\n');
+	if (!strcmp (env, "1"))
+		fputs (json->str, stderr);
+	else {
+		FILE *f = fopen (env, "a");
+		if (f) {
+			fputs (json->str, f);
+			fclose (f);
+		}
+	}
+
+	g_string_free (json, TRUE);
+	g_free (stats);
+}
+
+/*
+ * Decompressed (and progressively loaded) files are accumulated in memory,
+ * and the parser reads that buffer directly. Past IO_XCF_MEMORY_LIMIT
+ * megabytes, the content is moved to an unlinked temporary file, which is
+ * mmap'ed back for parsing.
+ */
+
+#define XCF_MEMORY_LIMIT	512	//in MB
+#define XCF_BUFFER_PREALLOC	4	//in MB, the buffer grows past it as needed
+
+typedef struct _XcfBuffer XcfBuffer;
+struct _XcfBuffer {
+	GByteArray *data;	//NULL once spilled to disk
 	FILE *file;
+	gsize limit;
+};
+
+/*
+ * Tile index of a level, built in one pass over its tile pointers. The
+ * length of a tile runs up to the next tile, and is capped to the largest
+ * possible encoded tile. The last tile has no known end, its length is taken
+ * from the file length when it's decoded (see xcf_tile_length).
+ */
+typedef struct _XcfTiles XcfTiles;
+struct _XcfTiles {
+	int count;
+	goffset *offsets;	//0 for missing tiles
+	guint32 *lengths;	//0 for tiles running to the end of the file
+	guint32 max;
+	int ready;		//the tiles before it have all arrived, see tiles_ready
 };
 
 typedef struct _XcfChannel XcfChannel;
@@ -140,7 +344,8 @@ struct _XcfChannel {
 	guint32 height;
 	gboolean visible;
 	guint32 opacity;
-	guint32 lptr;
+	goffset lptr;
+	XcfTiles tiles;
 };
 
 typedef struct _XcfLayer XcfLayer;
@@ -155,738 +360,3202 @@ struct _XcfLayer {
 	gint32 dx;
 	gint32 dy;
 	XcfChannel* layer_mask;
-	guint32 lptr;;
+	goffset lptr;
+	XcfTiles tiles;
 };
 
-void
-rle_decode (FILE *f, gchar *ptr, int count, int type)
+typedef struct _XcfImage XcfImage;
+struct _XcfImage {
+	guint32 width;
+	guint32 height;
+	guint32 color_mode;
+	guint32 version;	//0 for the original "file" format
+	int pointer_size;	//of the file offsets, 8 bytes in v011+ files, 4 before
+	guint32 precision;	//PRECISION_*
+	gboolean linear;	//color components are linear light, not sRGB
+	guchar colormap[256 * 4];	//rgba colors of the indexes, opaque black past the palette
+	gchar compression;
+	GList *layers;		//visible layers, bottom-up
+	goffset thumbnail;	//offset of the embedded thumbnail, 0 if none
+	guint32 thumbnail_length;
+};
+
+typedef struct _XcfContext XcfContext;
+struct _XcfContext {
+	GdkPixbufModuleSizeFunc size_func;
+	GdkPixbufModulePreparedFunc prepare_func;
+	GdkPixbufModuleUpdatedFunc update_func;
+	gpointer user_data;
+	gint type;
+	bz_stream *bz_stream;
+
+#if GIO_2_23
+	GConverter *decompressor;
+#endif
+
+	XcfBuffer buffer;
+	XcfStats *stats;
+
+	//only render this area of the canvas, if viewport_width > 0
+	gint viewport_x;
+	gint viewport_y;
+	gint viewport_width;
+	gint viewport_height;
+
+	//the prepared pixbuf, until it is returned
+	GdkPixbuf *pixbuf;
+	int scale;		//the canvas is downscaled by scale in both directions
+	int x;			//position of the pixbuf in the downscaled canvas
+	int y;
+	guchar *rendered;	//regions of the pixbuf already rendered
+	gint requested_width;	//by size_func, 0 if any size will do
+	gint requested_height;
+	gboolean thumbnail;	//the pixbuf was rendered from the embedded thumbnail
+
+	//progressive rendering
+	XcfImage image;		//parsed from the data received so far
+	gboolean parsed;
+	gsize wanted;		//data needed before trying to parse again
+};
+
+/* File access */
+
+/*
+ * All the parsing goes through an XcfReader. Whenever possible, the file is
+ * mmap'ed and every read is a bounds-checked pointer access in the mapping.
+ * If the file can't be mapped, the reader falls back to a window buffered
+ * over the FILE*, so the parser always gets a pointer to contiguous bytes.
+ *
+ * Out of bounds accesses don't abort: they return zeroes and set the sticky
+ * error flag, checked by the parser at the end of each stage.
+ */
+
+#define READER_WINDOW_SIZE	65536
+
+typedef struct _XcfReader XcfReader;
+struct _XcfReader {
+	const guchar *data;	//the whole file if mapped, the current window otherwise
+	goffset base;		//file offset of data[0]
+	gsize size;		//number of valid bytes at data
+	goffset pos;		//cursor
+	goffset length;		//file length
+	gboolean error;
+	goffset wanted;		//end of the first access past the end of the file
+
+	//mmap backend
+	gpointer map;
+	gsize map_size;
+
+	//buffered backend
+	FILE *file;
+	guchar *buffer;
+	gsize buffer_size;
+
+	z_stream *inflate;	//for the zlib tiles, created on the first one
+	XcfStats *stats;	//NULL unless IO_XCF_STATS is set
+};
+
+static gboolean
+xcf_reader_init_file (XcfReader *reader, FILE *f)
 {
-	int channels;
-	switch (type) {
-		case LAYERTYPE_RGB : channels = 3; break;
-		case LAYERTYPE_RGBA: channels = 4; break;
-		case LAYERTYPE_GRAYSCALE: channels = 1; break;
-		case LAYERTYPE_GRAYSCALEA: channels = 2; break;
-		case LAYERTYPE_INDEXED: channels = 1; break;
-		case LAYERTYPE_INDEXEDA: channels = 2; break;
-	}
+	struct stat st;
 
-	guchar opcode;
-	guchar buffer[3];
-	guchar ch[channels][count];
-	int channel;
+	memset (reader, 0, sizeof (XcfReader));
 
-	//un-rle
-	for (channel = 0; channel < channels; channel++) {
-		int pixels_count = 0;
-		while (pixels_count < count) {
-			fread (&opcode, sizeof(guchar), 1, f);
-			if (opcode <= 126) {
-				fread (buffer, 1, 1, f);
-				opcode ++;
-				while (opcode --)
-					memcpy (ch[channel] + (pixels_count++), buffer, 1);
-			} else if (opcode == 127) {
-				fread (buffer, 3, 1, f);
-				int p = buffer[0];
-				int q = buffer[1];
-				int count = p*256+q;
-				while (count --)
-					memcpy (ch[channel] + (pixels_count++), buffer+2, 1);
-			} else if (opcode == 128) {
-				fread (buffer, 2, 1, f);
-				int p = buffer[0];
-				int q = buffer[1];
-				fread (ch[channel] + pixels_count, p*256+q, 1, f);
-				pixels_count += p*256+q;
-			} else if (opcode >= 129) {
-				fread (ch[channel] + pixels_count, 256 - opcode, 1, f);
-				pixels_count += 256 - opcode;
-			}
+	if (fstat (fileno (f), &st) == 0 && S_ISREG (st.st_mode))
+		reader->length = st.st_size;
+	else {
+		if (fseeko (f, 0, SEEK_END) != 0)
+			return FALSE;
+		reader->length = ftello (f);
+		rewind (f);
+	}
+
+#ifdef HAVE_MMAP
+	if (reader->length > 0 && (guint64)reader->length <= G_MAXSIZE) {
+		gpointer map = mmap (NULL, reader->length, PROT_READ, MAP_PRIVATE, fileno (f), 0);
+		if (map != MAP_FAILED) {
+			LOG ("mmap'ed %ld bytes\n", (long)reader->length);
+			reader->map = map;
+			reader->map_size = reader->length;
+			reader->data = map;
+			reader->size = reader->length;
+			return TRUE;
 		}
 	}
+#endif
 
-	//reinterlace the channels
-	int i, j;
-	for (i=0; i <count; i++)
-		for (j=0; j<channels; j++)
-			memcpy (ptr + i * channels + j, ch[j] + i, 1);
+	LOG ("falling back to buffered reads\n");
+	reader->file = f;
+	reader->buffer_size = READER_WINDOW_SIZE;
+	reader->buffer = g_try_malloc (reader->buffer_size);
+	return reader->buffer != NULL;
 }
 
-void
-to_rgba (gchar *ptr, int count, int type)
+static void
+xcf_reader_init_memory (XcfReader *reader, const guchar *data, gsize len)
 {
-	//pad to rgba
-	int i;
-
-	for (i=count-1; i>=0;i--)
-		switch (type) {
-		case LAYERTYPE_RGB:
-			memcpy (ptr + 4*i, ptr + 3*i, 3);
-			ptr[4*i + 3] = 0xff;
-			break;
-		case LAYERTYPE_RGBA:
-			///nothing to do
-			break;
-		case LAYERTYPE_GRAYSCALE:
-			memcpy (ptr + 4*i, ptr + i, 1);
-			memcpy (ptr + 4*i + 1, ptr + i, 1);
-			memcpy (ptr + 4*i + 2, ptr + i, 1);
-			ptr[4*i + 3] = 0xff;
-			break;
-		case LAYERTYPE_GRAYSCALEA:
-			memcpy (ptr + 4*i, ptr + i, 1);
-			memcpy (ptr + 4*i + 1, ptr + i, 1);
-			memcpy (ptr + 4*i + 2, ptr + i, 1);
-			memcpy (ptr + 4+i + 3, ptr + i + 1, 1);
-			break;
-		}
+	memset (reader, 0, sizeof (XcfReader));
+	reader->data = data;
+	reader->size = len;
+	reader->length = len;
 }
 
-void
-apply_opacity (guchar* ptr, int size, guint32 opacity)
+static void
+xcf_reader_clear (XcfReader *reader)
 {
-	int i;
-	for (i=0; i<size; i++)
-		ptr[4*i + 3] = (guchar)((ptr[4*i+3] * opacity) / 0xff);
+#ifdef HAVE_MMAP
+	if (reader->map)
+		munmap (reader->map, reader->map_size);
+#endif
+	g_free (reader->buffer);
+	if (reader->inflate) {
+		inflateEnd (reader->inflate);
+		g_free (reader->inflate);
+	}
+	memset (reader, 0, sizeof (XcfReader));
 }
 
-void
-apply_mask (FILE *f, gchar compression, guchar *ptr, int size, XcfChannel *mask, int tile_id)
+//refill the window so it holds at least len bytes at the cursor
+static gboolean
+xcf_reader_fill (XcfReader *reader, gsize len)
 {
-	//save file position
-	long pos = ftell (f);
+	if (!reader->file)
+		return FALSE;
 
-	guint32 tptr = mask->lptr + (2 + tile_id) * sizeof(guint32); //skip width and height
-	fseek (f, tptr, SEEK_SET);
-	fread (&tptr, sizeof(guint32), 1, f);
-	fseek (f, GUINT32_FROM_BE(tptr), SEEK_SET);
+	if (len > reader->buffer_size) {
+		guchar *buffer = g_try_realloc (reader->buffer, len);
+		if (!buffer)
+			return FALSE;
+		reader->buffer = buffer;
+		reader->buffer_size = len;
+	}
 
-	gchar pixels[4096];
-	if (compression == COMPRESSION_RLE)
-		rle_decode (f, pixels, size, LAYERTYPE_GRAYSCALE);
-	else //COMPRESSION_NONE
-		fread (pixels, sizeof(gchar), size, f);
+	if (reader->stats)
+		reader->stats->reads++;
+	reader->base = reader->pos;
+	reader->size = 0;
+	reader->data = reader->buffer;
+	if (fseeko (reader->file, reader->pos, SEEK_SET) != 0)
+		return FALSE;
+	reader->size = fread (reader->buffer, 1, MIN (reader->buffer_size, (gsize)(reader->length - reader->pos)), reader->file);
 
-	int i;
-	for (i = 0; i<size; i++)
-		ptr[4*i + 3] = ptr[4 * i + 3] * pixels[i] / 0xff;
+	return reader->size >= len;
+}
 
-	//rewind
-	fseek (f, pos, SEEK_SET);
+//flag an access ending at end, past the end of the file
+static void
+xcf_reader_fail (XcfReader *reader, goffset end)
+{
+	if (!reader->error)
+		reader->wanted = end;
+	reader->error = TRUE;
 }
 
+/*
+ * Returns a pointer to (at most max, at least 1) bytes at the cursor, and
+ * the number of bytes actually available in *len. Doesn't move the cursor.
+ */
 
-void
-intersect_tile (guchar* ptr, int im_width, int im_height, int *ox, int *oy, int *tw, int *th)
+static const guchar*
+xcf_reader_peek_avail (XcfReader *reader, gsize max, gsize *len)
 {
-	int i;
-	if (*ox < 0) {
-		for (i=0; i<*th; i++) {
-			memmove (ptr + 4 * i * (*tw + *ox), ptr + 4 * ( i * *tw - *ox), 4 * (*tw + *ox));
-		}
-		*tw = *tw + *ox;
-		*ox = 0;
-	}
-	if (*oy < 0) {
-		memmove (ptr, ptr + 4 * *tw * -*oy, 4 * *tw * (*th + *oy));
-		*th = *th + *oy;
-		*oy = 0;
+	if (reader->pos < 0 || reader->pos >= reader->length) {
+		xcf_reader_fail (reader, reader->pos + 1);
+		*len = 0;
+		return NULL;
 	}
-	if (*ox + *tw > im_width) {
-		for (i=0; i<*th; i++) {
-			memmove (ptr + 4 * i * (im_width - *ox), ptr + 4 * i * (*tw), 4 * (im_width - *ox));
+
+	max = MIN ((guint64)max, (guint64)(reader->length - reader->pos));
+	if (reader->pos < reader->base || reader->pos + max > reader->base + reader->size)
+		if (!xcf_reader_fill (reader, max)) {
+			reader->error = TRUE;
+			*len = 0;
+			return NULL;
 		}
-		*tw = im_width - *ox;
-	}
-	if (*oy + *th > im_height) {
-		*th = im_height - *oy;
-	}
+
+	if (reader->stats)
+		reader->stats->bytes_read += max;
+	*len = max;
+	return reader->data + (reader->pos - reader->base);
 }
 
-void blend (guchar* rgba0, guchar* rgba1)
+static const guchar*
+xcf_reader_peek (XcfReader *reader, gsize len)
 {
-	if (rgba0[3] == 0 && rgba1[3] == 0)
-		return;
+	gsize avail;
+	const guchar *ptr;
 
-	guchar k = 0xff * rgba1[3] / (0xff - (0xff-rgba0[3])*(0xff-rgba1[3])/0xff);
-	rgba0[0] = ((0xff - k) * rgba0[0] + k * rgba1[0]) / 0xff;
-	rgba0[1] = ((0xff - k) * rgba0[1] + k * rgba1[1]) / 0xff;
-	rgba0[2] = ((0xff - k) * rgba0[2] + k * rgba1[2]) / 0xff;
-}
+	if (reader->pos >= 0 && reader->pos + (goffset)len > reader->length) {
+		xcf_reader_fail (reader, reader->pos + len);
+		return NULL;
+	}
 
-typedef void (*composite_func) (guchar* rgb0, guchar* rgb1);
+	ptr = xcf_reader_peek_avail (reader, len, &avail);
+	if (avail < len) {
+		reader->error = TRUE;
+		return NULL;
+	}
+	return ptr;
+}
 
-void
-multiply (guchar *rgb0, guchar *rgb1)
+static inline goffset
+xcf_reader_tell (XcfReader *reader)
 {
-	rgb1[0] = (rgb0[0] * rgb1[0] ) / 0xff;
-	rgb1[1] = (rgb0[1] * rgb1[1] ) / 0xff;
-	rgb1[2] = (rgb0[2] * rgb1[2] ) / 0xff;
+	return reader->pos;
 }
 
-void
-screen (guchar *rgb0, guchar *rgb1)
+static inline void
+xcf_reader_seek (XcfReader *reader, goffset pos)
 {
-	rgb1[0] = 0xff - (0xff - rgb0[0]) * (0xff - rgb1[0]) / 0xff;
-	rgb1[1] = 0xff - (0xff - rgb0[1]) * (0xff - rgb1[1]) / 0xff;
-	rgb1[2] = 0xff - (0xff - rgb0[2]) * (0xff - rgb1[2]) / 0xff;
+	if (reader->stats && pos != reader->pos)
+		reader->stats->seeks++;
+	reader->pos = pos;
 }
 
-void
-overlay (guchar *rgb0, guchar *rgb1)
+static inline void
+xcf_reader_skip (XcfReader *reader, goffset len)
 {
-	//FIXME
-	//LOG ("Overlay (%d %d %d) (%d %d %d) : ", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
-	rgb1[0] = MIN (0xff, ((0xff - rgb1[0]) * rgb0[0] * rgb0[0] / 0xff + rgb0[0] * (0xff - (0xff - rgb1[0]) * (0xff - rgb1[0]) / 0xff)) / 0xff);
-	rgb1[1] = MIN (0xff, ((0xff - rgb1[1]) * rgb0[1] * rgb0[1] / 0xff + rgb0[1] * (0xff - (0xff - rgb1[1]) * (0xff - rgb1[1]) / 0xff)) / 0xff);
-	rgb1[2] = MIN (0xff, ((0xff - rgb1[2]) * rgb0[2] * rgb0[2] / 0xff + rgb0[2] * (0xff - (0xff - rgb1[2]) * (0xff - rgb1[2]) / 0xff)) / 0xff);
-	//LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+	reader->pos += len;
 }
 
-void
-difference (guchar *rgb0, guchar *rgb1)
+static gboolean
+xcf_reader_read (XcfReader *reader, gpointer dest, gsize len)
 {
-	rgb1[0] = (rgb0[0] > rgb1[0]) ? rgb0[0] - rgb1[0] : rgb1[0] - rgb0[0];
-	rgb1[1] = (rgb0[1] > rgb1[1]) ? rgb0[1] - rgb1[1] : rgb1[1] - rgb0[1];
-	rgb1[2] = (rgb0[2] > rgb1[2]) ? rgb0[2] - rgb1[2] : rgb1[2] - rgb0[2];
+	const guchar *ptr = xcf_reader_peek (reader, len);
+
+	if (!ptr) {
+		memset (dest, 0, len);
+		return FALSE;
+	}
+	memcpy (dest, ptr, len);
+	reader->pos += len;
+	return TRUE;
 }
 
-void
-addition (guchar *rgb0, guchar *rgb1)
+static guint32
+xcf_reader_read_uint32 (XcfReader *reader)
 {
-//	LOG ("addition (%d %d %d) (%d %d %d):", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
-	rgb1[0] = (rgb0[0] + rgb1[0]) > 0xff ? 0xff : rgb0[0] + rgb1[0];
-	rgb1[1] = (rgb0[1] + rgb1[1]) > 0xff ? 0xff : rgb0[1] + rgb1[1];
-	rgb1[2] = (rgb0[2] + rgb1[2]) > 0xff ? 0xff : rgb0[2] + rgb1[2];
-//	LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+	guint32 value;
+
+	xcf_reader_read (reader, &value, sizeof (guint32));
+	return GUINT32_FROM_BE (value);
 }
 
-void
-subtract (guchar *rgb0, guchar *rgb1)
+//a big endian file offset of size bytes at ptr
+static inline goffset
+xcf_pointer (const guchar *ptr, int size)
 {
-	rgb1[0] = (rgb0[0] - rgb1[0]) < 0 ? 0 : rgb0[0] - rgb1[0];
-	rgb1[1] = (rgb0[1] - rgb1[1]) < 0 ? 0 : rgb0[1] - rgb1[1];
-	rgb1[2] = (rgb0[2] - rgb1[2]) < 0 ? 0 : rgb0[2] - rgb1[2];
+	if (size == sizeof (guint64)) {
+		guint64 value;
+		memcpy (&value, ptr, sizeof (guint64));
+		return GUINT64_FROM_BE (value);
+	} else {
+		guint32 value;
+		memcpy (&value, ptr, sizeof (guint32));
+		return GUINT32_FROM_BE (value);
+	}
 }
 
-void
-min (guchar *rgb0, guchar *rgb1)
+//a file offset of size bytes, 0 if it's past the end of the file
+static goffset
+xcf_reader_read_pointer (XcfReader *reader, int size)
 {
-	rgb1[0] = MIN (rgb0[0], rgb1[0]);
-	rgb1[1] = MIN (rgb0[1], rgb1[1]);
-	rgb1[2] = MIN (rgb0[2], rgb1[2]);
+	const guchar *ptr = xcf_reader_peek (reader, size);
+
+	if (!ptr)
+		return 0;
+	reader->pos += size;
+	return xcf_pointer (ptr, size);
 }
 
 void
-max (guchar *rgb0, guchar *rgb1)
+xcf_tiles_clear (XcfTiles *tiles)
 {
-	rgb1[0] = MAX (rgb0[0], rgb1[0]);
-	rgb1[1] = MAX (rgb0[1], rgb1[1]);
-	rgb1[2] = MAX (rgb0[2], rgb1[2]);
+	g_free (tiles->offsets);
+	g_free (tiles->lengths);
+	memset (tiles, 0, sizeof (XcfTiles));
 }
 
-void
-divide (guchar *rgb0, guchar *rgb1)
+/*
+ * Read the tile pointers (of pointer_size bytes) of the width x height level
+ * at lptr, with bpp bytes per pixel, into tiles. Returns FALSE if the index
+ * can't be allocated, a truncated list sets the reader error.
+ */
+gboolean
+xcf_tiles_read (XcfReader *reader, goffset lptr, guint32 width, guint32 height, guint32 bpp, int pointer_size, XcfTiles *tiles)
 {
-	rgb1[0] = rgb1[0] == 0 ? (rgb0[0] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[0] / rgb1[0]);
-	rgb1[1] = rgb1[1] == 0 ? (rgb0[1] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[1] / rgb1[1]);
-	rgb1[2] = rgb1[2] == 0 ? (rgb0[2] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[2] / rgb1[2]);
+	guint64 count = (guint64)((width + 63) / 64) * ((height + 63) / 64);
+	gint64 max = (gint64)2 * 64 * 64 * bpp; //RLE, runs of 1, more than any zlib tile
+	int i;
+
+	memset (tiles, 0, sizeof (XcfTiles));
+
+	//Ignore Level w and h (same as hierarchy)
+	xcf_reader_seek (reader, lptr + 2 * sizeof(guint32));
+	if (count * pointer_size > (guint64)reader->length) {
+		xcf_reader_fail (reader, lptr + 2 * sizeof(guint32) + count * pointer_size);
+		return TRUE;
+	}
+	const guchar *ptrs = xcf_reader_peek (reader, count * pointer_size);
+	if (!ptrs)
+		return TRUE;
+
+	tiles->offsets = g_try_new0 (goffset, count);
+	tiles->lengths = g_try_new0 (guint32, count);
+	if (!tiles->offsets || !tiles->lengths) {
+		xcf_tiles_clear (tiles);
+		return FALSE;
+	}
+	tiles->count = count;
+	tiles->max = max;
+
+	for (i = 0; i < tiles->count; i++) {
+		goffset ptr = xcf_pointer (ptrs + i * pointer_size, pointer_size);
+		if (!ptr) //end of the list
+			break;
+		tiles->offsets[i] = ptr;
+	}
+
+	for (i = 0; i + 1 < tiles->count && tiles->offsets[i+1]; i++)
+		if (tiles->offsets[i+1] > tiles->offsets[i])
+			tiles->lengths[i] = MIN (tiles->offsets[i+1] - tiles->offsets[i], max);
+
+	return TRUE;
 }
 
-void
-dodge (guchar *rgb0, guchar *rgb1)
+/*
+ * Length of tile id, in a file of length bytes. Tiles without a following
+ * tile run to the end of the file, which grows while loading progressively,
+ * so their length can't be known when the index is read.
+ */
+guint32
+xcf_tile_length (XcfTiles *tiles, int id, goffset length)
 {
-	rgb1[0] = rgb1[0] == 0xff ? (rgb0[0] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[0] / (0xff - rgb1[0]));
-	rgb1[1] = rgb1[1] == 0xff ? (rgb0[1] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[1] / (0xff - rgb1[1]));
-	rgb1[2] = rgb1[2] == 0xff ? (rgb0[2] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[2] / (0xff - rgb1[2]));
+	if (tiles->lengths[id])
+		return tiles->lengths[id];
+	return CLAMP (length - tiles->offsets[id], 0, (gint64)tiles->max);
 }
 
-void
-burn (guchar *rgb0, guchar *rgb1) // 1-(1-x1)/x2
+int
+layer_channels (guint32 type)
 {
-	rgb1[0] = rgb1[0] == 0 ? (rgb0[0] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[0]) / rgb1[0]);
-	rgb1[1] = rgb1[1] == 0 ? (rgb0[1] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[1]) / rgb1[1]);
-	rgb1[2] = rgb1[2] == 0 ? (rgb0[2] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[2]) / rgb1[2]);
+	switch (type) {
+		case LAYERTYPE_RGB : return 3;
+		case LAYERTYPE_RGBA: return 4;
+		case LAYERTYPE_GRAYSCALE: return 1;
+		case LAYERTYPE_GRAYSCALEA: return 2;
+		case LAYERTYPE_INDEXED: return 1;
+		case LAYERTYPE_INDEXEDA: return 2;
+		default: return 0;
+	}
 }
 
-void
-hardlight (guchar *rgb0, guchar *rgb1) //if x2 < 0.5 then 2*x1*x2 else 1-2*(1-x1)(1-x2)
+/*
+ * Parse the RLE op at *src, producing at most left bytes, and move *src past
+ * it. Returns its length, or 0 if the data is corrupt. Literals point
+ * *literal to their bytes, runs set it to NULL and their byte in *value.
+ */
+static inline int
+rle_op (const guchar **src, const guchar *end, int left, const guchar **literal, guchar *value)
 {
-	rgb1[0] = rgb1[0] < 0x80 ? 2 * rgb0[0] * rgb1[0] / 0xff : 0xff - 2 * (0xff - rgb0[0]) * (0xff - rgb1[0])/ 0xff;
-	rgb1[1] = rgb1[1] < 0x80 ? 2 * rgb0[1] * rgb1[1] / 0xff : 0xff - 2 * (0xff - rgb0[1]) * (0xff - rgb1[1])/ 0xff;
-	rgb1[2] = rgb1[2] < 0x80 ? 2 * rgb0[2] * rgb1[2] / 0xff : 0xff - 2 * (0xff - rgb0[2]) * (0xff - rgb1[2])/ 0xff;
+	const guchar *p = *src;
+	int length;
+
+	if (p >= end)
+		return 0;
+	guchar opcode = *p++;
+	if (opcode <= 126) { //short run
+		length = opcode + 1;
+		if (p + 1 > end)
+			return 0;
+		*literal = NULL;
+		*value = *p++;
+	} else if (opcode == 127) { //long run
+		if (p + 3 > end)
+			return 0;
+		length = p[0]*256 + p[1];
+		*literal = NULL;
+		*value = p[2];
+		p += 3;
+	} else if (opcode == 128) { //long literal
+		if (p + 2 > end)
+			return 0;
+		length = p[0]*256 + p[1];
+		p += 2;
+		if (p + length > end)
+			return 0;
+		*literal = p;
+		p += length;
+	} else { //short literal
+		length = 256 - opcode;
+		if (p + length > end)
+			return 0;
+		*literal = p;
+		p += length;
+	}
+	if (length > left)
+		return 0;
+	*src = p;
+	return length;
 }
 
-void
+/*
+ * un-rle count pixels of a tile from the [src, end[ span, into channels planes
+ * of count bytes. Returns a pointer past the last consumed byte, or NULL if
+ * the data is corrupt.
+ */
+const guchar*
+rle_decode (const guchar *src, const guchar *end, guchar *planes, int count, int channels)
+{
+	int channel;
+
+	for (channel = 0; channel < channels; channel++) {
+		guchar *dest = planes + channel * count;
+		guchar *dest_end = dest + count;
+		while (dest < dest_end) {
+			const guchar *literal;
+			guchar value;
+			int length = rle_op (&src, end, dest_end - dest, &literal, &value);
+			if (!length)
+				return NULL;
+			if (literal)
+				memcpy (dest, literal, length);
+			else
+				memset (dest, value, length);
+			dest += length;
+		}
+	}
+
+	return src;
+}
+
+/*
+ * Decode a RLE tile of (at most) length bytes at the reader cursor into
+ * planes, and move the cursor past it. A RLE stream is at most 2 bytes per
+ * pixel and channel (runs of length 1).
+ */
+gboolean
+rle_decode_tile (XcfReader *reader, guchar *planes, int count, int channels, gsize length)
+{
+	gsize avail;
+	const guchar *src = xcf_reader_peek_avail (reader, MIN (length, (gsize)(2 * channels * count)), &avail);
+	if (!src)
+		return FALSE;
+
+	const guchar *next = rle_decode (src, src + avail, planes, count, channels);
+	if (!next) {
+		reader->error = TRUE;
+		return FALSE;
+	}
+	xcf_reader_skip (reader, next - src);
+	return TRUE;
+}
+
+/*
+ * Inflate a zlib tile of (at most) length bytes at the reader cursor into
+ * size bytes at dest, and move the cursor past it. Each tile is a zlib
+ * stream of its own, so they're inflated independently, by the z_stream of
+ * the reader (one per rendering thread), reset between tiles.
+ */
+gboolean
+zlib_decode_tile (XcfReader *reader, guchar *dest, gsize size, gsize length)
+{
+	gsize avail;
+	const guchar *src = xcf_reader_peek_avail (reader, length, &avail);
+	if (!src)
+		return FALSE;
+
+	if (!reader->inflate) {
+		reader->inflate = g_try_new0 (z_stream, 1);
+		if (!reader->inflate || inflateInit (reader->inflate) != Z_OK) {
+			g_free (reader->inflate);
+			reader->inflate = NULL;
+			reader->error = TRUE;
+			return FALSE;
+		}
+	} else
+		inflateReset (reader->inflate);
+
+	z_stream *stream = reader->inflate;
+	stream->next_in = (Bytef*)src;
+	stream->avail_in = avail;
+	stream->next_out = dest;
+	stream->avail_out = size;
+	if (inflate (stream, Z_FINISH) != Z_STREAM_END || stream->avail_out) {
+		reader->error = TRUE;
+		return FALSE;
+	}
+	xcf_reader_skip (reader, stream->total_in);
+	return TRUE;
+}
+
+/*
+ * Planar to packed RGBA. Every layer type boils down to interleaving 4
+ * planes: grayscale uses the same plane for r, g and b, and missing alpha
+ * channels come from an opaque plane.
+ */
+
+typedef void (*interleave_func) (const guchar *r, const guchar *g, const guchar *b, const guchar *a, guchar *dest, int count);
+
+//twice a tile, the high and low bytes of 16 bits components
+static const guchar opaque_plane[2*64*64] = { [0 ... 2*64*64-1] = 0xff };
+
+static void
+interleave_scalar (const guchar *r, const guchar *g, const guchar *b, const guchar *a, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		dest[4*i]     = r[i];
+		dest[4*i + 1] = g[i];
+		dest[4*i + 2] = b[i];
+		dest[4*i + 3] = a[i];
+	}
+}
+
+/*
+ * Planar to packed 16 bits RGBA, for high bit depth integer planes. Each
+ * component is split in a plane of most significant bytes, and a plane of
+ * least significant ones stride bytes further.
+ */
+
+typedef void (*interleave16_func) (const guchar *r, const guchar *g, const guchar *b, const guchar *a, int stride, guint16 *dest, int count);
+
+static void
+interleave16_scalar (const guchar *r, const guchar *g, const guchar *b, const guchar *a, int stride, guint16 *dest, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		dest[4*i]     = r[i] << 8 | r[stride + i];
+		dest[4*i + 1] = g[i] << 8 | g[stride + i];
+		dest[4*i + 2] = b[i] << 8 | b[stride + i];
+		dest[4*i + 3] = a[i] << 8 | a[stride + i];
+	}
+}
+
+/*
+ * Indexed to rgba, the colormap being 256 rgba colors. There's no byte
+ * shuffle wide enough for a 1KB table, but AVX2 gathers 8 colors at once.
+ */
+
+typedef void (*gather_func) (const guchar *colormap, const guchar *indexes, guchar *dest, int count);
+
+static void
+gather_scalar (const guchar *colormap, const guchar *indexes, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+		memcpy (dest + 4*i, colormap + 4 * indexes[i], 4);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static void
+interleave_sse2 (const guchar *r, const guchar *g, const guchar *b, const guchar *a, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m128i vr = _mm_loadu_si128 ((const __m128i*)(r + i));
+		__m128i vg = _mm_loadu_si128 ((const __m128i*)(g + i));
+		__m128i vb = _mm_loadu_si128 ((const __m128i*)(b + i));
+		__m128i va = _mm_loadu_si128 ((const __m128i*)(a + i));
+		__m128i rg_lo = _mm_unpacklo_epi8 (vr, vg);
+		__m128i rg_hi = _mm_unpackhi_epi8 (vr, vg);
+		__m128i ba_lo = _mm_unpacklo_epi8 (vb, va);
+		__m128i ba_hi = _mm_unpackhi_epi8 (vb, va);
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i),      _mm_unpacklo_epi16 (rg_lo, ba_lo));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 16), _mm_unpackhi_epi16 (rg_lo, ba_lo));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 32), _mm_unpacklo_epi16 (rg_hi, ba_hi));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 48), _mm_unpackhi_epi16 (rg_hi, ba_hi));
+	}
+	interleave_scalar (r + i, g + i, b + i, a + i, dest + 4*i, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+interleave_avx2 (const guchar *r, const guchar *g, const guchar *b, const guchar *a, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i + 32 <= count; i += 32) {
+		__m256i vr = _mm256_loadu_si256 ((const __m256i*)(r + i));
+		__m256i vg = _mm256_loadu_si256 ((const __m256i*)(g + i));
+		__m256i vb = _mm256_loadu_si256 ((const __m256i*)(b + i));
+		__m256i va = _mm256_loadu_si256 ((const __m256i*)(a + i));
+		//the unpacks work within 128 bits lanes, so each lane holds 8 pixels out of order
+		__m256i rg_lo = _mm256_unpacklo_epi8 (vr, vg);
+		__m256i rg_hi = _mm256_unpackhi_epi8 (vr, vg);
+		__m256i ba_lo = _mm256_unpacklo_epi8 (vb, va);
+		__m256i ba_hi = _mm256_unpackhi_epi8 (vb, va);
+		__m256i q0 = _mm256_unpacklo_epi16 (rg_lo, ba_lo); //0-3, 16-19
+		__m256i q1 = _mm256_unpackhi_epi16 (rg_lo, ba_lo); //4-7, 20-23
+		__m256i q2 = _mm256_unpacklo_epi16 (rg_hi, ba_hi); //8-11, 24-27
+		__m256i q3 = _mm256_unpackhi_epi16 (rg_hi, ba_hi); //12-15, 28-31
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i),      _mm256_permute2x128_si256 (q0, q1, 0x20));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 32), _mm256_permute2x128_si256 (q2, q3, 0x20));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 64), _mm256_permute2x128_si256 (q0, q1, 0x31));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 96), _mm256_permute2x128_si256 (q2, q3, 0x31));
+	}
+	interleave_sse2 (r + i, g + i, b + i, a + i, dest + 4*i, count - i);
+}
+
+//the unpacks of the low bytes with the high ones make little endian words
+__attribute__((target("sse2"))) static __m128i
+load16_sse2 (const guchar *p, int stride)
+{
+	return _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i*)(p + stride)), _mm_loadl_epi64 ((const __m128i*)p));
+}
+
+__attribute__((target("sse2"))) static void
+interleave16_sse2 (const guchar *r, const guchar *g, const guchar *b, const guchar *a, int stride, guint16 *dest, int count)
+{
+	int i;
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i vr = load16_sse2 (r + i, stride);
+		__m128i vg = load16_sse2 (g + i, stride);
+		__m128i vb = load16_sse2 (b + i, stride);
+		__m128i va = load16_sse2 (a + i, stride);
+		__m128i rg_lo = _mm_unpacklo_epi16 (vr, vg);
+		__m128i rg_hi = _mm_unpackhi_epi16 (vr, vg);
+		__m128i ba_lo = _mm_unpacklo_epi16 (vb, va);
+		__m128i ba_hi = _mm_unpackhi_epi16 (vb, va);
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i),      _mm_unpacklo_epi32 (rg_lo, ba_lo));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 8),  _mm_unpackhi_epi32 (rg_lo, ba_lo));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 16), _mm_unpacklo_epi32 (rg_hi, ba_hi));
+		_mm_storeu_si128 ((__m128i*)(dest + 4*i + 24), _mm_unpackhi_epi32 (rg_hi, ba_hi));
+	}
+	interleave16_scalar (r + i, g + i, b + i, a + i, stride, dest + 4*i, count - i);
+}
+
+__attribute__((target("avx2"))) static __m256i
+load16_avx2 (const guchar *p, int stride)
+{
+	__m256i hi = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i*)p));
+	__m256i lo = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i*)(p + stride)));
+	return _mm256_or_si256 (_mm256_slli_epi16 (hi, 8), lo);
+}
+
+__attribute__((target("avx2"))) static void
+interleave16_avx2 (const guchar *r, const guchar *g, const guchar *b, const guchar *a, int stride, guint16 *dest, int count)
+{
+	int i;
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i vr = load16_avx2 (r + i, stride);
+		__m256i vg = load16_avx2 (g + i, stride);
+		__m256i vb = load16_avx2 (b + i, stride);
+		__m256i va = load16_avx2 (a + i, stride);
+		//as in interleave_avx2, each lane holds 8 pixels out of order
+		__m256i rg_lo = _mm256_unpacklo_epi16 (vr, vg);
+		__m256i rg_hi = _mm256_unpackhi_epi16 (vr, vg);
+		__m256i ba_lo = _mm256_unpacklo_epi16 (vb, va);
+		__m256i ba_hi = _mm256_unpackhi_epi16 (vb, va);
+		__m256i q0 = _mm256_unpacklo_epi32 (rg_lo, ba_lo); //0-1, 8-9
+		__m256i q1 = _mm256_unpackhi_epi32 (rg_lo, ba_lo); //2-3, 10-11
+		__m256i q2 = _mm256_unpacklo_epi32 (rg_hi, ba_hi); //4-5, 12-13
+		__m256i q3 = _mm256_unpackhi_epi32 (rg_hi, ba_hi); //6-7, 14-15
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i),      _mm256_permute2x128_si256 (q0, q1, 0x20));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 16), _mm256_permute2x128_si256 (q2, q3, 0x20));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 32), _mm256_permute2x128_si256 (q0, q1, 0x31));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i + 48), _mm256_permute2x128_si256 (q2, q3, 0x31));
+	}
+	interleave16_sse2 (r + i, g + i, b + i, a + i, stride, dest + 4*i, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+gather_avx2 (const guchar *colormap, const guchar *indexes, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i*)(indexes + i)));
+		_mm256_storeu_si256 ((__m256i*)(dest + 4*i), _mm256_i32gather_epi32 ((const int*)colormap, index, 4));
+	}
+	gather_scalar (colormap, indexes + i, dest + 4*i, count - i);
+}
+#endif
+
+static interleave_func interleave = interleave_scalar;
+static interleave16_func interleave16 = interleave16_scalar;
+static gather_func gather = gather_scalar;
+
+//count pixels of planes stride bytes apart to rgba
+void
+planes_to_rgba (const guchar *planes, int stride, int count, int type, guchar *dest)
+{
+	const guchar *p0 = planes;
+	const guchar *p1 = planes + stride;
+	const guchar *p2 = planes + 2 * stride;
+	const guchar *p3 = planes + 3 * stride;
+
+	switch (type) {
+	case LAYERTYPE_RGB:
+		interleave (p0, p1, p2, opaque_plane, dest, count);
+		break;
+	case LAYERTYPE_RGBA:
+		interleave (p0, p1, p2, p3, dest, count);
+		break;
+	case LAYERTYPE_GRAYSCALE:
+		interleave (p0, p0, p0, opaque_plane, dest, count);
+		break;
+	case LAYERTYPE_GRAYSCALEA:
+		interleave (p0, p0, p0, p1, dest, count);
+		break;
+	}
+}
+
+/*
+ * un-rle count pixels of an indexed tile straight to rgba, looking the
+ * indexes up in colormap as they're decoded: runs fill a single color, and
+ * literals are a gather. The alpha plane, if any, then goes to the 4th bytes.
+ */
+const guchar*
+rle_decode_indexed (const guchar *src, const guchar *end, const guchar *colormap, guchar *dest, int count, gboolean alpha)
+{
+	int i, j;
+
+	for (i = 0; i < count;) {
+		const guchar *literal;
+		guchar value;
+		int length = rle_op (&src, end, count - i, &literal, &value);
+		if (!length)
+			return NULL;
+		if (literal)
+			gather (colormap, literal, dest + 4 * i, length);
+		else {
+			guint32 color;
+			memcpy (&color, colormap + 4 * value, 4);
+			for (j = 0; j < length; j++)
+				memcpy (dest + 4 * (i + j), &color, 4);
+		}
+		i += length;
+	}
+
+	for (i = 0; alpha && i < count;) {
+		const guchar *literal;
+		guchar value;
+		int length = rle_op (&src, end, count - i, &literal, &value);
+		if (!length)
+			return NULL;
+		if (literal)
+			for (j = 0; j < length; j++)
+				dest[4 * (i + j) + 3] = literal[j];
+		else
+			for (j = 0; j < length; j++)
+				dest[4 * (i + j) + 3] = value;
+		i += length;
+	}
+
+	return src;
+}
+
+//rle_decode_tile, for indexed tiles expanded to rgba pixels with colormap
+gboolean
+rle_decode_indexed_tile (XcfReader *reader, const guchar *colormap, guchar *pixels, int count, gboolean alpha, gsize length)
+{
+	gsize avail;
+	const guchar *src = xcf_reader_peek_avail (reader, MIN (length, (gsize)(2 * (alpha ? 2 : 1) * count)), &avail);
+	if (!src)
+		return FALSE;
+
+	const guchar *next = rle_decode_indexed (src, src + avail, colormap, pixels, count, alpha);
+	if (!next) {
+		reader->error = TRUE;
+		return FALSE;
+	}
+	xcf_reader_skip (reader, next - src);
+	return TRUE;
+}
+
+int
+precision_size (guint32 precision)
+{
+	switch (precision) {
+		case PRECISION_U8: return 1;
+		case PRECISION_U16: return 2;
+		case PRECISION_U32: return 4;
+		case PRECISION_HALF: return 2;
+		case PRECISION_FLOAT: return 4;
+		default: return 0;
+	}
+}
+
+/*
+ * High bit depth components are composited in 16 bits, and only narrowed to
+ * 8 bits with the whole canvas (see unpremultiply_row). Linear light color
+ * components are encoded to sRGB on the way, alpha channels and masks are
+ * linear in every precision. Integers keep their 16 most significant bits,
+ * and the linear ones, as well as half floats, go through tables built once
+ * the first high bit depth file shows up.
+ */
+
+static guint16 linear_to_srgb[65536];		//indexed by a 16 bits linear component
+static guint16 half_to_u16[65536];		//indexed by the bits of a half float
+static guint16 half_linear_to_srgb[65536];
+
+static float
+half_to_float (guint16 half)
+{
+	int exponent = (half >> 10) & 0x1f;
+	int mantissa = half & 0x3ff;
+	float value;
+
+	if (exponent == 0) //subnormal
+		value = ldexpf (mantissa, -24);
+	else if (exponent == 0x1f)
+		value = mantissa ? NAN : INFINITY;
+	else
+		value = ldexpf (mantissa | 0x400, exponent - 25);
+	return half & 0x8000 ? -value : value;
+}
+
+static guint16
+float_to_u16 (float value, gboolean linear)
+{
+	if (!(value > 0.0f)) //and NaN
+		return 0;
+	if (value >= 1.0f)
+		return 0xffff;
+	guint16 v = value * 65535.0f + 0.5f;
+	return linear ? linear_to_srgb[v] : v;
+}
+
+static void
+precision_init (void)
+{
+	static gsize initialized = 0;
+	int i;
+
+	if (!g_once_init_enter (&initialized))
+		return;
+
+	for (i = 0; i < 65536; i++) {
+		double v = i / 65535.0;
+		v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow (v, 1 / 2.4) - 0.055;
+		linear_to_srgb[i] = (guint16)(65535.0 * v + 0.5);
+	}
+	for (i = 0; i < 65536; i++) {
+		half_to_u16[i] = float_to_u16 (half_to_float (i), FALSE);
+		half_linear_to_srgb[i] = float_to_u16 (half_to_float (i), TRUE);
+	}
+
+	g_once_init_leave (&initialized, 1);
+}
+
+/*
+ * Convert count components of precision at src to 16 bits at dest. The
+ * bytes of a component are big endian, byte_stride apart, and the components
+ * are src_stride bytes apart at src, dest_stride at dest. If linear, they're
+ * encoded to sRGB.
+ */
+static void
+components_to_u16 (const guchar *src, int byte_stride, int src_stride, guint16 *dest, int dest_stride, int count, guint32 precision, gboolean linear)
+{
+	const guint16 *lut;
+	int i;
+
+	switch (precision) {
+	case PRECISION_U16:
+	case PRECISION_U32:
+		if (linear)
+			for (i = 0; i < count; i++, src += src_stride, dest += dest_stride)
+				*dest = linear_to_srgb[src[0] << 8 | src[byte_stride]];
+		else
+			for (i = 0; i < count; i++, src += src_stride, dest += dest_stride)
+				*dest = src[0] << 8 | src[byte_stride];
+		break;
+	case PRECISION_HALF:
+		lut = linear ? half_linear_to_srgb : half_to_u16;
+		for (i = 0; i < count; i++, src += src_stride, dest += dest_stride)
+			*dest = lut[src[0] << 8 | src[byte_stride]];
+		break;
+	case PRECISION_FLOAT:
+		for (i = 0; i < count; i++, src += src_stride, dest += dest_stride) {
+			guint32 bits = (guint32)src[0] << 24 | src[byte_stride] << 16 | src[2 * byte_stride] << 8 | src[3 * byte_stride];
+			float value;
+			memcpy (&value, &bits, sizeof (float));
+			*dest = float_to_u16 (value, linear);
+		}
+		break;
+	}
+}
+
+/*
+ * Convert count high bit depth pixels of a layer of type to straight 16 bits
+ * rgba pixels at dest. The bytes of channel c of pixel i start at src + c *
+ * channel_stride + i * pixel_stride, byte_stride apart: the planes of a RLE
+ * tile, or interleaved pixels. Indexed layers don't come in high bit depths,
+ * corrupt ones are read as grayscale.
+ */
+void
+pixels_to_rgba16 (const guchar *src, int channel_stride, int byte_stride, int pixel_stride, guint16 *dest, int count, int type, guint32 precision, gboolean linear)
+{
+	int channels = layer_channels (type);
+	gboolean gray = type != LAYERTYPE_RGB && type != LAYERTYPE_RGBA;
+	gboolean alpha = channels == 2 || channels == 4;
+	int c, i;
+
+	//integer planes are already 16 bits values, split in two planes of bytes
+	if (pixel_stride == 1 && !linear && (precision == PRECISION_U16 || precision == PRECISION_U32)) {
+		const guchar *a = alpha ? src + (channels - 1) * channel_stride : opaque_plane;
+		if (gray)
+			interleave16 (src, src, src, a, byte_stride, dest, count);
+		else
+			interleave16 (src, src + channel_stride, src + 2 * channel_stride, a, byte_stride, dest, count);
+		return;
+	}
+
+	for (c = 0; c < channels; c++) {
+		int k = alpha && c == channels - 1 ? 3 : c;
+		components_to_u16 (src + c * channel_stride, byte_stride, pixel_stride, dest + k, 4, count, precision, linear && k < 3);
+	}
+	for (i = 0; i < count; i++, dest += 4) {
+		if (gray)
+			dest[1] = dest[2] = dest[0];
+		if (!alpha)
+			dest[3] = 0xffff;
+	}
+}
+
+static void
+xcf_buffer_init (XcfBuffer *buffer, gsize size_hint)
+{
+	const gchar *env = g_getenv ("IO_XCF_MEMORY_LIMIT");
+	guint64 limit = env ? g_ascii_strtoull (env, NULL, 10) : XCF_MEMORY_LIMIT;
+
+	limit = MIN (limit, G_MAXUINT >> 20);
+	buffer->limit = limit * 1024 * 1024;
+	buffer->data = g_byte_array_sized_new (MIN (size_hint, MIN (buffer->limit, XCF_BUFFER_PREALLOC * 1024 * 1024)));
+	buffer->file = NULL;
+}
+
+static void
+xcf_buffer_clear (XcfBuffer *buffer)
+{
+	if (buffer->data)
+		g_byte_array_free (buffer->data, TRUE);
+	if (buffer->file)
+		fclose (buffer->file);
+	buffer->data = NULL;
+	buffer->file = NULL;
+}
+
+static gboolean
+xcf_buffer_spill (XcfBuffer *buffer, GError **error)
+{
+	gchar *tempname;
+	gint fd = g_file_open_tmp ("gdkpixbuf-xcf-tmp.XXXXXX", &tempname, NULL);
+	if (fd < 0) {
+		gint save_errno = errno;
+		g_set_error (error,
+				G_FILE_ERROR,
+				g_file_error_from_errno (save_errno),
+				"Failed to create temporary file when loading Xcf image");
+		return FALSE;
+	}
+	g_unlink (tempname);
+	g_free (tempname);
+
+	LOG ("spilling %d bytes to disk\n", buffer->data->len);
+	buffer->file = fdopen (fd, "w+");
+	if (!buffer->file ||
+	    fwrite (buffer->data->data, sizeof (guchar), buffer->data->len, buffer->file) != buffer->data->len) {
+		gint save_errno = errno;
+		g_set_error (error,
+				G_FILE_ERROR,
+				g_file_error_from_errno (save_errno),
+				"Failed to write to temporary file when loading Xcf image");
+		//the data is still in memory, and the buffer isn't spilled
+		if (buffer->file)
+			fclose (buffer->file);
+		else
+			close (fd);
+		buffer->file = NULL;
+		return FALSE;
+	}
+
+	g_byte_array_free (buffer->data, TRUE);
+	buffer->data = NULL;
+	return TRUE;
+}
+
+/*
+ * Make room for len more bytes, and set *dest to where to write them, or to
+ * NULL once the buffer is spilled to disk. Returns FALSE if it can't spill.
+ */
+static gboolean
+xcf_buffer_reserve (XcfBuffer *buffer, gsize len, guchar **dest, GError **error)
+{
+	*dest = NULL;
+	if (!buffer->data)
+		return TRUE;
+
+	if (buffer->data->len + len > buffer->limit)
+		return xcf_buffer_spill (buffer, error);
+
+	guint old_len = buffer->data->len;
+	g_byte_array_set_size (buffer->data, old_len + len);
+	buffer->data->len = old_len;
+	*dest = buffer->data->data + old_len;
+	return TRUE;
+}
+
+//commit len bytes previously written at the place returned by xcf_buffer_reserve
+static void
+xcf_buffer_commit (XcfBuffer *buffer, gsize len)
+{
+	buffer->data->len += len;
+}
+
+static gboolean
+xcf_buffer_append (XcfBuffer *buffer, const guchar *data, gsize len, GError **error)
+{
+	guchar *dest;
+	if (!xcf_buffer_reserve (buffer, len, &dest, error))
+		return FALSE;
+	if (dest) {
+		memcpy (dest, data, len);
+		xcf_buffer_commit (buffer, len);
+		return TRUE;
+	}
+
+	if (fwrite (data, sizeof (guchar), len, buffer->file) != len) {
+		gint save_errno = errno;
+		g_set_error (error,
+				G_FILE_ERROR,
+				g_file_error_from_errno (save_errno),
+				"Failed to write to temporary file when loading Xcf image");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+xcf_buffer_open_reader (XcfBuffer *buffer, XcfReader *reader, GError **error)
+{
+	if (buffer->data) {
+		xcf_reader_init_memory (reader, buffer->data->data, buffer->data->len);
+		return TRUE;
+	}
+
+	fflush (buffer->file);
+	rewind (buffer->file);
+	if (!xcf_reader_init_file (reader, buffer->file)) {
+		g_set_error (error,
+			     GDK_PIXBUF_ERROR,
+			     GDK_PIXBUF_ERROR_FAILED,
+			     "Failed to read XCF file");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+#if GIO_2_23
+/*
+ * Run size bytes of compressed data through the decompressor, straight into
+ * the buffer. Sets *finished when the end of the compressed stream is reached.
+ */
+static gboolean
+xcf_buffer_append_converted (XcfBuffer *buffer, GConverter *decompressor,
+			     const guchar *buf, gsize size, GConverterFlags flags,
+			     gboolean *finished, GError **error)
+{
+	while (1) {
+		GConverterResult result;
+		gsize bytes_read = 0, bytes_written = 0;
+		guchar outbuf [65536];
+		guchar *dest;
+		if (!xcf_buffer_reserve (buffer, sizeof (outbuf), &dest, error))
+			return FALSE;
+
+		GError *local_error = NULL;
+		result = g_converter_convert (decompressor, buf, size, dest ? dest : outbuf, sizeof (outbuf),
+					      flags, &bytes_read, &bytes_written, &local_error);
+		if (result == G_CONVERTER_ERROR) {
+			//nothing left to convert until more input comes in
+			if (size == 0 && g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+				g_error_free (local_error);
+				return TRUE;
+			}
+			g_propagate_error (error, local_error);
+			return FALSE;
+		}
+
+		if (dest)
+			xcf_buffer_commit (buffer, bytes_written);
+		else if (!xcf_buffer_append (buffer, outbuf, bytes_written, error))
+			return FALSE;
+
+		buf += bytes_read;
+		size -= bytes_read;
+		if (result == G_CONVERTER_FINISHED) {
+			*finished = TRUE;
+			return TRUE;
+		}
+		//all the input is consumed, and the output is flushed
+		if (size == 0 && bytes_written < sizeof (outbuf))
+			return TRUE;
+	}
+}
+#endif
+
+void
+to_rgba (gchar *ptr, int count, int type, const guchar *colormap)
+{
+	//pad to rgba, or look the indexes up in colormap, backwards as it's in place
+	int i;
+
+	switch (type) {
+	case LAYERTYPE_RGB:
+		for (i=count-1; i>=0;i--) {
+			memmove (ptr + 4*i, ptr + 3*i, 3);
+			ptr[4*i + 3] = 0xff;
+		}
+		break;
+	case LAYERTYPE_RGBA:
+		///nothing to do
+		break;
+	case LAYERTYPE_GRAYSCALE:
+		for (i=count-1; i>=0;i--) {
+			memset (ptr + 4*i, ptr[i], 3);
+			ptr[4*i + 3] = 0xff;
+		}
+		break;
+	case LAYERTYPE_GRAYSCALEA:
+		for (i=count-1; i>=0;i--) {
+			ptr[4*i + 3] = ptr[2*i + 1];
+			memset (ptr + 4*i, ptr[2*i], 3);
+		}
+		break;
+	case LAYERTYPE_INDEXED:
+		for (i=count-1; i>=0;i--)
+			memcpy (ptr + 4*i, colormap + 4 * (guchar)ptr[i], 4);
+		break;
+	case LAYERTYPE_INDEXEDA:
+		for (i=count-1; i>=0;i--) {
+			ptr[4*i + 3] = ptr[2*i + 1];
+			memcpy (ptr + 4*i, colormap + 4 * (guchar)ptr[2*i], 3);
+		}
+		break;
+	}
+}
+
+/*
+ * Decode tile tile_id of mask, size pixels, to a plane of 8 bits values, or
+ * of 16 bits ones for the high bit depths. Those are read to wide first, 4 *
+ * size bytes. Returns FALSE if the tile is missing.
+ */
+gboolean
+decode_mask (XcfReader *reader, gchar compression, guint32 precision, XcfChannel *mask, int tile_id, int size, guchar *plane, guchar *wide)
+{
+	if (tile_id >= mask->tiles.count || !mask->tiles.offsets[tile_id])
+		return FALSE;
+	xcf_reader_seek (reader, mask->tiles.offsets[tile_id]);
+
+	int bytes = precision_size (precision);
+	guchar *raw = precision != PRECISION_U8 ? wide : plane;
+	if (compression == COMPRESSION_RLE)
+		rle_decode_tile (reader, raw, size, bytes, xcf_tile_length (&mask->tiles, tile_id, reader->length));
+	else if (compression == COMPRESSION_ZLIB)
+		zlib_decode_tile (reader, raw, size * bytes, xcf_tile_length (&mask->tiles, tile_id, reader->length));
+	else //COMPRESSION_NONE
+		xcf_reader_read (reader, raw, size * bytes);
+
+	//planes of bytes for RLE, big endian values otherwise
+	if (precision != PRECISION_U8 && compression == COMPRESSION_RLE)
+		components_to_u16 (wide, size, 1, (guint16*)plane, 1, size, precision, FALSE);
+	else if (precision != PRECISION_U8)
+		components_to_u16 (wide, 1, bytes, (guint16*)plane, 1, size, precision, FALSE);
+	return TRUE;
+}
+
+//the alphas of count rgba pixels, times the mask values
+void
+apply_mask (guchar *pixels, const guchar *mask, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+		pixels[4*i + 3] = pixels[4*i + 3] * mask[i] / 0xff;
+}
+
+void blend (guchar* rgba0, guchar* rgba1)
+{
+	if (rgba0[3] == 0 && rgba1[3] == 0)
+		return;
+
+	guchar k = 0xff * rgba1[3] / (0xff - (0xff-rgba0[3])*(0xff-rgba1[3])/0xff);
+	rgba0[0] = ((0xff - k) * rgba0[0] + k * rgba1[0]) / 0xff;
+	rgba0[1] = ((0xff - k) * rgba0[1] + k * rgba1[1]) / 0xff;
+	rgba0[2] = ((0xff - k) * rgba0[2] + k * rgba1[2]) / 0xff;
+}
+
+typedef void (*composite_func) (guchar* rgb0, guchar* rgb1);
+
+void
+multiply (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = (rgb0[0] * rgb1[0] ) / 0xff;
+	rgb1[1] = (rgb0[1] * rgb1[1] ) / 0xff;
+	rgb1[2] = (rgb0[2] * rgb1[2] ) / 0xff;
+}
+
+void
+screen (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = 0xff - (0xff - rgb0[0]) * (0xff - rgb1[0]) / 0xff;
+	rgb1[1] = 0xff - (0xff - rgb0[1]) * (0xff - rgb1[1]) / 0xff;
+	rgb1[2] = 0xff - (0xff - rgb0[2]) * (0xff - rgb1[2]) / 0xff;
+}
+
+void
+overlay (guchar *rgb0, guchar *rgb1)
+{
+	//FIXME
+	//LOG ("Overlay (%d %d %d) (%d %d %d) : ", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
+	rgb1[0] = MIN (0xff, ((0xff - rgb1[0]) * rgb0[0] * rgb0[0] / 0xff + rgb0[0] * (0xff - (0xff - rgb1[0]) * (0xff - rgb1[0]) / 0xff)) / 0xff);
+	rgb1[1] = MIN (0xff, ((0xff - rgb1[1]) * rgb0[1] * rgb0[1] / 0xff + rgb0[1] * (0xff - (0xff - rgb1[1]) * (0xff - rgb1[1]) / 0xff)) / 0xff);
+	rgb1[2] = MIN (0xff, ((0xff - rgb1[2]) * rgb0[2] * rgb0[2] / 0xff + rgb0[2] * (0xff - (0xff - rgb1[2]) * (0xff - rgb1[2]) / 0xff)) / 0xff);
+	//LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+}
+
+void
+difference (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = (rgb0[0] > rgb1[0]) ? rgb0[0] - rgb1[0] : rgb1[0] - rgb0[0];
+	rgb1[1] = (rgb0[1] > rgb1[1]) ? rgb0[1] - rgb1[1] : rgb1[1] - rgb0[1];
+	rgb1[2] = (rgb0[2] > rgb1[2]) ? rgb0[2] - rgb1[2] : rgb1[2] - rgb0[2];
+}
+
+void
+addition (guchar *rgb0, guchar *rgb1)
+{
+//	LOG ("addition (%d %d %d) (%d %d %d):", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
+	rgb1[0] = (rgb0[0] + rgb1[0]) > 0xff ? 0xff : rgb0[0] + rgb1[0];
+	rgb1[1] = (rgb0[1] + rgb1[1]) > 0xff ? 0xff : rgb0[1] + rgb1[1];
+	rgb1[2] = (rgb0[2] + rgb1[2]) > 0xff ? 0xff : rgb0[2] + rgb1[2];
+//	LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+}
+
+void
+subtract (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = (rgb0[0] - rgb1[0]) < 0 ? 0 : rgb0[0] - rgb1[0];
+	rgb1[1] = (rgb0[1] - rgb1[1]) < 0 ? 0 : rgb0[1] - rgb1[1];
+	rgb1[2] = (rgb0[2] - rgb1[2]) < 0 ? 0 : rgb0[2] - rgb1[2];
+}
+
+void
+min (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = MIN (rgb0[0], rgb1[0]);
+	rgb1[1] = MIN (rgb0[1], rgb1[1]);
+	rgb1[2] = MIN (rgb0[2], rgb1[2]);
+}
+
+void
+max (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = MAX (rgb0[0], rgb1[0]);
+	rgb1[1] = MAX (rgb0[1], rgb1[1]);
+	rgb1[2] = MAX (rgb0[2], rgb1[2]);
+}
+
+void
+divide (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = rgb1[0] == 0 ? (rgb0[0] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[0] / rgb1[0]);
+	rgb1[1] = rgb1[1] == 0 ? (rgb0[1] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[1] / rgb1[1]);
+	rgb1[2] = rgb1[2] == 0 ? (rgb0[2] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[2] / rgb1[2]);
+}
+
+void
+dodge (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = rgb1[0] == 0xff ? (rgb0[0] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[0] / (0xff - rgb1[0]));
+	rgb1[1] = rgb1[1] == 0xff ? (rgb0[1] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[1] / (0xff - rgb1[1]));
+	rgb1[2] = rgb1[2] == 0xff ? (rgb0[2] == 0 ? 0 : 0xff) : MIN (0xff, 0xff * rgb0[2] / (0xff - rgb1[2]));
+}
+
+void
+burn (guchar *rgb0, guchar *rgb1) // 1-(1-x1)/x2
+{
+	rgb1[0] = rgb1[0] == 0 ? (rgb0[0] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[0]) / rgb1[0]);
+	rgb1[1] = rgb1[1] == 0 ? (rgb0[1] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[1]) / rgb1[1]);
+	rgb1[2] = rgb1[2] == 0 ? (rgb0[2] == 0xff ? 0xff : 0) : 0xff - MIN (0xff, 0xff * (0xff - rgb0[2]) / rgb1[2]);
+}
+
+void
+hardlight (guchar *rgb0, guchar *rgb1) //if x2 < 0.5 then 2*x1*x2 else 1-2*(1-x1)(1-x2)
+{
+	rgb1[0] = rgb1[0] < 0x80 ? 2 * rgb0[0] * rgb1[0] / 0xff : 0xff - 2 * (0xff - rgb0[0]) * (0xff - rgb1[0])/ 0xff;
+	rgb1[1] = rgb1[1] < 0x80 ? 2 * rgb0[1] * rgb1[1] / 0xff : 0xff - 2 * (0xff - rgb0[1]) * (0xff - rgb1[1])/ 0xff;
+	rgb1[2] = rgb1[2] < 0x80 ? 2 * rgb0[2] * rgb1[2] / 0xff : 0xff - 2 * (0xff - rgb0[2]) * (0xff - rgb1[2])/ 0xff;
+}
+
+void
 softlight(guchar *rgb0, guchar *rgb1)
 {
-	//FIXME
-	//LOG ("Softlight (%d %d %d) (%d %d %d) : ", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
-	rgb1[0] = ((0xff - rgb0[0]) * rgb0[0] * rgb1[0] / 0xff + rgb0[0] * (0xff - (0xff - rgb1[0]) * (0xff - rgb0[0]) / 0x100)) / 0x100;
-	rgb1[1] = ((0xff - rgb0[1]) * rgb0[1] * rgb1[1] / 0xff + rgb0[1] * (0xff - (0xff - rgb1[1]) * (0xff - rgb0[1]) / 0x100)) / 0x100;
-	rgb1[2] = ((0xff - rgb0[2]) * rgb0[2] * rgb1[2] / 0xff + rgb0[2] * (0xff - (0xff - rgb1[2]) * (0xff - rgb0[2]) / 0x100)) / 0x100;
-	//LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+	//FIXME
+	//LOG ("Softlight (%d %d %d) (%d %d %d) : ", rgb0[0], rgb0[1], rgb0[2], rgb1[0], rgb1[1], rgb1[2]);
+	rgb1[0] = ((0xff - rgb0[0]) * rgb0[0] * rgb1[0] / 0xff + rgb0[0] * (0xff - (0xff - rgb1[0]) * (0xff - rgb0[0]) / 0x100)) / 0x100;
+	rgb1[1] = ((0xff - rgb0[1]) * rgb0[1] * rgb1[1] / 0xff + rgb0[1] * (0xff - (0xff - rgb1[1]) * (0xff - rgb0[1]) / 0x100)) / 0x100;
+	rgb1[2] = ((0xff - rgb0[2]) * rgb0[2] * rgb1[2] / 0xff + rgb0[2] * (0xff - (0xff - rgb1[2]) * (0xff - rgb0[2]) / 0x100)) / 0x100;
+	//LOG ("(%d %d %d)\n", rgb1[0], rgb1[1], rgb1[2]);
+}
+
+void
+grainextract (guchar *rgb0, guchar *rgb1) //x1-x2+.5
+{
+	rgb1[0] = MAX (0, MIN (0xff, rgb0[0] - rgb1[0] + 0x80));
+	rgb1[1] = MAX (0, MIN (0xff, rgb0[1] - rgb1[1] + 0x80));
+	rgb1[2] = MAX (0, MIN (0xff, rgb0[2] - rgb1[2] + 0x80));
+}
+
+void
+grainmerge (guchar *rgb0, guchar *rgb1)
+{
+	rgb1[0] = MAX (0, MIN (0xff, rgb0[0] + rgb1[0] - 0x80));
+	rgb1[1] = MAX (0, MIN (0xff, rgb0[1] + rgb1[1] - 0x80));
+	rgb1[2] = MAX (0, MIN (0xff, rgb0[2] + rgb1[2] - 0x80));
+}
+
+
+/*
+ * The hsv modes map the channels of one pixel linearly onto the range of
+ * the other one, which keeps the hue of the first. Each one is a handful of
+ * products of 8 bits values, divided by a per pixel denominator with a
+ * single reciprocal, all in fixed point.
+ */
+
+//ceil (2^31 / d), for 0 < d
+static inline guint32
+recip31 (guint32 d)
+{
+	return 0x7fffffff / d + 1;
+}
+
+//(n + d / 2) / d, m being recip31 (d), exact as long as (n + d) * d < 2^31
+static inline guint32
+div_round (guint32 n, guint32 d, guint32 m)
+{
+	return ((guint64)(n + (d >> 1)) * m) >> 31;
+}
+
+#define MIN3(rgb)	MIN (MIN ((rgb)[0], (rgb)[1]), (rgb)[2])
+#define MAX3(rgb)	MAX (MAX ((rgb)[0], (rgb)[1]), (rgb)[2])
+
+void
+hue (guchar *rgb0, guchar *rgb1)
+{
+	//hue of rgb1, saturation and value of rgb0: [min1, max1] to [min0, max0]
+	guint32 min0 = MIN3 (rgb0), max0 = MAX3 (rgb0);
+	guint32 min1 = MIN3 (rgb1), max1 = MAX3 (rgb1);
+	guint32 den = max1 - min1;
+	int i;
+
+	if (den == 0) { //gray rgb1 has no hue
+		rgb1[0] = rgb0[0];
+		rgb1[1] = rgb0[1];
+		rgb1[2] = rgb0[2];
+		return;
+	}
+	guint32 m = recip31 (den);
+	for (i = 0; i < 3; i++)
+		rgb1[i] = min0 + div_round ((rgb1[i] - min1) * (max0 - min0), den, m);
+}
+
+void
+saturation (guchar *rgb0, guchar *rgb1)
+{
+	//hue and value of rgb0, saturation of rgb1: [min0, max0] to
+	//[max0 - span, max0], span being max0 * (max1 - min1) / max1
+	guint32 min0 = MIN3 (rgb0), max0 = MAX3 (rgb0);
+	guint32 min1 = MIN3 (rgb1), max1 = MAX3 (rgb1);
+	guint32 den = MAX (max1, 1);
+	guint32 span = div_round (max0 * (max1 - min1), den, recip31 (den));
+	int i;
+
+	den = max0 - min0;
+	if (den == 0) { //gray rgb0 has a red hue, as in gimp
+		rgb1[0] = max0;
+		rgb1[1] = max0 - span;
+		rgb1[2] = max0 - span;
+		return;
+	}
+	guint32 m = recip31 (den);
+	for (i = 0; i < 3; i++)
+		rgb1[i] = max0 - div_round ((max0 - rgb0[i]) * span, den, m);
+}
+
+void
+value (guchar *rgb0, guchar *rgb1)
+{
+	//hue and saturation of rgb0, value of rgb1: [0, max0] to [0, max1],
+	//black rgb0 being taken as gray
+	guint32 black = MAX3 (rgb0) == 0;
+	guint32 max0 = MAX3 (rgb0) + black, max1 = MAX3 (rgb1);
+	guint32 m = recip31 (max0);
+	int i;
+
+	for (i = 0; i < 3; i++)
+		rgb1[i] = div_round ((rgb0[i] + black) * max1, max0, m);
+}
+
+void
+color (guchar *rgb0, guchar *rgb1)
+{
+	//hue and hsl saturation of rgb1, lightness of rgb0. With sum = min +
+	//max, twice the lightness, and range = MIN (sum, 510 - sum): [min1,
+	//max1] to [min0, max0], scaled by range0 / range1 around sum0 / 2
+	guint32 sum0 = MIN3 (rgb0) + MAX3 (rgb0);
+	guint32 sum1 = MIN3 (rgb1) + MAX3 (rgb1);
+	guint32 range0 = MIN (sum0, 510 - sum0);
+	guint32 range1 = MAX (MIN (sum1, 510 - sum1), 1); //black or white rgb1 is gray
+	guint32 m = recip31 (2 * range1);
+	int i;
+
+	for (i = 0; i < 3; i++)
+		rgb1[i] = div_round ((sum0 - range0) * range1 + (2 * rgb1[i] + range1 - sum1) * range0, 2 * range1, m);
+}
+
+/*
+ * The canvas is composited in a working buffer of premultiplied 16 bits
+ * channels, 0xffff being 1, and converted to the straight alpha 8 bits of
+ * the pixbuf once, when it's done. Opacity and normal mode are
+ * multiply-adds there, without any division by the alpha. The blend modes
+ * are defined on straight colors, so their rows are converted back and
+ * forth around them.
+ */
+
+typedef void (*unpremultiply_row_func) (const guint16 *src, guchar *dest, int count);
+
+//x * y / 0xffff rounded, for x and y up to 0xffff
+static inline guint32
+mul16 (guint32 x, guint32 y)
+{
+	guint32 t = x * y + 0x8000;
+	return (t + (t >> 16)) >> 16;
+}
+
+/*
+ * Row compositing. Every mode composites a row of straight alpha 8 bits src
+ * pixels, times their mask values and the opacity, on a row of the working
+ * buffer with one composite_row_func. key is the hash key of the first
+ * pixel, for dissolve.
+ *
+ * The row functions are inline templates, whose masked and opaque arguments
+ * are constants: COMPOSITE_ROW_VARIANTS builds a function per combination,
+ * without a mask or with one, with any opacity or an opaque one. Each layer
+ * picks its variant once, and the loops have no test left for the mask or
+ * the opacity. Blend modes modify src.
+ */
+
+typedef void (*composite_row_func) (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key);
+
+#define COMPOSITE_ROW_VARIANT(name, suffix, type, masked, opaque)	\
+static void								\
+name##suffix (guint16 *dest, type *src, const type *mask, int count, guint32 opacity, guint32 key) \
+{									\
+	name (dest, src, mask, count, opacity, key, masked, opaque);	\
+}
+
+//of row templates taking type src pixels and mask values
+#define COMPOSITE_ROW_VARIANTS_OF(name, type)				\
+COMPOSITE_ROW_VARIANT (name, _plain, type, FALSE, FALSE)		\
+COMPOSITE_ROW_VARIANT (name, _opaque, type, FALSE, TRUE)		\
+COMPOSITE_ROW_VARIANT (name, _masked, type, TRUE, FALSE)		\
+COMPOSITE_ROW_VARIANT (name, _masked_opaque, type, TRUE, TRUE)
+
+#define COMPOSITE_ROW_VARIANTS(name)	COMPOSITE_ROW_VARIANTS_OF (name, guchar)
+
+//the variants of name, indexed by [masked][opaque]
+#define COMPOSITE_ROW_FUNCS(name) \
+	{ { name##_plain, name##_opaque }, { name##_masked, name##_masked_opaque } }
+
+//the alpha of src pixel i, times its mask value and opacity
+static inline guint32
+src_alpha (const guchar *src, const guchar *mask, int i, guint32 opacity, gboolean masked, gboolean opaque)
+{
+	guint32 a = src[4*i + 3];
+	if (masked)
+		a = a * mask[i] / 0xff;
+	if (!opaque)
+		a = a * opacity / 0xff;
+	return a;
+}
+
+//normal mode: the straight src pixels over dest
+static inline void
+over_row_scalar (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4) {
+		const guchar *s = src + 4 * i;
+		//masked in 8 bits, times the opacity in 16 bits
+		guint32 a = src_alpha (src, mask, i, opacity, masked, TRUE) * 257;
+		if (!opaque)
+			a = mul16 (a, opacity * 257);
+		guint32 inv = 0xffff - a;
+		dest[0] = mul16 (a, s[0] * 257) + mul16 (dest[0], inv);
+		dest[1] = mul16 (a, s[1] * 257) + mul16 (dest[1], inv);
+		dest[2] = mul16 (a, s[2] * 257) + mul16 (dest[2], inv);
+		dest[3] = a + mul16 (dest[3], inv);
+	}
+}
+
+//working buffer pixels to straight alpha 8 bits, the only division by alpha
+static void
+unpremultiply_row_scalar (const guint16 *src, guchar *dest, int count)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4, src += 4) {
+		float k = 255.0f / MAX (src[3], 1);
+		dest[0] = src[0] * k + 0.5f;
+		dest[1] = src[1] * k + 0.5f;
+		dest[2] = src[2] * k + 0.5f;
+		dest[3] = src[3] * (255.0f / 0xffff) + 0.5f;
+	}
+}
+
+//the straight colors of src, premultiplied by the alpha of dest, to dest
+static void
+premultiply_row_scalar (const guchar *src, guint16 *dest, int count)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4, src += 4) {
+		dest[0] = mul16 (dest[3], src[0] * 257);
+		dest[1] = mul16 (dest[3], src[1] * 257);
+		dest[2] = mul16 (dest[3], src[2] * 257);
+	}
+}
+
+/*
+ * Dissolve mode draws each src pixel, opaque, with a probability of its
+ * alpha times opacity. The draws are a hash of the position of the pixel on
+ * the canvas, and of a seed of the layer: they don't depend on the regions
+ * or the threads, and the same file always renders the same pixels.
+ */
+
+//a 32 bits integer hash, with good avalanche
+static inline guint32
+hash32 (guint32 x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+//the pixels of the row drawn from the hashes of key, key + 1...
+static inline void
+dissolve_row_scalar (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4) {
+		guint32 d = ((hash32 (key + i) & 0xffff) * 255) >> 16; //0 to 254
+		if (d >= src_alpha (src, mask, i, opacity, masked, opaque))
+			continue;
+		dest[0] = src[4*i] * 257;
+		dest[1] = src[4*i + 1] * 257;
+		dest[2] = src[4*i + 2] * 257;
+		dest[3] = 0xffff;
+	}
+}
+
+static unpremultiply_row_func unpremultiply_row = unpremultiply_row_scalar;
+
+// 3<=mode<=10 || 15<=mode<=21
+// a0 = a0
+// rgba0 = blend (rgba0, F(rgb0, rgb1), MIN(a0, a1)
+static inline void
+composite_row_scalar (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, gboolean masked, gboolean opaque, composite_func f)
+{
+	guchar row[4 * 64];
+	int i, k;
+
+	for (i = 0; i < count; i += 64, dest += 4 * 64, src += 4 * 64, mask += masked ? 64 : 0) {
+		int n = MIN (64, count - i);
+		unpremultiply_row (dest, row, n);
+		for (k = 0; k < n; k++) {
+			guchar *d = row + 4 * k, *s = src + 4 * k;
+			s[3] = src_alpha (src, mask, k, opacity, masked, opaque);
+			f (d, s);
+			s[3] = MIN (d[3], s[3]);
+			blend (d, s);
+		}
+		premultiply_row_scalar (row, dest, n);
+	}
+}
+
+#define COMPOSITE_ROW_SCALAR(f)						\
+static inline void							\
+composite_row_##f (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque) \
+{									\
+	composite_row_scalar (dest, src, mask, count, opacity, masked, opaque, f); \
+}									\
+COMPOSITE_ROW_VARIANTS (composite_row_##f)
+
+//behind mode is ignored
+static inline void
+behind_row (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+}
+
+COMPOSITE_ROW_VARIANTS (over_row_scalar)
+COMPOSITE_ROW_VARIANTS (dissolve_row_scalar)
+COMPOSITE_ROW_VARIANTS (behind_row)
+
+COMPOSITE_ROW_SCALAR (multiply)
+COMPOSITE_ROW_SCALAR (screen)
+COMPOSITE_ROW_SCALAR (overlay)
+COMPOSITE_ROW_SCALAR (difference)
+COMPOSITE_ROW_SCALAR (addition)
+COMPOSITE_ROW_SCALAR (subtract)
+COMPOSITE_ROW_SCALAR (min)
+COMPOSITE_ROW_SCALAR (max)
+COMPOSITE_ROW_SCALAR (hue)
+COMPOSITE_ROW_SCALAR (saturation)
+COMPOSITE_ROW_SCALAR (color)
+COMPOSITE_ROW_SCALAR (value)
+COMPOSITE_ROW_SCALAR (divide)
+COMPOSITE_ROW_SCALAR (dodge)
+COMPOSITE_ROW_SCALAR (burn)
+COMPOSITE_ROW_SCALAR (hardlight)
+COMPOSITE_ROW_SCALAR (softlight)
+COMPOSITE_ROW_SCALAR (grainextract)
+COMPOSITE_ROW_SCALAR (grainmerge)
+
+//per mode, indexed by [mode][masked][opaque]
+static composite_row_func composite_row_funcs[LAYERMODE_GRAINMERGE + 1][2][2] = {
+	[LAYERMODE_NORMAL]	= COMPOSITE_ROW_FUNCS (over_row_scalar),
+	[LAYERMODE_DISSOLVE]	= COMPOSITE_ROW_FUNCS (dissolve_row_scalar),
+	[LAYERMODE_BEHIND]	= COMPOSITE_ROW_FUNCS (behind_row),
+	[LAYERMODE_MULTIPLY]	= COMPOSITE_ROW_FUNCS (composite_row_multiply),
+	[LAYERMODE_SCREEN]	= COMPOSITE_ROW_FUNCS (composite_row_screen),
+	[LAYERMODE_OVERLAY]	= COMPOSITE_ROW_FUNCS (composite_row_overlay),
+	[LAYERMODE_DIFFERENCE]	= COMPOSITE_ROW_FUNCS (composite_row_difference),
+	[LAYERMODE_ADDITION]	= COMPOSITE_ROW_FUNCS (composite_row_addition),
+	[LAYERMODE_SUBTRACT]	= COMPOSITE_ROW_FUNCS (composite_row_subtract),
+	[LAYERMODE_DARKENONLY]	= COMPOSITE_ROW_FUNCS (composite_row_min),
+	[LAYERMODE_LIGHTENONLY]	= COMPOSITE_ROW_FUNCS (composite_row_max),
+	[LAYERMODE_HUE]		= COMPOSITE_ROW_FUNCS (composite_row_hue),
+	[LAYERMODE_SATURATION]	= COMPOSITE_ROW_FUNCS (composite_row_saturation),
+	[LAYERMODE_COLOR]	= COMPOSITE_ROW_FUNCS (composite_row_color),
+	[LAYERMODE_VALUE]	= COMPOSITE_ROW_FUNCS (composite_row_value),
+	[LAYERMODE_DIVIDE]	= COMPOSITE_ROW_FUNCS (composite_row_divide),
+	[LAYERMODE_DODGE]	= COMPOSITE_ROW_FUNCS (composite_row_dodge),
+	[LAYERMODE_BURN]	= COMPOSITE_ROW_FUNCS (composite_row_burn),
+	[LAYERMODE_HARDLIGHT]	= COMPOSITE_ROW_FUNCS (composite_row_hardlight),
+	[LAYERMODE_SOFTLIGHT]	= COMPOSITE_ROW_FUNCS (composite_row_softlight),
+	[LAYERMODE_GRAINEXTRACT] = COMPOSITE_ROW_FUNCS (composite_row_grainextract),
+	[LAYERMODE_GRAINMERGE]	= COMPOSITE_ROW_FUNCS (composite_row_grainmerge),
+};
+
+/*
+ * High bit depth layers composite rows of straight 16 bits src pixels, with
+ * 16 bits mask values, with a composite_row16_func: nothing is narrowed to 8
+ * bits before unpremultiply_row. Normal and dissolve modes are the same
+ * multiply-adds and draws as in 8 bits, the blend modes are computed in
+ * float on straight colors, 1 being 1.0f.
+ */
+
+typedef void (*composite_row16_func) (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key);
+
+#define COMPOSITE_ROW16_VARIANTS(name)	COMPOSITE_ROW_VARIANTS_OF (name, guint16)
+
+//src_alpha () of 16 bits src pixels and mask values
+static inline guint32
+src_alpha16 (const guint16 *src, const guint16 *mask, int i, guint32 opacity, gboolean masked, gboolean opaque)
+{
+	guint32 a = src[4*i + 3];
+	if (masked)
+		a = mul16 (a, mask[i]);
+	if (!opaque)
+		a = mul16 (a, opacity * 257);
+	return a;
+}
+
+//apply_mask () on 16 bits pixels and mask values
+void
+apply_mask16 (guint16 *pixels, const guint16 *mask, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+		pixels[4*i + 3] = mul16 (pixels[4*i + 3], mask[i]);
+}
+
+static inline void
+over_row16_scalar (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4) {
+		const guint16 *s = src + 4 * i;
+		guint32 a = src_alpha16 (src, mask, i, opacity, masked, opaque);
+		guint32 inv = 0xffff - a;
+		dest[0] = mul16 (a, s[0]) + mul16 (dest[0], inv);
+		dest[1] = mul16 (a, s[1]) + mul16 (dest[1], inv);
+		dest[2] = mul16 (a, s[2]) + mul16 (dest[2], inv);
+		dest[3] = a + mul16 (dest[3], inv);
+	}
+}
+
+static inline void
+dissolve_row16_scalar (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	int i;
+	for (i = 0; i < count; i++, dest += 4) {
+		guint32 d = ((hash32 (key + i) & 0xffff) * 0xffff) >> 16; //0 to 0xfffe
+		if (d >= src_alpha16 (src, mask, i, opacity, masked, opaque))
+			continue;
+		dest[0] = src[4*i];
+		dest[1] = src[4*i + 1];
+		dest[2] = src[4*i + 2];
+		dest[3] = 0xffff;
+	}
+}
+
+static inline void
+behind_row16 (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+}
+
+typedef void (*composite_float_func) (const float *rgb0, float *rgb1);
+
+//a blend mode, expr of x0 and x1, the channels of rgb0 and rgb1
+#define COMPOSITE_FLOAT(name, expr)					\
+static void								\
+name##_float (const float *rgb0, float *rgb1)				\
+{									\
+	int i;								\
+	for (i = 0; i < 3; i++) {					\
+		float x0 = rgb0[i], x1 = rgb1[i];			\
+		rgb1[i] = (expr);					\
+	}								\
+}
+
+COMPOSITE_FLOAT (multiply, x0 * x1)
+COMPOSITE_FLOAT (screen, 1.0f - (1.0f - x0) * (1.0f - x1))
+COMPOSITE_FLOAT (overlay, MIN (1.0f, (1.0f - x1) * x0 * x0 + x0 * (1.0f - (1.0f - x1) * (1.0f - x1))))
+COMPOSITE_FLOAT (difference, fabsf (x0 - x1))
+COMPOSITE_FLOAT (addition, MIN (1.0f, x0 + x1))
+COMPOSITE_FLOAT (subtract, MAX (0.0f, x0 - x1))
+COMPOSITE_FLOAT (min, MIN (x0, x1))
+COMPOSITE_FLOAT (max, MAX (x0, x1))
+COMPOSITE_FLOAT (divide, x1 == 0.0f ? (x0 == 0.0f ? 0.0f : 1.0f) : MIN (1.0f, x0 / x1))
+COMPOSITE_FLOAT (dodge, x1 == 1.0f ? (x0 == 0.0f ? 0.0f : 1.0f) : MIN (1.0f, x0 / (1.0f - x1)))
+COMPOSITE_FLOAT (burn, x1 == 0.0f ? (x0 == 1.0f ? 1.0f : 0.0f) : 1.0f - MIN (1.0f, (1.0f - x0) / x1))
+COMPOSITE_FLOAT (hardlight, x1 < 0.5f ? 2.0f * x0 * x1 : 1.0f - 2.0f * (1.0f - x0) * (1.0f - x1))
+COMPOSITE_FLOAT (softlight, (1.0f - x0) * x0 * x1 + x0 * (1.0f - (1.0f - x1) * (1.0f - x0)))
+COMPOSITE_FLOAT (grainextract, CLAMP (x0 - x1 + 0.5f, 0.0f, 1.0f))
+COMPOSITE_FLOAT (grainmerge, CLAMP (x0 + x1 - 0.5f, 0.0f, 1.0f))
+
+//the hsv modes, as hue () and the next ones without rounding
+static void
+hue_float (const float *rgb0, float *rgb1)
+{
+	float min0 = MIN3 (rgb0), max0 = MAX3 (rgb0);
+	float min1 = MIN3 (rgb1), max1 = MAX3 (rgb1);
+	int i;
+
+	for (i = 0; i < 3; i++)
+		rgb1[i] = max1 == min1 ? rgb0[i] : min0 + (rgb1[i] - min1) * (max0 - min0) / (max1 - min1);
+}
+
+static void
+saturation_float (const float *rgb0, float *rgb1)
+{
+	float min0 = MIN3 (rgb0), max0 = MAX3 (rgb0);
+	float min1 = MIN3 (rgb1), max1 = MAX3 (rgb1);
+	float span = max1 > 0.0f ? max0 * (max1 - min1) / max1 : 0.0f;
+	int i;
+
+	if (max0 == min0) {
+		rgb1[0] = max0;
+		rgb1[1] = max0 - span;
+		rgb1[2] = max0 - span;
+		return;
+	}
+	for (i = 0; i < 3; i++)
+		rgb1[i] = max0 - (max0 - rgb0[i]) * span / (max0 - min0);
+}
+
+static void
+value_float (const float *rgb0, float *rgb1)
+{
+	float max0 = MAX3 (rgb0), max1 = MAX3 (rgb1);
+	int i;
+
+	for (i = 0; i < 3; i++)
+		rgb1[i] = max0 > 0.0f ? rgb0[i] * max1 / max0 : max1;
+}
+
+static void
+color_float (const float *rgb0, float *rgb1)
+{
+	float sum0 = MIN3 (rgb0) + MAX3 (rgb0);
+	float sum1 = MIN3 (rgb1) + MAX3 (rgb1);
+	float range0 = MIN (sum0, 2.0f - sum0);
+	float range1 = MIN (sum1, 2.0f - sum1);
+	int i;
+
+	if (range1 <= 0.0f) //black or white rgb1 is gray, any range maps it to sum0 / 2
+		range1 = 1.0f;
+	for (i = 0; i < 3; i++)
+		rgb1[i] = ((sum0 - range0) * range1 + (2.0f * rgb1[i] + range1 - sum1) * range0) / (2.0f * range1);
+}
+
+//composite_row_scalar () on 16 bits src pixels, in float
+static inline void
+composite_row16_scalar (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, gboolean masked, gboolean opaque, composite_float_func f)
+{
+	int i, c;
+
+	for (i = 0; i < count; i++, dest += 4) {
+		guint32 a0 = dest[3];
+		guint32 a1 = MIN (a0, src_alpha16 (src, mask, i, opacity, masked, opaque));
+		float rgb0[3], rgb1[3];
+		if (a1 == 0)
+			continue;
+		float inv = 1.0f / a0;
+		for (c = 0; c < 3; c++) {
+			rgb0[c] = dest[c] * inv;
+			rgb1[c] = src[4*i + c] * (1.0f / 0xffff);
+		}
+		f (rgb0, rgb1);
+		//blend (), a1 over a0
+		float k0 = a0 * (1.0f / 0xffff), k1 = a1 * (1.0f / 0xffff);
+		float k = k1 / (1.0f - (1.0f - k0) * (1.0f - k1));
+		for (c = 0; c < 3; c++)
+			dest[c] = CLAMP (rgb0[c] + k * (rgb1[c] - rgb0[c]), 0.0f, 1.0f) * a0 + 0.5f;
+	}
+}
+
+#define COMPOSITE_ROW16_FLOAT(f)					\
+static inline void							\
+composite_row16_##f (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque) \
+{									\
+	composite_row16_scalar (dest, src, mask, count, opacity, masked, opaque, f##_float); \
+}									\
+COMPOSITE_ROW16_VARIANTS (composite_row16_##f)
+
+COMPOSITE_ROW16_VARIANTS (over_row16_scalar)
+COMPOSITE_ROW16_VARIANTS (dissolve_row16_scalar)
+COMPOSITE_ROW16_VARIANTS (behind_row16)
+
+COMPOSITE_ROW16_FLOAT (multiply)
+COMPOSITE_ROW16_FLOAT (screen)
+COMPOSITE_ROW16_FLOAT (overlay)
+COMPOSITE_ROW16_FLOAT (difference)
+COMPOSITE_ROW16_FLOAT (addition)
+COMPOSITE_ROW16_FLOAT (subtract)
+COMPOSITE_ROW16_FLOAT (min)
+COMPOSITE_ROW16_FLOAT (max)
+COMPOSITE_ROW16_FLOAT (hue)
+COMPOSITE_ROW16_FLOAT (saturation)
+COMPOSITE_ROW16_FLOAT (color)
+COMPOSITE_ROW16_FLOAT (value)
+COMPOSITE_ROW16_FLOAT (divide)
+COMPOSITE_ROW16_FLOAT (dodge)
+COMPOSITE_ROW16_FLOAT (burn)
+COMPOSITE_ROW16_FLOAT (hardlight)
+COMPOSITE_ROW16_FLOAT (softlight)
+COMPOSITE_ROW16_FLOAT (grainextract)
+COMPOSITE_ROW16_FLOAT (grainmerge)
+
+//composite_row_funcs, for 16 bits src pixels
+static composite_row16_func composite_row16_funcs[LAYERMODE_GRAINMERGE + 1][2][2] = {
+	[LAYERMODE_NORMAL]	= COMPOSITE_ROW_FUNCS (over_row16_scalar),
+	[LAYERMODE_DISSOLVE]	= COMPOSITE_ROW_FUNCS (dissolve_row16_scalar),
+	[LAYERMODE_BEHIND]	= COMPOSITE_ROW_FUNCS (behind_row16),
+	[LAYERMODE_MULTIPLY]	= COMPOSITE_ROW_FUNCS (composite_row16_multiply),
+	[LAYERMODE_SCREEN]	= COMPOSITE_ROW_FUNCS (composite_row16_screen),
+	[LAYERMODE_OVERLAY]	= COMPOSITE_ROW_FUNCS (composite_row16_overlay),
+	[LAYERMODE_DIFFERENCE]	= COMPOSITE_ROW_FUNCS (composite_row16_difference),
+	[LAYERMODE_ADDITION]	= COMPOSITE_ROW_FUNCS (composite_row16_addition),
+	[LAYERMODE_SUBTRACT]	= COMPOSITE_ROW_FUNCS (composite_row16_subtract),
+	[LAYERMODE_DARKENONLY]	= COMPOSITE_ROW_FUNCS (composite_row16_min),
+	[LAYERMODE_LIGHTENONLY]	= COMPOSITE_ROW_FUNCS (composite_row16_max),
+	[LAYERMODE_HUE]		= COMPOSITE_ROW_FUNCS (composite_row16_hue),
+	[LAYERMODE_SATURATION]	= COMPOSITE_ROW_FUNCS (composite_row16_saturation),
+	[LAYERMODE_COLOR]	= COMPOSITE_ROW_FUNCS (composite_row16_color),
+	[LAYERMODE_VALUE]	= COMPOSITE_ROW_FUNCS (composite_row16_value),
+	[LAYERMODE_DIVIDE]	= COMPOSITE_ROW_FUNCS (composite_row16_divide),
+	[LAYERMODE_DODGE]	= COMPOSITE_ROW_FUNCS (composite_row16_dodge),
+	[LAYERMODE_BURN]	= COMPOSITE_ROW_FUNCS (composite_row16_burn),
+	[LAYERMODE_HARDLIGHT]	= COMPOSITE_ROW_FUNCS (composite_row16_hardlight),
+	[LAYERMODE_SOFTLIGHT]	= COMPOSITE_ROW_FUNCS (composite_row16_softlight),
+	[LAYERMODE_GRAINEXTRACT] = COMPOSITE_ROW_FUNCS (composite_row16_grainextract),
+	[LAYERMODE_GRAINMERGE]	= COMPOSITE_ROW_FUNCS (composite_row16_grainmerge),
+};
+
+/*
+ * Vector kernels, built from io-xcf-kernels.h once per instruction set. The
+ * SSE2 ones composite 4 pixels per iteration, the AVX2 ones 8.
+ */
+#if HAVE_X86_SIMD
+#define V_ADD(a, b)		V_OP (add_epi16) (a, b)
+#define V_ADDS(a, b)		V_OP (adds_epu16) (a, b)
+#define V_SUB(a, b)		V_OP (sub_epi16) (a, b)
+#define V_SUBS(a, b)		V_OP (subs_epu16) (a, b)
+#define V_MUL(a, b)		V_OP (mullo_epi16) (a, b)
+#define V_MULHI(a, b)		V_OP (mulhi_epu16) (a, b)
+#define V_SRL(a, n)		V_OP (srli_epi16) (a, n)
+#define V_SLL(a, n)		V_OP (slli_epi16) (a, n)
+#define V_AND(a, b)		V_OP (and_si) (a, b)
+#define V_ANDNOT(m, a)		V_OP (andnot_si) (m, a)
+#define V_OR(a, b)		V_OP (or_si) (a, b)
+#define V_XOR(a, b)		V_OP (xor_si) (a, b)
+#define V_CMPEQ(a, b)		V_OP (cmpeq_epi16) (a, b)
+#define V_CMPGT_S(a, b)		V_OP (cmpgt_epi16) (a, b)
+#define V_MIN_S(a, b)		V_OP (min_epi16) (a, b)
+#define V_MAX_S(a, b)		V_OP (max_epi16) (a, b)
+#define V_SET1(x)		V_OP (set1_epi16) (x)
+#define V_SET1_32(x)		V_OP (set1_epi32) (x)
+#define V_ADD32(a, b)		V_OP (add_epi32) (a, b)
+#define V_ZERO()		V_OP (setzero_si) ()
+#define V_UNPACKLO8(a, b)	V_OP (unpacklo_epi8) (a, b)
+#define V_UNPACKHI8(a, b)	V_OP (unpackhi_epi8) (a, b)
+#define V_UNPACKLO16(a, b)	V_OP (unpacklo_epi16) (a, b)
+#define V_UNPACKHI16(a, b)	V_OP (unpackhi_epi16) (a, b)
+#define V_UNPACKLO32(a, b)	V_OP (unpacklo_epi32) (a, b)
+#define V_UNPACKHI32(a, b)	V_OP (unpackhi_epi32) (a, b)
+#define V_PACKUS16(a, b)	V_OP (packus_epi16) (a, b)
+#define V_PACKS32(a, b)		V_OP (packs_epi32) (a, b)
+#define V_CVTPS(a)		V_OP (cvtepi32_ps) (a)
+#define V_CVTTPS(a)		V_OP (cvttps_epi32) (a)
+#define V_DIVPS(a, b)		V_OP (div_ps) (a, b)
+#define V_MULPS(a, b)		V_OP (mul_ps) (a, b)
+#define V_ADDPS(a, b)		V_OP (add_ps) (a, b)
+#define V_MAXPS(a, b)		V_OP (max_ps) (a, b)
+#define V_SET1PS(x)		V_OP (set1_ps) (x)
+#define V_SHUFFLEPS(a, b, i)	V_OP (shuffle_ps) (a, b, i)
+#define V_SRL32(a, n)		V_OP (srli_epi32) (a, n)
+#define V_SRL64(a, n)		V_OP (srli_epi64) (a, n)
+//the same shuffle of the 4 channels of each pixel
+#define V_SHUFFLE16(a, i)	V_OP (shufflehi_epi16) (V_OP (shufflelo_epi16) (a, i), i)
+//broadcast the alpha of each pixel to its 4 channels
+#define V_ALPHA(a)		V_SHUFFLE16 (a, 0xff)
+//only the 3 color channels of each pixel
+#define V_COLOR_MASK		V_OP (set1_epi64x) (0x0000ffffffffffffLL)
+//only the red channel of each pixel
+#define V_RED_MASK		V_OP (set1_epi64x) (0xffffLL)
+
+#define ISA			"sse2"
+#define F(name)			name##_sse2
+#define V			__m128i
+#define VF			__m128
+#define V_PIXELS		2
+#define V_OP(op)		_mm_##op
+#define _mm_and_si		_mm_and_si128
+#define _mm_andnot_si		_mm_andnot_si128
+#define _mm_or_si		_mm_or_si128
+#define _mm_xor_si		_mm_xor_si128
+#define _mm_setzero_si		_mm_setzero_si128
+#define V_LOAD(p)		_mm_loadu_si128 ((const __m128i*) (p))
+#define V_STORE(p, v)		_mm_storeu_si128 ((__m128i*) (p), v)
+#define V_SPREAD(a)		(a)
+#define V_COLOR32_MASK		_mm_srli_si128 (_mm_set1_epi32 (-1), 4)
+#define V_MUL32(a, b)		mullo_epi32_sse2 (a, b)
+#define V_PIXEL_ORDER		_mm_setr_epi32 (0, 1, 2, 3)
+#define V_LOAD_MASK(p)		load_mask_sse2 (p)
+#define V_LOAD_MASK16(p)	load_mask16_sse2 (p)
+
+//sse2 has no 32 bits low multiply, from the 64 bits products of the even and odd lanes
+__attribute__((target("sse2"))) static inline __m128i
+mullo_epi32_sse2 (__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32 (a, b);
+	__m128i odd = _mm_mul_epu32 (_mm_srli_epi64 (a, 32), _mm_srli_epi64 (b, 32));
+	return _mm_unpacklo_epi32 (_mm_shuffle_epi32 (even, 0x08), _mm_shuffle_epi32 (odd, 0x08));
+}
+
+//the 4 mask values at p, each repeated to the 4 bytes of a pixel
+__attribute__((target("sse2"))) static inline __m128i
+load_mask_sse2 (const guchar *p)
+{
+	gint32 m;
+	memcpy (&m, p, 4);
+	__m128i t = _mm_cvtsi32_si128 (m);
+	t = _mm_unpacklo_epi8 (t, t);
+	return _mm_unpacklo_epi16 (t, t);
+}
+
+//the 2 16 bits mask values at p, each repeated to the 4 channels of a pixel
+__attribute__((target("sse2"))) static inline __m128i
+load_mask16_sse2 (const guint16 *p)
+{
+	gint32 m;
+	memcpy (&m, p, 4);
+	__m128i t = _mm_cvtsi32_si128 (m);
+	t = _mm_unpacklo_epi16 (t, t);
+	return _mm_unpacklo_epi32 (t, t);
+}
+
+#include "io-xcf-kernels.h"
+#undef ISA
+#undef F
+#undef V
+#undef VF
+#undef V_PIXELS
+#undef V_OP
+#undef V_LOAD
+#undef V_STORE
+#undef V_SPREAD
+#undef V_COLOR32_MASK
+#undef V_MUL32
+#undef V_PIXEL_ORDER
+#undef V_LOAD_MASK
+#undef V_LOAD_MASK16
+
+#define ISA			"avx2"
+#define F(name)			name##_avx2
+#define V			__m256i
+#define VF			__m256
+#define V_PIXELS		4
+#define V_OP(op)		_mm256_##op
+#define _mm256_and_si		_mm256_and_si256
+#define _mm256_andnot_si	_mm256_andnot_si256
+#define _mm256_or_si		_mm256_or_si256
+#define _mm256_xor_si		_mm256_xor_si256
+#define _mm256_setzero_si	_mm256_setzero_si256
+#define V_LOAD(p)		_mm256_loadu_si256 ((const __m256i*) (p))
+#define V_STORE(p, v)		_mm256_storeu_si256 ((__m256i*) (p), v)
+//the unpacks work within 128 bits lanes, put pixels 0-1 and 4-5 in the first one
+#define V_SPREAD(a)		_mm256_permute4x64_epi64 (a, 0xd8)
+#define V_COLOR32_MASK		_mm256_srli_si256 (_mm256_set1_epi32 (-1), 4)
+#define V_MUL32(a, b)		_mm256_mullo_epi32 (a, b)
+//pixels per 32 bits lane, as the 32 bits unpacks need them to match V_SPREAD
+#define V_PIXEL_ORDER		_mm256_setr_epi32 (0, 1, 4, 5, 2, 3, 6, 7)
+#define V_LOAD_MASK(p)		load_mask_avx2 (p)
+#define V_LOAD_MASK16(p)	load_mask16_avx2 (p)
+
+//the 8 mask values at p, each repeated to the 4 bytes of a pixel
+__attribute__((target("avx2"))) static inline __m256i
+load_mask_avx2 (const guchar *p)
+{
+	__m128i t = _mm_loadl_epi64 ((const __m128i*) p);
+	t = _mm_unpacklo_epi8 (t, t);
+	return _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_unpacklo_epi16 (t, t)), _mm_unpackhi_epi16 (t, t), 1);
+}
+
+//the 4 16 bits mask values at p, each repeated to the 4 channels of a pixel
+__attribute__((target("avx2"))) static inline __m256i
+load_mask16_avx2 (const guint16 *p)
+{
+	__m128i t = _mm_loadl_epi64 ((const __m128i*) p);
+	t = _mm_unpacklo_epi16 (t, t);
+	return _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_unpacklo_epi32 (t, t)), _mm_unpackhi_epi32 (t, t), 1);
+}
+
+#include "io-xcf-kernels.h"
+#endif
+
+//pick the kernels for the running cpu, IO_XCF_SIMD=0 forces the scalar ones
+static void
+xcf_simd_init (void)
+{
+	static gsize initialized = 0;
+
+	if (!g_once_init_enter (&initialized))
+		return;
+
+#if HAVE_X86_SIMD
+	const gchar *env = g_getenv ("IO_XCF_SIMD");
+	if (!env || strcmp (env, "0")) {
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports ("avx2")) {
+			interleave = interleave_avx2;
+			interleave16 = interleave16_avx2;
+			gather = gather_avx2;
+			unpremultiply_row = unpremultiply_row_avx2;
+			composite_row_funcs_avx2 (composite_row_funcs);
+			composite_row16_funcs_avx2 (composite_row16_funcs);
+		} else if (__builtin_cpu_supports ("sse2")) {
+			interleave = interleave_sse2;
+			interleave16 = interleave16_sse2;
+			unpremultiply_row = unpremultiply_row_sse2;
+			composite_row_funcs_sse2 (composite_row_funcs);
+			composite_row16_funcs_sse2 (composite_row16_funcs);
+		}
+	}
+#endif
+
+	g_once_init_leave (&initialized, 1);
+}
+
+//unknown modes pack the layer on top of the others, without any blending at all
+static inline void
+pack_row (guint16 *dest, guchar *src, const guchar *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	memset (dest, 0, 4 * count * sizeof (guint16));
+	composite_row_funcs[LAYERMODE_NORMAL][masked][opaque] (dest, src, mask, count, opacity, key);
+}
+
+COMPOSITE_ROW_VARIANTS (pack_row)
+
+static composite_row_func pack_row_funcs[2][2] = COMPOSITE_ROW_FUNCS (pack_row);
+
+static inline void
+pack_row16 (guint16 *dest, guint16 *src, const guint16 *mask, int count, guint32 opacity, guint32 key, gboolean masked, gboolean opaque)
+{
+	memset (dest, 0, 4 * count * sizeof (guint16));
+	composite_row16_funcs[LAYERMODE_NORMAL][masked][opaque] (dest, src, mask, count, opacity, key);
+}
+
+COMPOSITE_ROW16_VARIANTS (pack_row16)
+
+static composite_row16_func pack_row16_funcs[2][2] = COMPOSITE_ROW_FUNCS (pack_row16);
+
+/*
+ * How a layer is composited: its row function, picked once for all its
+ * tiles, and its parameters.
+ */
+typedef struct _XcfComposite XcfComposite;
+struct _XcfComposite {
+	composite_row_func row;
+	composite_row16_func row16;	//for high bit depth tiles
+	guint32 opacity;
+	guint32 seed;		//of the dissolve draws
+};
+
+//composite layer, with its mask applied by the row function if masked
+void
+composite_init (XcfComposite *composite, XcfLayer *layer, gboolean masked)
+{
+	composite_row_func (*funcs)[2] = pack_row_funcs;
+	composite_row16_func (*funcs16)[2] = pack_row16_funcs;
+
+	if (layer->mode < G_N_ELEMENTS (composite_row_funcs)) {
+		funcs = composite_row_funcs[layer->mode];
+		funcs16 = composite_row16_funcs[layer->mode];
+	}
+	composite->opacity = MIN (layer->opacity, 0xff);
+	composite->row = funcs[masked != FALSE][composite->opacity == 0xff];
+	composite->row16 = funcs16[masked != FALSE][composite->opacity == 0xff];
+	composite->seed = hash32 (layer->lptr ^ (layer->lptr >> 32));
+}
+
+/*
+ * A decoded tile of a layer: its rgba pixels, or the 8 bits planes they're
+ * interleaved from, and the plane of the layer mask, if any. High bit depth
+ * tiles keep their raw planes or pixels, and their pixels and mask values
+ * are 16 bits. The rows are converted and masked span by span, right before
+ * being composited, while they're in L1.
+ */
+typedef struct _XcfTile XcfTile;
+struct _XcfTile {
+	int width;
+	int height;
+	int type;
+	const guchar *planes;	//NULL if pixels holds rgba already
+	guchar *pixels;
+	const guchar *mask;	//NULL if none
+	guint32 precision;	//of the planes, PRECISION_U8 for 8 bits tiles
+	gboolean linear;
+	gboolean interleaved;	//raw high bit depth pixels, rather than RLE planes
+};
+
+/*
+ * The count rgba pixels from (i, j) on, unmasked: converted to row, or in
+ * place in tile->pixels. Returns them.
+ */
+guchar*
+tile_span (XcfTile *tile, int i, int j, int count, guchar *row)
+{
+	int offset = j * tile->width + i;
+
+	if (!tile->planes)
+		return tile->pixels + 4 * offset;
+	planes_to_rgba (tile->planes + offset, tile->width * tile->height, count, tile->type, row);
+	return row;
+}
+
+//tile_span () of a high bit depth tile, to 16 bits rgba pixels
+guint16*
+tile_span16 (XcfTile *tile, int i, int j, int count, guint16 *row)
+{
+	int offset = j * tile->width + i;
+	int area = tile->width * tile->height;
+	int size = precision_size (tile->precision);
+	int bpp = layer_channels (tile->type) * size;
+
+	if (!tile->planes)
+		return (guint16*)tile->pixels + 4 * offset;
+	if (tile->interleaved)
+		pixels_to_rgba16 (tile->planes + offset * bpp, size, 1, bpp, row, count, tile->type, tile->precision, tile->linear);
+	else
+		pixels_to_rgba16 (tile->planes + offset, size * area, area, 1, row, count, tile->type, tile->precision, tile->linear);
+	return row;
+}
+
+/*
+ * Composite tile at (ox, oy) on the width x height working buffer work,
+ * stride guint16s per row, (x, y) on the canvas. The tile is clipped to the
+ * buffer span by span, it's never moved. The mask of the tile is only
+ * applied if composite is masked.
+ */
+void
+composite_tile (guint16 *work, int stride, int width, int height, int x, int y, XcfTile *tile, int ox, int oy, XcfComposite *composite)
+{
+	int i0 = MAX (0, -ox), i1 = MIN (tile->width, width - ox);
+	int j0 = MAX (0, -oy), j1 = MIN (tile->height, height - oy);
+	guint16 row[4 * 64];
+	int j;
+
+	for (j = j0; j < j1 && i0 < i1; j++) {
+		guint16 *dest = work + stride * (oy + j) + 4 * (ox + i0);
+		int offset = j * tile->width + i0;
+		//the layer seeds the rows, each row seeds its pixels
+		guint32 key = hash32 (composite->seed + y + oy + j) + x + ox + i0;
+		if (tile->precision == PRECISION_U8)
+			composite->row (dest, tile_span (tile, i0, j, i1 - i0, (guchar*)row), tile->mask ? tile->mask + offset : NULL,
+					i1 - i0, composite->opacity, key);
+		else
+			composite->row16 (dest, tile_span16 (tile, i0, j, i1 - i0, row), tile->mask ? (const guint16*)tile->mask + offset : NULL,
+					  i1 - i0, composite->opacity, key);
+	}
+}
+
+/*
+ * Rendering. The canvas is split in REGION_SIZE square regions, and each
+ * region is rendered on its own: every layer tile overlapping it is decoded,
+ * clipped to the region and composited, bottom-up, starting from the topmost
+ * layer hiding the whole region, if any. Regions are independent,
+ * so when the whole file is in memory they are spread over a pool of
+ * threads, each with its own reader. update_func is called once per region,
+ * always from the loading thread.
+ */
+
+#define REGION_SIZE	64
+#define WORK_STRIDE	(4 * REGION_SIZE)	//of the working buffer of a region, in guint16s
+
+typedef struct _XcfRender XcfRender;
+struct _XcfRender {
+	XcfReader *reader;
+	GList *layers;
+	gchar compression;
+	guint32 precision;
+	gboolean linear;
+	const guchar *colormap;
+	guchar *pixels;
+	int rowstride;
+	int width;
+	int height;
+	int canvas_width;
+	int canvas_height;
+	int scale;		//the canvas is downscaled by scale in both directions
+	int x;			//position of the pixbuf in the downscaled canvas
+	int y;
+	int columns;
+	int *regions;		//the regions to render
+	int count;
+	gint next;		//next region to render, in regions
+	gint error;
+	GAsyncQueue *done;	//regions rendered by the workers, + 1, negated if they failed
+	XcfStats *stats;	//per worker, NULL unless IO_XCF_STATS is set
+};
+
+/*
+ * The scratch buffers of a rendering thread, carved out of a single block
+ * allocated once per load, and reused for every tile of every layer. Each
+ * buffer starts on a SCRATCH_ALIGN boundary, for the vector kernels, and
+ * the threads don't need any large stack.
+ */
+
+#define SCRATCH_ALIGN	64
+
+typedef struct _XcfScratch XcfScratch;
+struct _XcfScratch {
+	guint16 *work;		//the working buffer of a region
+	guchar *pixels;		//rgba pixels of a tile, 16 bits for high bit depths
+	guchar *planes;		//planes, or raw high bit depth pixels, of a tile
+	guchar *mask;		//mask plane of a tile, 16 bits for high bit depths
+	guchar *wide;		//raw high bit depth mask values of a tile
+	guint64 *sums;		//box filter of a region, NULL unless scaled
+	gpointer block;
+};
+
+//size, rounded up to the alignment of the buffers
+#define SCRATCH_SIZE(size)	(((gsize)(size) + SCRATCH_ALIGN - 1) & ~(gsize)(SCRATCH_ALIGN - 1))
+
+void
+xcf_scratch_init (XcfScratch *scratch, gboolean scaled)
+{
+	gsize work = SCRATCH_SIZE (WORK_STRIDE * REGION_SIZE * sizeof (guint16));
+	gsize pixels = SCRATCH_SIZE (4 * 64 * 64 * sizeof (guint16));
+	gsize planes = SCRATCH_SIZE (TILE_BUFFER_SIZE);
+	gsize mask = SCRATCH_SIZE (64 * 64 * sizeof (guint16));
+	gsize wide = SCRATCH_SIZE (4 * 64 * 64);
+	gsize sums = scaled ? SCRATCH_SIZE (4 * REGION_SIZE * REGION_SIZE * sizeof (guint64)) : 0;
+
+	scratch->block = g_malloc (SCRATCH_ALIGN - 1 + work + pixels + planes + mask + wide + sums);
+	guchar *p = GSIZE_TO_POINTER (SCRATCH_SIZE (GPOINTER_TO_SIZE (scratch->block)));
+	scratch->work = (guint16*)p;
+	scratch->pixels = p += work;
+	scratch->planes = p += pixels;
+	scratch->mask = p += planes;
+	scratch->wide = p += mask;
+	scratch->sums = scaled ? (guint64*)(p + wide) : NULL;
+}
+
+void
+xcf_scratch_clear (XcfScratch *scratch)
+{
+	g_free (scratch->block);
+	memset (scratch, 0, sizeof (XcfScratch));
+}
+
+//IO_XCF_THREADS sets the number of rendering threads, defaults to the number of cpus
+static int
+render_threads (void)
+{
+	const gchar *env = g_getenv ("IO_XCF_THREADS");
+	if (env && atoi (env) > 0)
+		return atoi (env);
+#if GLIB_CHECK_VERSION (2, 36, 0)
+	return g_get_num_processors ();
+#else
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+/*
+ * Decode tile (tx, ty) of layer, and its mask. RLE planes, and high bit
+ * depth tiles, are left to tile_span () and tile_span16 (), other tiles go
+ * to rgba in pixels. Returns FALSE if the tile is missing.
+ */
+gboolean
+render_tile (XcfReader *reader, XcfRender *render, XcfLayer *layer, int tx, int ty, XcfTile *tile, XcfScratch *scratch)
+{
+	int tile_id = ty * ((layer->width + 63) / 64) + tx;
+	XcfStats *stats = reader->stats;
+	gchar *pixels = (gchar*)scratch->pixels;
+	guchar *planes = scratch->planes;
+	guchar *mask = scratch->mask;
+
+	if (tile_id >= layer->tiles.count || !layer->tiles.offsets[tile_id]) {
+		if (stats)
+			stats->tiles_skipped++;
+		return FALSE;
+	}
+	gint64 t = xcf_stats_time (stats, STAGE_NONE, 0);
+	xcf_reader_seek (reader, layer->tiles.offsets[tile_id]);
+
+	tile->width = MIN (64, layer->width - 64 * tx);
+	tile->height = MIN (64, layer->height - 64 * ty);
+	tile->type = layer->type;
+	tile->planes = NULL;
+	tile->pixels = (guchar*)pixels;
+	tile->mask = NULL;
+	tile->precision = render->precision;
+	tile->linear = render->linear;
+	tile->interleaved = render->compression != COMPRESSION_RLE;
+	int count = tile->width * tile->height;
+
+	//decompress, high bit depth tiles are only converted span by span
+	int bpp = layer_channels (layer->type) * precision_size (render->precision);
+	gboolean indexed = layer->type == LAYERTYPE_INDEXED || layer->type == LAYERTYPE_INDEXEDA;
+	if (render->compression == COMPRESSION_RLE && indexed) {
+		rle_decode_indexed_tile (reader, render->colormap, tile->pixels, count, layer->type == LAYERTYPE_INDEXEDA, xcf_tile_length (&layer->tiles, tile_id, reader->length));
+	} else if (render->compression == COMPRESSION_RLE) {
+		rle_decode_tile (reader, planes, count, bpp, xcf_tile_length (&layer->tiles, tile_id, reader->length));
+		tile->planes = planes;
+	} else {//COMPRESSION_NONE or COMPRESSION_ZLIB, interleaved
+		guchar *raw = render->precision != PRECISION_U8 ? planes : tile->pixels;
+		if (render->compression == COMPRESSION_ZLIB)
+			zlib_decode_tile (reader, raw, count * bpp, xcf_tile_length (&layer->tiles, tile_id, reader->length));
+		else
+			xcf_reader_read (reader, raw, count * bpp);
+		if (render->precision != PRECISION_U8)
+			tile->planes = planes;
+		else
+			to_rgba (pixels, count, layer->type, render->colormap);
+	}
+
+	t = xcf_stats_time (stats, STAGE_DECODE, t);
+	if (stats)
+		stats->tiles_decoded++;
+
+	if (layer->layer_mask) {
+		//a missing mask tile hides nothing
+		if (!decode_mask (reader, render->compression, render->precision, layer->layer_mask, tile_id, count, mask, scratch->wide))
+			memset (mask, 0xff, count * (render->precision != PRECISION_U8 ? sizeof (guint16) : 1));
+		tile->mask = mask;
+		xcf_stats_time (stats, STAGE_MASK, t);
+	}
+
+	return TRUE;
+}
+
+/*
+ * The range of tiles of layer overlapping the [x0, x1]x[y0, y1] canvas
+ * area. Returns FALSE if there's none.
+ */
+gboolean
+layer_tiles (XcfLayer *layer, int x0, int y0, int x1, int y1, int *tx0, int *ty0, int *tx1, int *ty1)
+{
+	x0 -= layer->dx;
+	y0 -= layer->dy;
+	x1 -= layer->dx;
+	y1 -= layer->dy;
+	if (x1 < 0 || y1 < 0 || x0 >= (int)layer->width || y0 >= (int)layer->height)
+		return FALSE;
+
+	*tx0 = MAX (x0, 0) / 64;
+	*ty0 = MAX (y0, 0) / 64;
+	*tx1 = MIN (x1, (int)layer->width - 1) / 64;
+	*ty1 = MIN (y1, (int)layer->height - 1) / 64;
+	return TRUE;
+}
+
+/*
+ * Whether layer hides everything under it in the [x0, x1]x[y0, y1] canvas
+ * area: a visible, opaque, normal mode layer without alpha channel nor mask,
+ * with all the tiles covering the area.
+ */
+gboolean
+layer_covers (XcfLayer *layer, int x0, int y0, int x1, int y1)
+{
+	int tx0, ty0, tx1, ty1;
+	int tx, ty;
+
+	if (!layer->visible || layer->mode != LAYERMODE_NORMAL || layer->opacity < 255 || layer->layer_mask ||
+	    (layer->type != LAYERTYPE_RGB && layer->type != LAYERTYPE_GRAYSCALE && layer->type != LAYERTYPE_INDEXED))
+		return FALSE;
+	if (x0 < layer->dx || y0 < layer->dy ||
+	    x1 >= layer->dx + (gint64)layer->width || y1 >= layer->dy + (gint64)layer->height)
+		return FALSE;
+
+	layer_tiles (layer, x0, y0, x1, y1, &tx0, &ty0, &tx1, &ty1);
+	for (ty = ty0; ty <= ty1; ty++)
+		for (tx = tx0; tx <= tx1; tx++) {
+			int tile_id = ty * ((layer->width + 63) / 64) + tx;
+			if (tile_id >= layer->tiles.count || !layer->tiles.offsets[tile_id])
+				return FALSE;
+		}
+	return TRUE;
+}
+
+/*
+ * The lowest layer showing in the [x0, x1]x[y0, y1] canvas area, the layers
+ * under the topmost one covering it are never decoded.
+ */
+GList*
+visible_layers (XcfRender *render, int x0, int y0, int x1, int y1)
+{
+	GList *current;
+
+	for (current = g_list_last (render->layers); current; current = g_list_previous (current))
+		if (layer_covers (current->data, x0, y0, x1, y1))
+			return current;
+	return g_list_first (render->layers);
 }
 
 void
-grainextract (guchar *rgb0, guchar *rgb1) //x1-x2+.5
+render_region_full (XcfReader *reader, XcfRender *render, int rx, int ry, int rw, int rh, XcfScratch *scratch)
 {
-	rgb1[0] = MAX (0, MIN (0xff, rgb0[0] - rgb1[0] + 0x80));
-	rgb1[1] = MAX (0, MIN (0xff, rgb0[1] - rgb1[1] + 0x80));
-	rgb1[2] = MAX (0, MIN (0xff, rgb0[2] - rgb1[2] + 0x80));
+	GList *current;
+
+	for (current = visible_layers (render, rx, ry, rx + rw - 1, ry + rh - 1); current; current = g_list_next (current)) {
+		XcfLayer *layer = current->data;
+		int tx0, ty0, tx1, ty1;
+		int tx, ty;
+		if (!layer->visible || !layer_tiles (layer, rx, ry, rx + rw - 1, ry + rh - 1, &tx0, &ty0, &tx1, &ty1))
+			continue;
+
+		XcfComposite composite;
+		composite_init (&composite, layer, layer->layer_mask != NULL);
+		for (ty = ty0; ty <= ty1; ty++)
+			for (tx = tx0; tx <= tx1; tx++) {
+				XcfTile tile;
+				if (!render_tile (reader, render, layer, tx, ty, &tile, scratch))
+					continue;
+				gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+
+				//composite at the region coordinates of the tile, with the layer opacity
+				composite_tile (scratch->work, WORK_STRIDE, rw, rh, rx, ry, &tile, 64 * tx + layer->dx - rx, 64 * ty + layer->dy - ry, &composite);
+				xcf_stats_time (reader->stats, STAGE_COMPOSITE, t);
+			}
+	}
 }
 
+/*
+ * Same as render_region_full, on a canvas downscaled by render->scale. Each
+ * layer is box filtered (with premultiplied alpha) into sums, then the
+ * part of the region it covers is composited.
+ */
 void
-grainmerge (guchar *rgb0, guchar *rgb1)
+render_region_scaled (XcfReader *reader, XcfRender *render, int rx, int ry, int rw, int rh, XcfScratch *scratch)
 {
-	rgb1[0] = MAX (0, MIN (0xff, rgb0[0] + rgb1[0] - 0x80));
-	rgb1[1] = MAX (0, MIN (0xff, rgb0[1] + rgb1[1] - 0x80));
-	rgb1[2] = MAX (0, MIN (0xff, rgb0[2] + rgb1[2] - 0x80));
+	guint64 *sums = scratch->sums;
+	int f = render->scale;
+	GList *current;
+	int i, j;
+
+	//the canvas area covered by the region
+	int cx0 = rx * f;
+	int cy0 = ry * f;
+	int cx1 = MIN ((rx + rw) * f, render->canvas_width) - 1;
+	int cy1 = MIN ((ry + rh) * f, render->canvas_height) - 1;
+
+	for (current = visible_layers (render, cx0, cy0, cx1, cy1); current; current = g_list_next (current)) {
+		XcfLayer *layer = current->data;
+		int tx0, ty0, tx1, ty1;
+		int tx, ty;
+		if (!layer->visible || !layer_tiles (layer, cx0, cy0, cx1, cy1, &tx0, &ty0, &tx1, &ty1))
+			continue;
+
+		//bounding box of the layer in the region
+		int bx0 = rw, by0 = rh, bx1 = -1, by1 = -1;
+		memset (sums, 0, 4 * REGION_SIZE * REGION_SIZE * sizeof (guint64));
+
+		for (ty = ty0; ty <= ty1; ty++)
+			for (tx = tx0; tx <= tx1; tx++) {
+				XcfTile tile;
+				guint16 row[4 * 64];
+				if (!render_tile (reader, render, layer, tx, ty, &tile, scratch))
+					continue;
+				gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+
+				//canvas coordinates
+				int ox = 64 * tx + layer->dx;
+				int oy = 64 * ty + layer->dy;
+				int i0 = MAX (0, cx0 - ox);
+				int i1 = MIN (tile.width - 1, cx1 - ox);
+				if (i1 < i0)
+					continue;
+
+				for (j = MAX (0, cy0 - oy); j < tile.height && oy + j <= cy1; j++) {
+					int y = (oy + j) / f - ry;
+					int offset = j * tile.width + i0;
+					if (tile.precision == PRECISION_U8) {
+						guchar *p = tile_span (&tile, i0, j, i1 - i0 + 1, (guchar*)row);
+						if (tile.mask)
+							apply_mask (p, tile.mask + offset, i1 - i0 + 1);
+						for (i = i0; i <= i1; i++, p += 4) {
+							guint64 *sum = sums + 4 * (y * REGION_SIZE + (ox + i) / f - rx);
+							sum[0] += p[0] * p[3];
+							sum[1] += p[1] * p[3];
+							sum[2] += p[2] * p[3];
+							sum[3] += p[3];
+						}
+					} else {
+						guint16 *p = tile_span16 (&tile, i0, j, i1 - i0 + 1, row);
+						if (tile.mask)
+							apply_mask16 (p, (const guint16*)tile.mask + offset, i1 - i0 + 1);
+						for (i = i0; i <= i1; i++, p += 4) {
+							guint64 *sum = sums + 4 * (y * REGION_SIZE + (ox + i) / f - rx);
+							sum[0] += (guint32)p[0] * p[3];
+							sum[1] += (guint32)p[1] * p[3];
+							sum[2] += (guint32)p[2] * p[3];
+							sum[3] += p[3];
+						}
+					}
+					by0 = MIN (by0, y);
+					by1 = MAX (by1, y);
+					bx0 = MIN (bx0, (ox + i0) / f - rx);
+					bx1 = MAX (bx1, (ox + i1) / f - rx);
+				}
+				xcf_stats_time (reader->stats, STAGE_COMPOSITE, t);
+			}
+
+		if (bx1 < bx0 || by1 < by0)
+			continue;
+
+		//average, and pack the bounding box in pixels
+		gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+		int bw = bx1 - bx0 + 1;
+		int bh = by1 - by0 + 1;
+		gboolean wide = render->precision != PRECISION_U8;
+		guchar *p = scratch->pixels;
+		guint16 *p16 = (guint16*)scratch->pixels;
+		for (j = by0; j <= by1; j++)
+			for (i = bx0; i <= bx1; i++, p += 4, p16 += 4) {
+				guint64 *sum = sums + 4 * (j * REGION_SIZE + i);
+				int area = MIN (f, render->canvas_width - (rx + i) * f) * MIN (f, render->canvas_height - (ry + j) * f);
+				int c;
+				for (c = 0; c < 3; c++) {
+					guint32 v = sum[3] ? sum[c] / sum[3] : 0;
+					if (wide)
+						p16[c] = v;
+					else
+						p[c] = v;
+				}
+				if (wide)
+					p16[3] = sum[3] / area;
+				else
+					p[3] = sum[3] / area;
+			}
+
+		XcfTile box = { bw, bh, LAYERTYPE_RGBA, NULL, scratch->pixels, NULL, render->precision, FALSE, FALSE };
+		XcfComposite composite;
+		composite_init (&composite, layer, FALSE);
+		composite_tile (scratch->work, WORK_STRIDE, rw, rh, rx, ry, &box, bx0, by0, &composite);
+		xcf_stats_time (reader->stats, STAGE_COMPOSITE, t);
+	}
+}
+
+/*
+ * The area of region in the downscaled canvas, clipped to it. Returns FALSE
+ * if it's empty.
+ */
+gboolean
+region_area (XcfRender *render, int region, int *rx, int *ry, int *rw, int *rh)
+{
+	int px = REGION_SIZE * (region % render->columns);
+	int py = REGION_SIZE * (region / render->columns);
+
+	*rx = MAX (px + render->x, 0);
+	*ry = MAX (py + render->y, 0);
+	*rw = MIN (px + REGION_SIZE, render->width) + render->x;
+	*rh = MIN (py + REGION_SIZE, render->height) + render->y;
+	*rw = MIN (*rw, (render->canvas_width + render->scale - 1) / render->scale) - *rx;
+	*rh = MIN (*rh, (render->canvas_height + render->scale - 1) / render->scale) - *ry;
+	return *rw > 0 && *rh > 0;
 }
 
+/*
+ * Whether tile id of a level with bpp bytes per pixel is in the first length
+ * bytes of the file. The last tile of a level has no known end, it's only
+ * complete once the largest possible tile fits.
+ */
+gboolean
+tile_ready (XcfTiles *tiles, int id, guint32 bpp, goffset length)
+{
+	if (id >= tiles->count || !tiles->offsets[id])
+		return TRUE;
+
+	goffset end = tiles->offsets[id] + 2 * 64 * 64 * bpp;
+	if (id + 1 < tiles->count && tiles->offsets[id+1] > tiles->offsets[id])
+		end = tiles->offsets[id+1];
+	return end <= length;
+}
 
-//FIXME: any way to do the following 4 ones in integer arithmetic ?
+/*
+ * Move the ready mark of tiles past the tiles that are now in the first
+ * length bytes of the file. The tiles usually arrive in order, and a region
+ * only has to compare its last tile with the mark, instead of checking each
+ * of its tiles again on every increment.
+ */
 void
-hue (guchar *rgb0, guchar *rgb1)
+tiles_ready (XcfTiles *tiles, guint32 bpp, goffset length)
 {
-	if (rgb1[0] == rgb1[1] == rgb1[2]) {
-		rgb1[0] = rgb0[0];
-		rgb1[1] = rgb0[1];
-		rgb1[2] = rgb0[2];
-		return;
+	while (tiles->ready < tiles->count && tile_ready (tiles, tiles->ready, bpp, length))
+		tiles->ready++;
+}
+
+void
+layers_ready (GList *layers, guint32 precision, goffset length)
+{
+	int size = precision_size (precision);
+	GList *current;
+
+	for (current = layers; current; current = g_list_next (current)) {
+		XcfLayer *layer = current->data;
+		tiles_ready (&layer->tiles, layer_channels (layer->type) * size, length);
+		if (layer->layer_mask)
+			tiles_ready (&layer->layer_mask->tiles, size, length);
 	}
-	//hue of rgb1, value and saturation of rgb0
-	guchar min0 = MIN (MIN (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar max0 = MAX (MAX (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar min1 = MIN (MIN (rgb1[0], rgb1[1]), rgb1[2]);
-	guchar max1 = MAX (MAX (rgb1[0], rgb1[1]), rgb1[2]);
-	if (max0 == 0) {
-		rgb1[0] = 0x00;
-		rgb1[1] = 0x00;
-		rgb1[2] = 0x00;
-		return;
+}
+
+//whether all the tiles region needs are below the ready marks of the layers
+gboolean
+region_ready (XcfRender *render, int region)
+{
+	int rx, ry, rw, rh;
+	int f = render->scale;
+	GList *current;
+
+	if (!region_area (render, region, &rx, &ry, &rw, &rh))
+		return TRUE;
+
+	//the canvas area covered by the region
+	int cx0 = rx * f;
+	int cy0 = ry * f;
+	int cx1 = MIN ((rx + rw) * f, render->canvas_width) - 1;
+	int cy1 = MIN ((ry + rh) * f, render->canvas_height) - 1;
+
+	//the hidden layers aren't needed
+	for (current = visible_layers (render, cx0, cy0, cx1, cy1); current; current = g_list_next (current)) {
+		XcfLayer *layer = current->data;
+		int tx0, ty0, tx1, ty1;
+		if (!layer->visible || !layer_tiles (layer, cx0, cy0, cx1, cy1, &tx0, &ty0, &tx1, &ty1))
+			continue;
+
+		//the tiles are numbered row by row, the last one comes after the others
+		int last = ty1 * ((layer->width + 63) / 64) + tx1;
+		if (last >= layer->tiles.ready)
+			return FALSE;
+		if (layer->layer_mask && last >= layer->layer_mask->tiles.ready)
+			return FALSE;
 	}
-	double p = max0 * (max0 - min0) / (max1*(max0-min0) - min1*max0 + max1*min0);
-	double q = - max0 * (min1*max0 - max1*min0) / (max1*(max0-min0) - min1*max0 + max1*min0);
-	rgb1[0] = (guchar)(rgb1[0] * p + q);
-	rgb1[1] = (guchar)(rgb1[1] * p + q);
-	rgb1[2] = (guchar)(rgb1[2] * p + q);
+	return TRUE;
 }
 
-void
-saturation (guchar *rgb0, guchar *rgb1)
+/*
+ * Render region in the work buffer, REGION_SIZE x REGION_SIZE premultiplied
+ * pixels, and convert it to the pixbuf. Returns FALSE if one of its tiles
+ * is corrupt, which also sets the (sticky) error flag of reader.
+ */
+gboolean
+render_region (XcfReader *reader, XcfRender *render, int region, XcfScratch *scratch)
 {
-	//hue and value of rgb0, saturation of rgb1
-	guchar min0 = MIN (MIN (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar max0 = MAX (MAX (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar min1 = MIN (MIN (rgb1[0], rgb1[1]), rgb1[2]);
-	guchar max1 = MAX (MAX (rgb1[0], rgb1[1]), rgb1[2]);
-	if (max0 == 0) {
-		rgb1[0] = 0x00;
-		rgb1[1] = 0x00;
-		rgb1[2] = 0x00;
-		return;
+	guint16 *work = scratch->work;
+	gboolean error = reader->error;
+	int rx, ry, rw, rh;
+	int j;
+
+	if (!region_area (render, region, &rx, &ry, &rw, &rh))
+		return TRUE;
+	reader->error = FALSE;
+
+	for (j = 0; j < rh; j++)
+		memset (work + j * WORK_STRIDE, 0, 4 * rw * sizeof (guint16));
+	if (render->scale > 1)
+		render_region_scaled (reader, render, rx, ry, rw, rh, scratch);
+	else
+		render_region_full (reader, render, rx, ry, rw, rh, scratch);
+
+	gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+	guchar *dest = render->pixels + 4 * (rx - render->x) + render->rowstride * (ry - render->y);
+	for (j = 0; j < rh; j++)
+		unpremultiply_row (work + j * WORK_STRIDE, dest + j * render->rowstride, rw);
+	xcf_stats_time (reader->stats, STAGE_COMPOSITE, t);
+
+	if (!reader->error) {
+		reader->error = error;
+		return TRUE;
 	}
-	if (max0 == min0) {
-		rgb1[0] = max0;
-		rgb1[1] = min1*max0 / max0;
-		rgb1[2] = rgb1[1];
-		return;
+	return FALSE;
+}
+
+static void
+render_worker (gpointer data, gpointer user_data)
+{
+	XcfRender *render = user_data;
+	XcfReader reader;
+	XcfScratch scratch;
+	int region;
+
+	xcf_scratch_init (&scratch, render->scale > 1);
+	xcf_reader_init_memory (&reader, render->reader->data, render->reader->length);
+	if (render->stats)
+		reader.stats = &render->stats[GPOINTER_TO_INT (data)];
+	while ((region = g_atomic_int_add (&render->next, 1)) < render->count) {
+		region = render->regions[region];
+		if (render_region (&reader, render, region, &scratch))
+			g_async_queue_push (render->done, GINT_TO_POINTER (region + 1));
+		else
+			g_async_queue_push (render->done, GINT_TO_POINTER (-region - 1));
 	}
-	double p = max0 * (min1 - max1) / (max0*(min1-max1) - min1*max0 + max1*min0);
-	double q = - max0 * (min1*max0 - max1*min0) / (max0*(min1-max1) - min1*max0 + max1*min0);
-	rgb1[0] = (guchar)(rgb0[0] * p + q);
-	rgb1[1] = (guchar)(rgb0[1] * p + q);
-	rgb1[2] = (guchar)(rgb0[2] * p + q);
 
+	xcf_scratch_clear (&scratch);
+	xcf_reader_clear (&reader);
 }
 
-void
-value (guchar *rgb0, guchar *rgb1)
+/*
+ * Notify a finished region, or mark it as not rendered if it failed, for
+ * stop_load to render it again and report the error.
+ */
+static void
+render_notify (XcfRender *render, int region, gboolean rendered, GdkPixbuf *pixbuf, XcfContext *context)
 {
-	//hue and saturation ov rgb0, value of rgb1
-	guchar min0 = MIN (MIN (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar max0 = MAX (MAX (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar min1 = MIN (MIN (rgb1[0], rgb1[1]), rgb1[2]);
-	guchar max1 = MAX (MAX (rgb1[0], rgb1[1]), rgb1[2]);
-	if (max0 == 0) {
-		rgb1[0] = 0x00;
-		rgb1[1] = 0x00;
-		rgb1[2] = 0x00;
+	int rx = REGION_SIZE * (region % render->columns);
+	int ry = REGION_SIZE * (region / render->columns);
+
+	if (!rendered) {
+		render->error = TRUE;
+		context->rendered[region] = FALSE;
 		return;
 	}
-	if (max0 == min0) {
-		rgb1[0] = max1;
-		rgb1[1] = max1;
-		rgb1[2] = max1;
-		return;
+	if (context->update_func)
+		(* context->update_func) (pixbuf, rx, ry, MIN (REGION_SIZE, render->width - rx), MIN (REGION_SIZE, render->height - ry), context->user_data);
+}
+
+/*
+ * Render image on context->pixbuf, skipping the regions already rendered.
+ * If partial, reader only holds the beginning of the file, and only the
+ * regions whose tiles are all there are rendered. Returns FALSE if the file
+ * is corrupt.
+ */
+static gboolean
+render_layers (XcfReader *reader, XcfImage *image, gboolean partial, XcfContext *context)
+{
+	XcfRender render;
+	GThreadPool *pool = NULL;
+	XcfScratch scratch;
+	gpointer done;
+	int finished = 0;
+	int threads, regions, i;
+	gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+
+	memset (&render, 0, sizeof (XcfRender));
+	render.reader = reader;
+	render.layers = image->layers;
+	render.compression = image->compression;
+	render.precision = image->precision;
+	render.linear = image->linear;
+	render.colormap = image->colormap;
+	render.pixels = gdk_pixbuf_get_pixels (context->pixbuf);
+	render.rowstride = gdk_pixbuf_get_rowstride (context->pixbuf);
+	render.width = gdk_pixbuf_get_width (context->pixbuf);
+	render.height = gdk_pixbuf_get_height (context->pixbuf);
+	render.canvas_width = image->width;
+	render.canvas_height = image->height;
+	render.scale = context->scale;
+	render.x = context->x;
+	render.y = context->y;
+	render.columns = (render.width + REGION_SIZE - 1) / REGION_SIZE;
+	regions = render.columns * ((render.height + REGION_SIZE - 1) / REGION_SIZE);
+
+	if (partial)
+		layers_ready (image->layers, image->precision, reader->length);
+	render.regions = g_new (int, regions);
+	for (i = 0; i < regions; i++) {
+		if (context->rendered[i] || (partial && !region_ready (&render, i)))
+			continue;
+		context->rendered[i] = TRUE;
+		render.regions[render.count++] = i;
+	}
+	if (!render.count) {
+		g_free (render.regions);
+		return TRUE;
+	}
+
+	//the buffered reader has a single window, don't share it
+	threads = reader->file ? 1 : MIN (render_threads (), render.count);
+	if (threads > 1) {
+		if (reader->stats)
+			render.stats = g_new0 (XcfStats, threads);
+		render.done = g_async_queue_new ();
+		pool = g_thread_pool_new (render_worker, &render, threads - 1, FALSE, NULL);
+		for (i = 1; pool && i < threads; i++)
+			g_thread_pool_push (pool, GINT_TO_POINTER (i), NULL);
+	}
+	LOG ("rendering %d regions on %d threads\n", render.count, pool ? threads : 1);
+
+	xcf_scratch_init (&scratch, render.scale > 1);
+
+	//the loading thread renders too, and notifies the finished regions
+	while (finished < render.count) {
+		int next = g_atomic_int_add (&render.next, 1);
+		if (next < render.count) {
+			gboolean rendered = render_region (reader, &render, render.regions[next], &scratch);
+			render_notify (&render, render.regions[next], rendered, context->pixbuf, context);
+			finished++;
+		} else {
+			//nothing left to render, wait for the workers
+			done = g_async_queue_pop (render.done);
+			render_notify (&render, ABS (GPOINTER_TO_INT (done)) - 1, GPOINTER_TO_INT (done) > 0, context->pixbuf, context);
+			finished++;
+		}
+
+		while (render.done && (done = g_async_queue_try_pop (render.done))) {
+			render_notify (&render, ABS (GPOINTER_TO_INT (done)) - 1, GPOINTER_TO_INT (done) > 0, context->pixbuf, context);
+			finished++;
+		}
 	}
 
-	double p = max1 / max0;
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+	xcf_scratch_clear (&scratch);
+	g_free (render.regions);
+	if (render.done)
+		g_async_queue_unref (render.done);
+
+	if (reader->stats) {
+		reader->stats->threads = MAX (reader->stats->threads, pool ? threads : 1);
+		for (i = 1; render.stats && i < threads; i++)
+			xcf_stats_merge (reader->stats, &render.stats[i]);
+		xcf_stats_time (reader->stats, STAGE_RENDER, t);
+	}
+	g_free (render.stats);
 
-	rgb1[0] = (guchar)(rgb0[0] * p);
-	rgb1[1] = (guchar)(rgb0[1] * p);
-	rgb1[2] = (guchar)(rgb0[2] * p);
+	return !reader->error && !render.error;
 }
 
 void
-color (guchar *rgb0, guchar *rgb1)
+xcf_image_clear (XcfImage *image)
 {
-	//hue and hsl-saturation or rgb1, luminosity of rgb0
-	guchar min0 = MIN (MIN (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar max0 = MAX (MAX (rgb0[0], rgb0[1]), rgb0[2]);
-	guchar min1 = MIN (MIN (rgb1[0], rgb1[1]), rgb1[2]);
-	guchar max1 = MAX (MAX (rgb1[0], rgb1[1]), rgb1[2]);
-
-	double p = MIN ((min0+max0)/2, 0xff - (min0+max0)/2) / MIN ((min1+max1)/2, 0xff - (min1+max1)/2);
-	double q = (min0 + max0 - (min1 + max1) * p) / 2.0;
+	GList *current;
 
-	rgb1[0] = (guchar)(rgb1[0] * p + q);
-	rgb1[1] = (guchar)(rgb1[1] * p + q);
-	rgb1[2] = (guchar)(rgb1[2] * p + q);
+	//free the layers and masks
+	for (current = g_list_first (image->layers); current; current = g_list_next(current)) {
+		XcfLayer *layer = current->data;
+		if (layer->layer_mask) {
+			xcf_tiles_clear (&layer->layer_mask->tiles);
+			g_free (layer->layer_mask);
+		}
+		xcf_tiles_clear (&layer->tiles);
+		g_free (layer);
+	}
+	g_list_free (image->layers);
+	image->layers = NULL;
 }
 
-void
-composite (gchar *pixbuf_pixels, int rowstride, gchar *tile_pixels, int ox, int oy, int tw, int th, guint32 layer_mode)
+#define XCF_HEADER_SIZE	30	//including the precision of v004+ files
+#define XCF_MAX_VERSION	20
+
+/*
+ * Set the component format of image from the precision field of its header.
+ * v004 numbers the precisions from 0, v005 and v006 by hundreds (the linear
+ * one first, then the gamma one), and v007+ use the GimpPrecision values,
+ * adding the perceptual variants and doubles. Returns FALSE for the unknown
+ * and double precisions.
+ */
+static gboolean
+xcf_image_parse_precision (XcfImage *image, guint32 precision)
 {
-	composite_func f = NULL;
-	int origin = 4 * ox + rowstride * oy;
-	int i, j;
+	static const guint32 v4[] = { PRECISION_U8, PRECISION_U16, PRECISION_U32, PRECISION_HALF, PRECISION_FLOAT };
+	static const guint32 v7[] = { PRECISION_U8, PRECISION_U16, PRECISION_U32, G_MAXUINT32, PRECISION_HALF, PRECISION_FLOAT };
 
-	switch (layer_mode) {
-	case LAYERMODE_NORMAL:
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				//a0 = 1 - (1-a0)*(a-a1)
-				//rgb0 = BLEND (rgba0, rgba1)
-				gchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				gchar *src = tile_pixels + j*tw*4 + i*4;
-				guchar alpha = 0xff - (0xff - dest[3]) * (0xff - src [3]);
-				blend (dest, src);
-				dest[3] = alpha;
-			}
-		break;
-	case LAYERMODE_DISSOLVE:
-		srand(time(0));
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				guchar d = rand () % 0x100;
-				dest [0] = d <= src[3] ? src[0] : dest[0];
-				dest [1] = d <= src[3] ? src[1] : dest[1];
-				dest [2] = d <= src[3] ? src[2] : dest[2];
-				dest [3] = d <= src[3] ? 0xff : dest[3];
-			}
-		break;
-	case LAYERMODE_BEHIND: //ignore
-		break;
-	// 3<=mode<=10 || 15<=mode<=21
-	// a0 = a0
-	// rgba0 = blend (rgba0, F(rgb0, rgb1), MIN(a0, a1)
-	case LAYERMODE_MULTIPLY:
-		f = multiply;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_SCREEN:
-		f = screen;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_OVERLAY:
-		f = overlay;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_SOFTLIGHT:
-		f = softlight;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_DIFFERENCE:
-		f = difference;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_ADDITION:
-		f = addition;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_SUBTRACT:
-		f = subtract;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_DARKENONLY:
-		f = min;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_LIGHTENONLY:
-		f = max;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_DIVIDE:
-		f = divide;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_DODGE:
-		f = dodge;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_BURN:
-		f = burn;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_HARDLIGHT:
-		f = hardlight;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_GRAINEXTRACT:
-		f = grainextract;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_GRAINMERGE:
-		f = grainmerge;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_HUE:
-		f = hue;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_SATURATION:
-		f = saturation;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_VALUE:
-		f = value;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
-	case LAYERMODE_COLOR:
-		f = color;
-		for (j=0;j<th;j++)
-			for (i=0;i<tw;i++) {
-				guchar *dest = pixbuf_pixels + origin + j * rowstride + 4 * i;
-				guchar *src = tile_pixels + j*tw*4 + i*4;
-				f (dest, src);
-				src[3] = MIN (dest[3], src[3]);
-				blend (dest, src);
-			}
-		break;
+	LOG ("precision: %d\n", precision);
+	if (image->version == 4) {
+		if (precision >= G_N_ELEMENTS (v4))
+			return FALSE;
+		image->precision = v4[precision];
+		image->linear = precision >= 2;
+	} else if (image->version <= 6) {
+		if (precision < 100 || precision >= 600 || (precision % 100 != 0 && precision % 100 != 50))
+			return FALSE;
+		image->precision = v4[precision / 100 - 1];
+		image->linear = precision % 100 == 0;
+	} else {
+		if (precision < 100 || precision >= 700 || (precision % 100 != 0 && precision % 100 != 50 && precision % 100 != 75))
+			return FALSE;
+		image->precision = v7[precision / 100 - 1];
+		image->linear = precision % 100 == 0;
+	}
+
+	if (image->precision == G_MAXUINT32)
+		return FALSE;
+	if (image->precision != PRECISION_U8)
+		precision_init ();
+	return TRUE;
+}
 
-	default:	//Pack layer on top of each other, without any blending at all
-		for (j=0; j<th;j++) {
-			memcpy (pixbuf_pixels + origin + j * rowstride, tile_pixels + j*tw*4 , tw*4);
+/*
+ * Look for the embedded thumbnail in the length bytes of parasites at the
+ * cursor. Each parasite is a name, flags, and a length prefixed payload.
+ */
+static void
+xcf_image_parse_parasites (XcfReader *reader, XcfImage *image, guint32 length)
+{
+	goffset end = xcf_reader_tell (reader) + length;
+	gchar name[sizeof (THUMBNAIL_PARASITE)];
+
+	while (!reader->error && xcf_reader_tell (reader) < end) {
+		guint32 name_length = xcf_reader_read_uint32 (reader);
+		gboolean thumbnail = name_length == sizeof (THUMBNAIL_PARASITE) &&
+				     xcf_reader_read (reader, name, name_length) &&
+				     !memcmp (name, THUMBNAIL_PARASITE, name_length);
+		if (!thumbnail && name_length != sizeof (THUMBNAIL_PARASITE))
+			xcf_reader_skip (reader, name_length);
+
+		xcf_reader_read_uint32 (reader); //flags
+		guint32 size = xcf_reader_read_uint32 (reader);
+		if (thumbnail && size && xcf_reader_tell (reader) + size <= end) {
+			image->thumbnail = xcf_reader_tell (reader);
+			image->thumbnail_length = size;
+			LOG ("thumbnail: %d bytes\n", size);
 		}
-		break;
+		xcf_reader_skip (reader, size);
 	}
-
+	xcf_reader_seek (reader, end);
 }
 
-static GdkPixbuf*
-xcf_image_load_real (FILE *f, XcfContext *context, GError **error)
+/*
+ * The colormap of indexed images, length bytes of payload. It's a count and
+ * as many rgb triplets, looked up once here into an rgba table, so indexed
+ * tiles expand with a gather. Called with a 0 length from the header to
+ * map every index to opaque black until there's a palette.
+ */
+static void
+xcf_image_parse_colormap (XcfReader *reader, XcfImage *image, guint32 length)
 {
-	guint32 width;
-	guint32 height;
-	guint32 color_mode;
-	gchar compression = 0;
-	GList *layers = NULL;
-	GdkPixbuf *pixbuf = NULL;
+	guint32 count = 0;
+	guint32 i;
+
+	if (length >= 4)
+		count = xcf_reader_read_uint32 (reader);
+	//version 0 files didn't save the colormaps correctly, gimp replaces them with a gray ramp
+	const guchar *colors = count && image->version > 0 ? xcf_reader_peek (reader, 3 * MIN (count, 256)) : NULL;
+
+	for (i = 0; i < 256; i++) {
+		guchar *color = image->colormap + 4 * i;
+		if (i < count && colors)
+			memcpy (color, colors + 3 * i, 3);
+		else if (i < count && image->version == 0)
+			color[0] = color[1] = color[2] = i;
+		else
+			color[0] = color[1] = color[2] = 0;
+		color[3] = 0xff;
+	}
+
+	if (length >= 4)
+		xcf_reader_skip (reader, image->version > 0 ? 3 * (goffset)count : count);
+}
 
+/*
+ * Parse the header: magic, version, canvas size and color mode, the first
+ * XCF_HEADER_SIZE bytes of the file.
+ */
+static gboolean
+xcf_image_parse_header (XcfReader *reader, XcfImage *image, GError **error)
+{
 	guchar buffer[32];
-	guint32 data[3];
-	guint32 property[2];
+
+	memset (image, 0, sizeof (XcfImage));
 
 	//Magic and version
-	fread (buffer, sizeof(guchar), 9, f);
+	xcf_reader_read (reader, buffer, 9);
 	//LOG ("%s\n", buffer);
 	if (strncmp (buffer, "gimp xcf ", 9)) {
 		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Wrong magic");
-		return NULL;
+		return FALSE;
 	}
 
-	fread (buffer, sizeof(guchar), 4, f);
-	if (strncmp (buffer, "file", 4) && strncmp (buffer, "v001", 4) && strncmp (buffer, "v002", 4)) {
+	//"file" or "v" and 3 digits
+	xcf_reader_read (reader, buffer, 4);
+	if (!strncmp (buffer, "file", 4))
+		image->version = 0;
+	else if (buffer[0] == 'v' && g_ascii_isdigit (buffer[1]) && g_ascii_isdigit (buffer[2]) && g_ascii_isdigit (buffer[3]))
+		image->version = 100 * (buffer[1] - '0') + 10 * (buffer[2] - '0') + buffer[3] - '0';
+	else
+		image->version = G_MAXUINT32;
+	if (image->version > XCF_MAX_VERSION) {
 		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Unsupported version");
-		return NULL;
+		return FALSE;
 	}
-	fread (buffer, sizeof(guchar), 1, f);
+	xcf_reader_skip (reader, 1);
+	image->pointer_size = image->version >= 11 ? sizeof (guint64) : sizeof (guint32);
 
 	//Canvas size and Color mode
-	fread (data, sizeof(guint32), 3, f);
-
-	width = GUINT32_FROM_BE(data[0]);
-	height = GUINT32_FROM_BE(data[1]);
-	color_mode = GUINT32_FROM_BE(data[2]);
-	if (color_mode == 2) { //Indexed, not supported for now
-		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Indexed color mode unsupported");
-		return NULL;
+	image->width = xcf_reader_read_uint32 (reader);
+	image->height = xcf_reader_read_uint32 (reader);
+	image->color_mode = xcf_reader_read_uint32 (reader);
+	xcf_image_parse_colormap (reader, image, 0);
+
+	//Precision, 8 bits sRGB before v004, and always for indexed images
+	if (image->version >= 4 && (!xcf_image_parse_precision (image, xcf_reader_read_uint32 (reader)) ||
+				    (image->color_mode == 2 && image->precision != PRECISION_U8))) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Unsupported precision");
+		return FALSE;
 	}
 
+	return TRUE;
+}
+
+/*
+ * The legacy mode closest to a layer mode. v009+ files have the GIMP 2.10
+ * modes, blending in linear light, after the legacy ones. The modes without
+ * any legacy equivalent fall back to normal.
+ */
+static guint32
+legacy_layer_mode (guint32 mode)
+{
+	static const guint32 modes[] = {
+		[23] = LAYERMODE_OVERLAY,
+		[28] = LAYERMODE_NORMAL,
+		[29] = LAYERMODE_BEHIND,
+		[30] = LAYERMODE_MULTIPLY,
+		[31] = LAYERMODE_SCREEN,
+		[32] = LAYERMODE_DIFFERENCE,
+		[33] = LAYERMODE_ADDITION,
+		[34] = LAYERMODE_SUBTRACT,
+		[35] = LAYERMODE_DARKENONLY,
+		[36] = LAYERMODE_LIGHTENONLY,
+		[37] = LAYERMODE_HUE,
+		[38] = LAYERMODE_SATURATION,
+		[39] = LAYERMODE_COLOR,
+		[40] = LAYERMODE_VALUE,
+		[41] = LAYERMODE_DIVIDE,
+		[42] = LAYERMODE_DODGE,
+		[43] = LAYERMODE_BURN,
+		[44] = LAYERMODE_HARDLIGHT,
+		[45] = LAYERMODE_SOFTLIGHT,
+		[46] = LAYERMODE_GRAINEXTRACT,
+		[47] = LAYERMODE_GRAINMERGE,
+	};
+
+	if (mode <= LAYERMODE_GRAINMERGE)
+		return mode;
+	return mode < G_N_ELEMENTS (modes) ? modes[mode] : LAYERMODE_NORMAL;
+}
+
+/*
+ * Parse the header, the layers and their masks, and index their tiles.
+ * The pixels are decoded at rendering time.
+ */
+static gboolean
+xcf_image_parse (XcfReader *reader, XcfImage *image, GError **error)
+{
+	guint32 width;
+	guint32 height;
+	guint32 color_mode;
+	gchar compression = 0;
+	GList *layers = NULL;
+
+	guint32 data[3];
+	guint32 property[2];
+
+	if (!xcf_image_parse_header (reader, image, error))
+		return FALSE;
+	width = image->width;
+	height = image->height;
+	color_mode = image->color_mode;
 
 	LOG ("W: %d, H: %d, mode: %d\n", width, height, color_mode);
 
 	//Image Properties
 	while (1) {
-		fread (property, sizeof(guint32), 2, f); //read property and payload
+		property[0] = xcf_reader_read_uint32 (reader); //read property and payload
+		property[1] = xcf_reader_read_uint32 (reader);
 		if (!property[0])
 			break;
-		property[0] = GUINT32_FROM_BE(property[0]);
-		property[1] = GUINT32_FROM_BE(property[1]);
 		//LOG ("property %d, payload %d\n", property[0], property[1]);
 		/* Probably just a garbage property */
 		if (property[0] > PROP_MAX)
 			break;
 		switch (property[0]) {
 		case PROP_COMPRESSION:
-			fread (&compression, sizeof(gchar), 1, f);
+			xcf_reader_read (reader, &compression, 1);
 			LOG ("compression: %d\n", compression);
 			break;
-		case PROP_COLORMAP: //essential, need to parse this
+		case PROP_PARASITES:
+			xcf_image_parse_parasites (reader, image, property[1]);
+			break;
+		case PROP_COLORMAP:
+			xcf_image_parse_colormap (reader, image, property[1]);
+			break;
 		case PROP_END:
 		default:
 			//skip the payload
-			fseek (f, property[1], SEEK_CUR);
+			xcf_reader_skip (reader, property[1]);
 			break;
 		}
 	}
 
+	if (compression != COMPRESSION_NONE && compression != COMPRESSION_RLE && compression != COMPRESSION_ZLIB) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Unsupported tile compression");
+		goto bail;
+	}
+
 	//Layer Pointer
-	guint32 layer_ptr;
+	goffset layer_ptr;
 	while (1) {
-		fread (&layer_ptr, sizeof(guint32), 1, f);
-		layer_ptr = GUINT32_FROM_BE (layer_ptr);
+		layer_ptr = xcf_reader_read_pointer (reader, image->pointer_size);
 		if (!layer_ptr)
 			break;;
 
-		XcfLayer *layer = g_try_new (XcfLayer, 1);
+		XcfLayer *layer = g_try_new0 (XcfLayer, 1);
 		if (!layer) {
 			g_set_error (error,
 			     GDK_PIXBUF_ERROR,
 			     GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
 			     "Cannot allocate memory for loading XCF image");
-			return NULL;
+			goto bail;
 		}
 
 		gboolean ignore_layer = FALSE;
@@ -899,101 +3568,92 @@ xcf_image_load_real (FILE *f, XcfContext *context, GError **error)
 		layer->opacity = 0xff;
 
 		//LOG ("layer_ptr: %d\n", layer_ptr);
-		long pos = ftell (f);
+		goffset pos = xcf_reader_tell (reader);
 		//jump to the layer
-		fseek(f, layer_ptr, SEEK_SET);
+		xcf_reader_seek (reader, layer_ptr);
 
 		//layer width, height, type
-		fread (data, sizeof(guint32), 3, f);
-		layer->width = GUINT32_FROM_BE(data[0]);
-		layer->height = GUINT32_FROM_BE(data[1]);
-		layer->type = GUINT32_FROM_BE(data[2]);
+		layer->width = xcf_reader_read_uint32 (reader);
+		layer->height = xcf_reader_read_uint32 (reader);
+		layer->type = xcf_reader_read_uint32 (reader);
 		LOG("\tLayer w:%d h:%d type:%d\n", layer->width, layer->height, layer->type);
 
 		//Layer name, ignore
-		guint32 string_size;
-		fread (&string_size, sizeof(guint32), 1, f);
-		fseek (f, GUINT32_FROM_BE(string_size), SEEK_CUR);
+		guint32 string_size = xcf_reader_read_uint32 (reader);
+		xcf_reader_skip (reader, string_size);
 
 		//Layer properties
 		while (1) {
-			fread (property, sizeof(guint32), 2, f); //property and payload
+			property[0] = xcf_reader_read_uint32 (reader); //property and payload
+			property[1] = xcf_reader_read_uint32 (reader);
 			if (!property[0])
 				break;		//break on PROP_END
-			property[0] = GUINT32_FROM_BE (property[0]);
-			property[1] = GUINT32_FROM_BE (property[1]);
 			//LOG ("\tproperty %d, payload %d\n", property[0], property[1]);
 			/* Probably just a garbage property */
 			if (property[0] > PROP_MAX)
 				break;
 			switch (property[0]) {
 			case PROP_OPACITY:
-				fread (data, sizeof(guint32), 1, f);
-				layer->opacity = GUINT32_FROM_BE(data[0]);
+				layer->opacity = xcf_reader_read_uint32 (reader);
 				break;
 			case PROP_MODE:
-				fread (data, sizeof(guint32), 1, f);
-				layer->mode = GUINT32_FROM_BE (data[0]);
+				layer->mode = legacy_layer_mode (xcf_reader_read_uint32 (reader));
 				break;
 			case PROP_VISIBLE:
-				fread (data, sizeof(guint32), 1, f);
-				if (GUINT32_FROM_BE(data[0]) == 0) {
+				if (xcf_reader_read_uint32 (reader) == 0) {
 					layer->visible = FALSE;
 					ignore_layer = TRUE;
 				}
 				break;
 			case PROP_APPLY_MASK:
-				fread (data, sizeof(guint32), 1, f);
-				if (GUINT32_FROM_BE(data[0]) == 1)
+				if (xcf_reader_read_uint32 (reader) == 1)
 					layer->apply_mask = TRUE;
 				break;
 			case PROP_OFFSETS:
-				fread(data, sizeof(gint32), 2, f);
-				layer->dx = GUINT32_FROM_BE(data[0]);
-				layer->dy = GUINT32_FROM_BE(data[1]);
+				layer->dx = xcf_reader_read_uint32 (reader);
+				layer->dy = xcf_reader_read_uint32 (reader);
 				break;
 			case PROP_FLOATING_SELECTION:
+			case PROP_ITEM_PATH: //inside a layer group, already in the group pixels
 				ignore_layer = TRUE;
 			default:
 				//skip the payload
-				fseek (f, property[1], SEEK_CUR);
+				xcf_reader_skip (reader, property[1]);
 				break;
 			}
 		}
 
 		//Hierararchy Pointer
-		guint32 hptr;
-		fread (&hptr, sizeof(guint32), 1, f);
-		hptr = GUINT32_FROM_BE (hptr);
-		long pos1 = ftell (f);
+		goffset hptr = xcf_reader_read_pointer (reader, image->pointer_size);
+		goffset pos1 = xcf_reader_tell (reader);
 		//jump to hierarchy
-		fseek (f, hptr, SEEK_SET);
+		xcf_reader_seek (reader, hptr);
 
 		//Hierarchy w, h, bpp
-		fread (data, sizeof(guint32), 3, f);
-		data[0] = GUINT32_FROM_BE(data[0]);
-		data[1] = GUINT32_FROM_BE(data[1]);
-		data[2] = GUINT32_FROM_BE(data[2]);
-		//LOG ("\tHierarchy w:%d, h:%d, bpp:%d\n", data[0], data[1], data[2]);
+		xcf_reader_read (reader, data, 3 * sizeof(guint32));
+		//LOG ("\tHierarchy w:%d, h:%d, bpp:%d\n", GUINT32_FROM_BE(data[0]), GUINT32_FROM_BE(data[1]), GUINT32_FROM_BE(data[2]));
 
-		guint32 lptr;
-		fread (&lptr, sizeof(guint32), 1, f);
-		layer->lptr = GUINT32_FROM_BE (lptr);
-		//Layer parsing is done at rendering time
+		layer->lptr = xcf_reader_read_pointer (reader, image->pointer_size);
+		//Index the tiles, decoding is done at rendering time
+		if (!ignore_layer && !xcf_tiles_read (reader, layer->lptr, layer->width, layer->height, layer_channels (layer->type) * precision_size (image->precision), image->pointer_size, &layer->tiles)) {
+			g_free (layer);
+			g_set_error (error,
+			     GDK_PIXBUF_ERROR,
+			     GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			     "Cannot allocate memory for loading XCF image");
+			goto bail;
+		}
 
 		//Here I could iterate over the unused dlevels and skip them
 
 		//rewind to the layer position
-		fseek (f, pos1, SEEK_SET);
+		xcf_reader_seek (reader, pos1);
 
 		//Mask Pointer
-		guint32 mptr;
-		fread (&mptr, sizeof(guint32), 1, f);
-		if (mptr)
-			mptr = GUINT32_FROM_BE(mptr);
+		goffset mptr = xcf_reader_read_pointer (reader, image->pointer_size);
 
 		//rewind to the previous position
-		fseek (f, pos, SEEK_SET);
+		xcf_reader_seek (reader, pos);
 
 
 		if (!ignore_layer)
@@ -1007,315 +3667,393 @@ xcf_image_load_real (FILE *f, XcfContext *context, GError **error)
 			continue;
 
 		LOG ("\t\tthis layer has a mask\n");
-		XcfChannel *mask = g_try_new (XcfChannel, 1);
+		XcfChannel *mask = g_try_new0 (XcfChannel, 1);
 		if (!mask) {
 			g_set_error (error,
 			     GDK_PIXBUF_ERROR,
 			     GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
 			     "Cannot allocate memory for loading XCF image");
-			return NULL;
+			goto bail;
 		}
 
 		mask->opacity = 0xff;
 		mask->visible = TRUE;
 
 		//LOG ("\t\tchannel_ptr: %d\n", mptr);
-		long mpos = ftell (f);
+		goffset mpos = xcf_reader_tell (reader);
 		//jump to the channel
-		fseek(f, mptr, SEEK_SET);
+		xcf_reader_seek (reader, mptr);
 
 		//Channel w, h
-		fread (data, sizeof(guint32), 2, f);
-		data[0] = GUINT32_FROM_BE(data[0]);
-		data[1] = GUINT32_FROM_BE(data[1]);
-		LOG ("\t\tChannel w:%d, h:%d\n", data[0], data[1]);
+		mask->width = xcf_reader_read_uint32 (reader);
+		mask->height = xcf_reader_read_uint32 (reader);
+		LOG ("\t\tChannel w:%d, h:%d\n", mask->width, mask->height);
 
 		//Channel name, ignore
-		fread (&string_size, sizeof(guint32), 1, f);
-		fseek (f, GUINT32_FROM_BE(string_size), SEEK_CUR);
+		string_size = xcf_reader_read_uint32 (reader);
+		xcf_reader_skip (reader, string_size);
 
 		//Channel properties
 		while (1) {
-			fread (property, sizeof(guint32), 2, f); //property and payload
+			property[0] = xcf_reader_read_uint32 (reader); //property and payload
+			property[1] = xcf_reader_read_uint32 (reader);
 			if (!property[0])
 				break;		//break on PROP_END
-			property[0] = GUINT32_FROM_BE (property[0]);
-			property[1] = GUINT32_FROM_BE (property[1]);
 			//LOG ("\tproperty %d, payload %d\n", property[0], property[1]);
 			switch (property[0]) {
 			case PROP_OPACITY:
-				fread (data, sizeof(guint32), 1, f);
-				mask->opacity = GUINT32_FROM_BE(data[0]);
+				mask->opacity = xcf_reader_read_uint32 (reader);
 				break;
 			case PROP_VISIBLE:
-				fread (data, sizeof(guint32), 1, f);
-				if (GUINT32_FROM_BE(data[0]) == 0)
+				if (xcf_reader_read_uint32 (reader) == 0)
 					mask->visible = FALSE;
 				break;
 			default:
 				//skip the payload
-				fseek (f, property[1], SEEK_CUR);
+				xcf_reader_skip (reader, property[1]);
 				break;
 			}
 		}
 
 		//Hierararchy Pointer
-		fread (&hptr, sizeof(guint32), 1, f);
-		hptr = GUINT32_FROM_BE (hptr);
-		long mpos1 = ftell (f);
+		hptr = xcf_reader_read_pointer (reader, image->pointer_size);
 		//jump to hierarchy
-		fseek (f, hptr, SEEK_SET);
+		xcf_reader_seek (reader, hptr);
 
 		//Hierarchy w, h, bpp
-		fread (data, sizeof(guint32), 3, f);
-		data[0] = GUINT32_FROM_BE(data[0]);
-		data[1] = GUINT32_FROM_BE(data[1]);
-		data[2] = GUINT32_FROM_BE(data[2]);
-		//LOG ("\tHierarchy w:%d, h:%d, bpp:%d\n", data[0], data[1], data[2]);
+		xcf_reader_read (reader, data, 3 * sizeof(guint32));
+		//LOG ("\tHierarchy w:%d, h:%d, bpp:%d\n", GUINT32_FROM_BE(data[0]), GUINT32_FROM_BE(data[1]), GUINT32_FROM_BE(data[2]));
 
-		fread (&lptr, sizeof(guint32), 1, f);
-		mask->lptr = GUINT32_FROM_BE (lptr);
-		//level parsing is done at render time
+		mask->lptr = xcf_reader_read_pointer (reader, image->pointer_size);
+		//Index the tiles, decoding is done at render time
+		if (mask->visible && !xcf_tiles_read (reader, mask->lptr, mask->width, mask->height, precision_size (image->precision), image->pointer_size, &mask->tiles)) {
+			g_free (mask);
+			g_set_error (error,
+			     GDK_PIXBUF_ERROR,
+			     GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			     "Cannot allocate memory for loading XCF image");
+			goto bail;
+		}
 
 		if (mask->visible)
 			layer->layer_mask = mask;
 		else
 			g_free (mask);
 
-		//rewind...
-		fseek (f, mpos1, SEEK_SET);
-
 		//rewind to the previous position
-		fseek (f, mpos, SEEK_SET);
+		xcf_reader_seek (reader, mpos);
 	}
 
 	//Channels goes here, don't read
 
 	LOG("Done parsing\n");
 
-	//Compose the pixbuf
-	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
-	LOG ("pixbuf %d %d\n", gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf));
-	LOG ("PrepareFunc\n");
-	if (context && context->prepare_func)
-		(* context->prepare_func) (pixbuf, NULL, context->user_data);
+	if (reader->error) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Truncated or corrupt XCF file");
+		goto bail;
+	}
+
+	image->width = width;
+	image->height = height;
+	image->color_mode = color_mode;
+	image->compression = compression;
+	image->layers = layers;
+	return TRUE;
+
+bail:
+	image->layers = layers;
+	xcf_image_clear (image);
+	return FALSE;
+}
+
+/*
+ * Let the caller pick a size, and prepare context->pixbuf for the width x
+ * height canvas, rendered at the smallest integer fraction of it that is
+ * still bigger than the requested size.
+ */
+static gboolean
+xcf_image_prepare (XcfContext *context, guint32 width, guint32 height, GError **error)
+{
+	int scale = 1;
+
+	if (context->size_func) {
+		gint w = width;
+		gint h = height;
+		(* context->size_func) (&w, &h, context->user_data);
+		if (w == 0 || h == 0) {
+			g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Transformed XCF has zero width or height");
+			return FALSE;
+		}
+		if (w > 0 && h > 0) {
+			scale = MAX (1, MIN (width / w, height / h));
+			context->requested_width = w;
+			context->requested_height = h;
+		}
+		LOG ("requested size %dx%d, scale 1/%d\n", w, h, scale);
+	}
+
+	//The (downscaled) canvas, or the requested area of it
+	int x = 0;
+	int y = 0;
+	int pixbuf_width = (width + scale - 1) / scale;
+	int pixbuf_height = (height + scale - 1) / scale;
+	if (context->viewport_width > 0 && context->viewport_height > 0) {
+		x = context->viewport_x;
+		y = context->viewport_y;
+		pixbuf_width = context->viewport_width;
+		pixbuf_height = context->viewport_height;
+	}
 
-	if (!pixbuf)
+	GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, pixbuf_width, pixbuf_height);
+	if (!pixbuf) {
 		g_set_error (error,
 				     GDK_PIXBUF_ERROR,
 				     GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
 				     "Cannot allocate memory for loading XCF image");
-
+		return FALSE;
+	}
+	LOG ("pixbuf %d %d\n", gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf));
 	gdk_pixbuf_fill (pixbuf, 0x00000000);
 
-	GList *current;
-	gchar pixels[16384];
-	for (current = g_list_first (layers); current; current = g_list_next(current)) {
-		XcfLayer *layer = current->data;
-		if (!layer->visible)
-			continue;
-
-		fseek (f, layer->lptr, SEEK_SET);
-		//Ignore Level w and h (same as hierarchy)
-		fseek (f, 2 * sizeof(guint32), SEEK_CUR);
+	context->pixbuf = pixbuf;
+	context->scale = scale;
+	context->x = x;
+	context->y = y;
+	context->rendered = g_new0 (guchar, ((pixbuf_width + REGION_SIZE - 1) / REGION_SIZE) * ((pixbuf_height + REGION_SIZE - 1) / REGION_SIZE));
 
+	LOG ("PrepareFunc\n");
+	if (context->prepare_func)
+		(* context->prepare_func) (pixbuf, NULL, context->user_data);
 
-		//Iterate on the tiles
-		guint32 tptr;
-		int tile_id = 0;
-		guchar *pixs = gdk_pixbuf_get_pixels (pixbuf);
-		int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-		int line_width = ceil ((layer->width) / 64.0);
-
-		while (1) {
-			fread (&tptr, sizeof(guint32), 1, f);
-			if (!tptr)
-				break;
-			tptr = GUINT32_FROM_BE(tptr);
-			long lpos = ftell (f);
-			fseek (f, tptr, SEEK_SET);
-
-			int ox = 64 * (tile_id % line_width);
-			int oy = 64 * (tile_id / line_width);
-			int tw = MIN (64, layer->width - ox);
-			int th = MIN (64, layer->height - oy);
-			ox += layer->dx;
-			oy += layer->dy;
-			//LOG("\tTile %d %d (%d %d) (%d %d)\n", tile_id, tptr, ox, oy, tw, th);
-
-			//if the tile doesn't intersect with the canvas, ignore
-			if (ox + tw < 0 || oy + th < 0 || ox > (int)width || oy > (int)height ) {
-				fseek (f, lpos, SEEK_SET);
-				tile_id++;
-				continue;
-			}
-
-			//decompress
-			if (compression == COMPRESSION_RLE)
-				rle_decode (f, pixels, tw*th, layer->type);
-			else {//COMPRESSION_NONE
-				int channels;
-				switch (layer->type) {
-					case LAYERTYPE_RGB : channels = 3; break;
-					case LAYERTYPE_RGBA: channels = 4; break;
-					case LAYERTYPE_GRAYSCALE: channels = 1; break;
-					case LAYERTYPE_GRAYSCALEA: channels = 2; break;
-					case LAYERTYPE_INDEXED: channels = 1; break;
-					case LAYERTYPE_INDEXEDA: channels = 2; break;
-				}
-				fread (pixels, sizeof(gchar), tw*th*channels, f);
-			}
+	return TRUE;
+}
 
-			//pad to rgba
-			to_rgba (pixels, tw*th, layer->type);
+//drop the prepared pixbuf, and the progressive rendering state
+static void
+xcf_image_unprepare (XcfContext *context)
+{
+	if (context->pixbuf)
+		g_object_unref (context->pixbuf);
+	context->pixbuf = NULL;
+	g_free (context->rendered);
+	context->rendered = NULL;
+	context->thumbnail = FALSE;
+	xcf_image_clear (&context->image);
+	context->parsed = FALSE;
+}
 
-			//apply mask
-			if (layer->layer_mask)
-				apply_mask (f, compression, pixels, tw*th, layer->layer_mask, tile_id);
+/*
+ * Fill context->pixbuf from the thumbnail embedded in the file, if it's at
+ * least as large as the size requested by size_func, instead of compositing
+ * the layers. Returns FALSE if the layers have to be rendered.
+ */
+static gboolean
+xcf_image_render_thumbnail (XcfReader *reader, XcfImage *image, XcfContext *context)
+{
+	GdkPixbufLoader *loader;
+	GdkPixbuf *thumbnail;
+	const guchar *data;
+	gboolean loaded;
+	int width, height, regions;
+
+	if (context->thumbnail)
+		return TRUE;
+	if (!image->thumbnail || context->requested_width <= 0 || context->viewport_width > 0 ||
+	    image->thumbnail + image->thumbnail_length > reader->length)
+		return FALSE;
 
-			//reduce the tile to its intersection with the canvas
-			intersect_tile (pixels, width, height, &ox, &oy, &tw, &th);
+	xcf_reader_seek (reader, image->thumbnail);
+	data = xcf_reader_peek (reader, image->thumbnail_length);
+	if (!data)
+		return FALSE;
 
-			//apply layer opacity
-			apply_opacity (pixels, tw*th, layer->opacity);
+	loader = gdk_pixbuf_loader_new ();
+	loaded = gdk_pixbuf_loader_write (loader, data, image->thumbnail_length, NULL);
+	loaded = gdk_pixbuf_loader_close (loader, NULL) && loaded;
+	thumbnail = loaded ? gdk_pixbuf_loader_get_pixbuf (loader) : NULL;
+	if (!thumbnail ||
+	    gdk_pixbuf_get_width (thumbnail) < context->requested_width ||
+	    gdk_pixbuf_get_height (thumbnail) < context->requested_height) {
+		LOG ("thumbnail unusable\n");
+		g_object_unref (loader);
+		return FALSE;
+	}
 
-			//composite
-			composite (pixs, rowstride, pixels, ox, oy, tw, th, layer->mode);
+	width = gdk_pixbuf_get_width (context->pixbuf);
+	height = gdk_pixbuf_get_height (context->pixbuf);
+	gdk_pixbuf_scale (thumbnail, context->pixbuf, 0, 0, width, height, 0, 0,
+			  (double)width / gdk_pixbuf_get_width (thumbnail),
+			  (double)height / gdk_pixbuf_get_height (thumbnail),
+			  GDK_INTERP_BILINEAR);
+	g_object_unref (loader);
+
+	regions = ((width + REGION_SIZE - 1) / REGION_SIZE) * ((height + REGION_SIZE - 1) / REGION_SIZE);
+	memset (context->rendered, TRUE, regions);
+	context->thumbnail = TRUE;
+	if (context->update_func)
+		(* context->update_func) (context->pixbuf, 0, 0, width, height, context->user_data);
+	return TRUE;
+}
 
-			//notify
-			if (context && context->update_func)
-				(* context->update_func) (pixbuf, ox, oy, tw, th, context->user_data);
+static GdkPixbuf*
+xcf_image_load_real (XcfReader *reader, XcfContext *context, GError **error)
+{
+	XcfImage image;
+	GdkPixbuf *pixbuf = NULL;
 
+	xcf_simd_init ();
 
-			fseek (f, lpos, SEEK_SET);
-			tile_id++;
+	gint64 t = xcf_stats_time (reader->stats, STAGE_NONE, 0);
+	if (!xcf_image_parse (reader, &image, error))
+		goto bail;
+	if (reader->stats) {
+		GList *current;
+		xcf_stats_time (reader->stats, STAGE_PARSE, t);
+		reader->stats->width = image.width;
+		reader->stats->height = image.height;
+		for (current = g_list_first (image.layers); current; current = g_list_next (current)) {
+			XcfLayer *layer = current->data;
+			reader->stats->layers[MIN (layer->mode, LAYERMODE_GRAINMERGE + 1)]++;
 		}
 	}
 
-	//free the layers and masks
-	for (current = g_list_first (layers); current; current = g_list_next(current)) {
-		XcfLayer *layer = current->data;
-		if (layer->layer_mask)
-			g_free (layer->layer_mask);
+	//the progressive loader may have prepared it already
+	if (!context->pixbuf && !xcf_image_prepare (context, image.width, image.height, error))
+		goto bail;
+
+	if (!xcf_image_render_thumbnail (reader, &image, context) &&
+	    !render_layers (reader, &image, FALSE, context)) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Truncated or corrupt XCF file");
+		goto bail;
 	}
-	g_list_free (layers);
+	pixbuf = g_object_ref (context->pixbuf);
+
+bail:
+	xcf_image_clear (&image);
+	xcf_image_unprepare (context);
 
 	return pixbuf;
 }
 
-/* Static Loader */
-
 static GdkPixbuf*
-xcf_image_load (FILE *f, GError **error)
+xcf_image_load_file (FILE *f, XcfContext *context, GError **error)
 {
-	guint type;
+	XcfReader reader;
+	GdkPixbuf *pixbuf;
 
-	guchar buffer[8];
-	fread (buffer, sizeof(guchar), 8, f);
-	rewind (f);
-
-	if (!strncmp (buffer, "BZh", 3)) {
-		type = FILETYPE_XCF_BZ2;
-	} else if (!strncmp (buffer, "\x1f\x8b", 2)) {
-		type = FILETYPE_XCF_GZ;
-	} else if (!strncmp (buffer, "gimp xcf", 8)) {
-		type = FILETYPE_XCF;
-	} else {
+	if (!xcf_reader_init_file (&reader, f)) {
 		g_set_error (error,
 			     GDK_PIXBUF_ERROR,
-			     GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
-			     "Unknown XCF file type");
+			     GDK_PIXBUF_ERROR_FAILED,
+			     "Failed to read XCF file");
 		return NULL;
 	}
 
-	if (type == FILETYPE_XCF)
-		return xcf_image_load_real (f, NULL, error);
+	reader.stats = context->stats;
+	pixbuf = xcf_image_load_real (&reader, context, error);
+	xcf_reader_clear (&reader);
+
+	return pixbuf;
+}
+
+//The file type, from the first size bytes of the file
+static guint
+xcf_file_type (const guchar *buf, gsize size)
+{
+	if (size >= 9 && !strncmp (buf, "gimp xcf ", 9))
+		return FILETYPE_XCF;
+	if (size >= 3 && !strncmp (buf, "BZh", 3))
+		return FILETYPE_XCF_BZ2;
+	if (size >= 2 && !strncmp (buf, "\x1f\x8b", 2))
+		return FILETYPE_XCF_GZ;
+	if (size >= 6 && !memcmp (buf, "\xfd" "7zXZ\0", 6))
+		return FILETYPE_XCF_XZ;
+	if (size >= 4 && !memcmp (buf, "\x28\xb5\x2f\xfd", 4))
+		return FILETYPE_XCF_ZST;
+	return FILETYPE_UNKNOWN;
+}
+
+#if GIO_2_23
+//bzip2 blocks are decompressed on the rendering threads when there's more than one
+static GConverter*
+xcf_decompressor_new (guint type, GError **error)
+{
+	int threads = render_threads ();
+
+	switch (type) {
+	case FILETYPE_XCF_GZ:
+		return G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+	case FILETYPE_XCF_BZ2:
+		if (threads > 1)
+			return G_CONVERTER (xcf_bz2_decompressor_new (threads));
+		return G_CONVERTER (yelp_bz2_decompressor_new ());
+#if HAVE_LZMA
+	case FILETYPE_XCF_XZ:
+		return G_CONVERTER (xcf_xz_decompressor_new ());
+#endif
+#if HAVE_ZSTD
+	case FILETYPE_XCF_ZST:
+		return G_CONVERTER (xcf_zstd_decompressor_new ());
+#endif
+	}
+
+	g_set_error (error,
+		     GDK_PIXBUF_ERROR,
+		     GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+		     type == FILETYPE_XCF_XZ ? "Xz XCF support is disabled" : "Zstd XCF support is disabled");
+	return NULL;
+}
+#endif
+
+/* Static Loader */
 
+/* Decompress the whole .xcf.bz2, .xcf.gz, .xcf.xz or .xcf.zst file f into buffer */
+static gboolean
+xcf_decompress_file (FILE *f, guint type, XcfBuffer *buffer, GError **error)
+{
 #if GIO_2_23
-	if (type == FILETYPE_XCF_BZ2 ||
-	    type == FILETYPE_XCF_GZ) {
+	if (type != FILETYPE_XCF) {
 		GConverter *decompressor;
-		GInputStream *input, *stream;
+		gboolean finished = FALSE;
+		guchar buf [65536];
+		gsize count;
 
-		if (type == FILETYPE_XCF_BZ2)
-			decompressor = G_CONVERTER (yelp_bz2_decompressor_new ());
-		else
-			decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
-		input = g_unix_input_stream_new (fileno (f), FALSE);
-		stream = (GInputStream *) g_converter_input_stream_new (input, decompressor);
+		decompressor = xcf_decompressor_new (type, error);
+		if (!decompressor)
+			return FALSE;
+
+		do {
+			count = fread (buf, sizeof (guchar), sizeof (buf), f);
+			if (!xcf_buffer_append_converted (buffer, decompressor, buf, count,
+							  count ? G_CONVERTER_NO_FLAGS : G_CONVERTER_INPUT_AT_END,
+							  &finished, error)) {
+				LOG ("decompression failed\n");
+				g_object_unref (decompressor);
+				return FALSE;
+			}
+		} while (count && !finished);
 		g_object_unref (decompressor);
-		g_object_unref (input);
 
-		gchar *tempname;
-		gint fd = g_file_open_tmp ("gdkpixbuf-xcf-tmp.XXXXXX", &tempname, NULL);
-		if (fd < 0) {
-			gint save_errno = errno;
-			g_set_error (error,
-					G_FILE_ERROR,
-					g_file_error_from_errno (save_errno),
-					"Failed to create temporary file when loading Xcf image");
-			return NULL;
-		}
-		GOutputStream *output;
-		output = g_unix_output_stream_new (fd, TRUE);
-		if (!g_output_stream_splice (G_OUTPUT_STREAM (output), stream,
-					     G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-					     NULL, NULL)) {
-			LOG ("splicing failed\n");
+		//the input ended, or failed, before the end of the compressed stream
+		if (!finished || ferror (f)) {
 			g_set_error (error,
 				     GDK_PIXBUF_ERROR,
-				     GDK_PIXBUF_ERROR_FAILED,
-				     "Decompression error while loading Xcf.gz file");
-			return NULL;
+				     GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				     "Compressed data truncated while loading Xcf file");
+			return FALSE;
 		}
-
-		FILE *file;
-		file = fopen (tempname, "r");
-		g_unlink (tempname);
-		g_free (tempname);
-
-		GdkPixbuf *pixbuf = xcf_image_load_real (file, NULL, error);
-		fclose (file);
-
-		return pixbuf;
 	}
 #else
-	/* Decompress the xcf.bz2 file to a temp file */
 	if (type == FILETYPE_XCF_BZ2) {
-		gchar *tempname;
-		gint fd = g_file_open_tmp ("gdkpixbuf-xcf-tmp.XXXXXX", &tempname, NULL);
-		if (fd < 0) {
-			gint save_errno = errno;
-			g_set_error (error,
-					G_FILE_ERROR,
-					g_file_error_from_errno (save_errno),
-					"Failed to create temporary file when loading Xcf image");
-			return NULL;
-		}
-
-		FILE *file = fdopen (fd, "w+");
-		if (!file) {
-			gint save_errno = errno;
-			g_set_error (error,
-					G_FILE_ERROR,
-					g_file_error_from_errno (save_errno),
-					"Failed to open temporary file when loading Xcf image");
-			g_free (tempname);
-			return NULL;
-		}
-
 		int bzerror;
 		BZFILE *b = BZ2_bzReadOpen (&bzerror, f, 0, 0, NULL, 0);
 		if (bzerror != BZ_OK) {
 			BZ2_bzReadClose (&bzerror, b);
-			fclose (file);
-			g_unlink (tempname);
-			g_free (tempname);
 			g_set_error (error,
 					GDK_PIXBUF_ERROR,
 					GDK_PIXBUF_ERROR_FAILED,
 					"Failed to initialize bz2 decompressor");
-			return NULL;
+			return FALSE;
 		}
 
 		bzerror = BZ_OK;
@@ -1324,61 +4062,162 @@ xcf_image_load (FILE *f, GError **error)
 		while (bzerror == BZ_OK) {
 			nBuf = BZ2_bzRead (&bzerror, b, buf, 65536);
 			if (bzerror == BZ_OK || bzerror == BZ_STREAM_END)
-				if (fwrite (buf, sizeof (guchar), nBuf, file) != nBuf) {
-					gint save_errno = errno;
-					g_set_error (error,
-							     G_FILE_ERROR,
-							     g_file_error_from_errno (save_errno),
-							     "Failed to write to temporary file when loading Xcf image");
+				if (!xcf_buffer_append (buffer, buf, nBuf, error)) {
 					BZ2_bzReadClose (&bzerror, b);
-					fclose (file);
-					g_unlink (tempname);
-					g_free (tempname);
-					return NULL;
+					return FALSE;
 				}
 		}
 
+		LOG ("bzerror = %d\n", bzerror);
 		if (bzerror != BZ_STREAM_END) {
-			LOG ("bzerror = %d\n", bzerror);
 			BZ2_bzReadClose (&bzerror, b);
-			fclose (file);
-			g_unlink (tempname);
-			g_free (tempname);
 			g_set_error (error,
 					GDK_PIXBUF_ERROR,
 					GDK_PIXBUF_ERROR_FAILED,
 					"Decompression error while loading Xcf.bz2 file");
-			return NULL;
-		} else {
-			LOG ("bzerror = %d\n", bzerror);
-			BZ2_bzReadClose (&bzerror, b);
+			return FALSE;
 		}
-
-		fflush (file);
-		rewind (file);
-		g_unlink (tempname);
-		g_free (tempname);
-
-		GdkPixbuf *pixbuf = xcf_image_load_real (file, NULL, error);
-		fclose (file);
-		return pixbuf;
+		BZ2_bzReadClose (&bzerror, b);
 	} else {
 		g_set_error (error,
 			     GDK_PIXBUF_ERROR,
 			     GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
 			     "Unhandled XCF file type");
+		return FALSE;
 	}
 #endif
+
+	return TRUE;
+}
+
+static GdkPixbuf*
+xcf_image_load_with_context (FILE *f, XcfContext *context, GError **error)
+{
+	guint type;
+
+	guchar buffer[9];
+	gsize count = fread (buffer, sizeof(guchar), 9, f);
+	rewind (f);
+
+	type = xcf_file_type (buffer, count);
+	if (type == FILETYPE_UNKNOWN) {
+		g_set_error (error,
+			     GDK_PIXBUF_ERROR,
+			     GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			     "Unknown XCF file type");
+		return NULL;
+	}
+
+	XcfBuffer xcf_buffer;
+	XcfReader reader;
+	GdkPixbuf *pixbuf = NULL;
+	struct stat st;
+	gsize size_hint = 65536;
+	gboolean regular = fstat (fileno (f), &st) == 0 && S_ISREG (st.st_mode);
+
+	context->stats = xcf_stats_new ();
+	if (context->stats) {
+		context->stats->file_type = type;
+		context->stats->input_bytes = regular ? st.st_size : 0;
+	}
+
+	if (type == FILETYPE_XCF) {
+		pixbuf = xcf_image_load_file (f, context, error);
+		xcf_stats_emit (context->stats, pixbuf);
+		context->stats = NULL;
+		return pixbuf;
+	}
+
+	/* Decompress the file in memory, sized from the compressed length */
+	if (regular)
+		size_hint = MAX (size_hint, 4 * (guint64)st.st_size);
+	xcf_buffer_init (&xcf_buffer, size_hint);
+
+	gint64 t = xcf_stats_time (context->stats, STAGE_NONE, 0);
+	if (!xcf_decompress_file (f, type, &xcf_buffer, error))
+		goto bail;
+	xcf_stats_time (context->stats, STAGE_DECOMPRESS, t);
+
+	if (xcf_buffer_open_reader (&xcf_buffer, &reader, error)) {
+		reader.stats = context->stats;
+		pixbuf = xcf_image_load_real (&reader, context, error);
+		xcf_reader_clear (&reader);
+	}
+
+bail:
+	xcf_buffer_clear (&xcf_buffer);
+	xcf_stats_emit (context->stats, pixbuf);
+	context->stats = NULL;
+	return pixbuf;
+}
+
+static GdkPixbuf*
+xcf_image_load (FILE *f, GError **error)
+{
+	XcfContext context;
+
+	memset (&context, 0, sizeof (XcfContext));
+	return xcf_image_load_with_context (f, &context, error);
 }
 
 
 /* Progressive loader */
 
 /*
- * as the layers are packed top down in the xcf format, and we have to render them bottom-up,
- * we need the full file loaded to start rendering
+ * The layers are packed top down in the xcf format, and we have to render
+ * them bottom-up, so a region can only be rendered once the tiles of every
+ * layer covering it have arrived. As the (decompressed) data comes in:
+ * - the pixbuf is prepared as soon as the header is there,
+ * - the layers are parsed once their headers and tile pointers are all
+ *   there. A failed attempt is retried from the start when the bytes it
+ *   missed have arrived,
+ * - then every region whose tiles are all there is rendered.
+ * stop_load renders the rest. There's no progressive rendering once the
+ * data is moved to a temporary file.
  */
 
+static gboolean
+xcf_image_progress (XcfContext *context, GError **error)
+{
+	GByteArray *data = context->buffer.data;
+	XcfReader reader;
+
+	if (!data || data->len < MAX (context->wanted, XCF_HEADER_SIZE) || strncmp ((gchar*)data->data, "gimp xcf ", 9))
+		return TRUE;
+
+	xcf_reader_init_memory (&reader, data->data, data->len);
+	reader.stats = context->stats;
+
+	if (!context->pixbuf) {
+		XcfImage header;
+		if (!xcf_image_parse_header (&reader, &header, error) ||
+		    !xcf_image_prepare (context, header.width, header.height, error))
+			return FALSE;
+		xcf_reader_seek (&reader, 0);
+	}
+
+	if (!context->parsed) {
+		xcf_simd_init ();
+		gint64 t = xcf_stats_time (context->stats, STAGE_NONE, 0);
+		gboolean parsed = xcf_image_parse (&reader, &context->image, NULL);
+		xcf_stats_time (context->stats, STAGE_PARSE, t);
+		if (!parsed) {
+			//wait for what's missing, let stop_load report any other error
+			context->wanted = reader.error ? MAX ((goffset)data->len + 1, reader.wanted) : G_MAXSIZE;
+			return TRUE;
+		}
+		context->parsed = TRUE;
+	}
+
+	//the regions that failed are left for stop_load, which reports the error
+	if (!xcf_image_render_thumbnail (&reader, &context->image, context) &&
+	    !render_layers (&reader, &context->image, TRUE, context))
+		LOG ("corrupt regions left for stop_load\n");
+	xcf_reader_clear (&reader);
+	return TRUE;
+}
+
+
 static gpointer
 xcf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
 		GdkPixbufModulePreparedFunc prepare_func,
@@ -1388,9 +4227,8 @@ xcf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
 {
 	LOG ("Begin\n");
 	XcfContext *context;
-	gint fd;
 
-	context = g_new (XcfContext, 1);
+	context = g_new0 (XcfContext, 1);
 	context->size_func = size_func;
 	context->prepare_func = prepare_func;
 	context->update_func = update_func;
@@ -1398,23 +4236,11 @@ xcf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
 	context->type = FILETYPE_UNKNOWN;
 	context->bz_stream = NULL;
 #if GIO_2_23
-	context->stream = NULL;
-	context->input = NULL;
+	context->decompressor = NULL;
 #endif
 
-	fd = g_file_open_tmp ("gdkpixbuf-xcf-tmp.XXXXXX", &context->tempname, NULL);
-
-	if (fd < 0) {
-		g_free (context);
-		return NULL;
-	}
-
-	context->file = fdopen (fd, "w+");
-	if (!context->file) {
-		g_free (context->tempname);
-		g_free (context);
-		return NULL;
-	}
+	xcf_buffer_init (&context->buffer, 65536);
+	context->stats = xcf_stats_new ();
 
 	return context;
 }
@@ -1428,50 +4254,56 @@ xcf_image_stop_load (gpointer data, GError **error)
 
 	g_return_val_if_fail (data, TRUE);
 
-#if GIO_2_23
-	if (context->type == FILETYPE_XCF_GZ ||
-	    context->type == FILETYPE_XCF_BZ2) {
-		g_object_unref (context->input);
-		context->input = NULL;
+	//render the regions still missing
+	xcf_image_clear (&context->image);
+	context->parsed = FALSE;
 
-		gchar buf [65536];
-		gsize count;
-		while ((count = g_input_stream_read (G_INPUT_STREAM (context->stream),
-						     &buf, sizeof (buf), NULL, error)) > 0) {
-			/* An error on the first run? */
-			if (count == -1)
-				break;
-			if (fwrite (buf, sizeof (gchar), count, context->file) != count) {
-				gint save_errno = errno;
-				g_set_error (error,
-					     G_FILE_ERROR,
-					     g_file_error_from_errno (save_errno),
-					     "Failed to write to temporary file when loading Xcf image");
-				retval = FALSE;
-				goto bail;
-			}
+#if GIO_2_23
+	if (context->decompressor && context->type != FILETYPE_STREAMCLOSED) {
+		//flush the decompressor
+		gboolean finished = FALSE;
+		gint64 t = xcf_stats_time (context->stats, STAGE_NONE, 0);
+		if (!xcf_buffer_append_converted (&context->buffer, context->decompressor, NULL, 0,
+						  G_CONVERTER_INPUT_AT_END, &finished, error)) {
+			retval = FALSE;
+			goto bail;
 		}
-		if (count == -1) {
-			/* error is already set */
+		xcf_stats_time (context->stats, STAGE_DECOMPRESS, t);
+		if (!finished) {
+			g_set_error (error,
+				     GDK_PIXBUF_ERROR,
+				     GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				     "Compressed data truncated while loading Xcf file");
 			retval = FALSE;
 			goto bail;
 		}
-		goto done;
+	}
+#else
+	if (context->type == FILETYPE_XCF_BZ2) { //the bz2 stream didn't end
+		g_set_error (error,
+			     GDK_PIXBUF_ERROR,
+			     GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			     "Compressed data truncated while loading Xcf file");
+		retval = FALSE;
+		goto bail;
 	}
 #endif
 	if (context->type == FILETYPE_XCF ||
 #if GIO_2_23
-	    context->type == FILETYPE_XCF_GZ ||
+	    context->decompressor ||
 #endif
-	    context->type == FILETYPE_XCF_BZ2) {
-		fflush (context->file);
-		rewind (context->file);
-		if (context->tempname) {
-			g_unlink (context->tempname);
-			g_free (context->tempname);
-			context->tempname = NULL;
+	    context->type == FILETYPE_XCF_BZ2 ||
+	    context->type == FILETYPE_STREAMCLOSED) {
+		XcfReader reader;
+		if (!xcf_buffer_open_reader (&context->buffer, &reader, error)) {
+			retval = FALSE;
+			goto bail;
 		}
-		GdkPixbuf *pixbuf = xcf_image_load_real (context->file, context, error);
+		reader.stats = context->stats;
+		GdkPixbuf *pixbuf = xcf_image_load_real (&reader, context, error);
+		xcf_reader_clear (&reader);
+		xcf_stats_emit (context->stats, pixbuf);
+		context->stats = NULL;
 		if (!pixbuf)
 			retval = FALSE;
 		else
@@ -1481,34 +4313,22 @@ xcf_image_stop_load (gpointer data, GError **error)
 		g_set_error (error,
 			     G_FILE_ERROR,
 			     GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
-			     "Gzip XCF support is disabled");
+			     "Compressed XCF support is disabled");
 		goto bail;
 	}
 
-done:
-	fflush (context->file);
-	rewind (context->file);
-	if (context->tempname) {
-		g_unlink (context->tempname);
-		g_free (context->tempname);
-		context->tempname = NULL;
-	}
-	GdkPixbuf *pixbuf = xcf_image_load_real (context->file, context, error);
-	if (!pixbuf)
-		retval = FALSE;
-	else
-		g_object_unref (pixbuf);
-
 bail:
 #if GIO_2_23
-	if (context->stream)
-		g_object_unref (context->stream);
+	if (context->decompressor)
+		g_object_unref (context->decompressor);
 #endif
-	fclose (context->file);
-	if (context->tempname) {
-		g_unlink (context->tempname);
-		g_free (context->tempname);
+	if (context->bz_stream) {
+		BZ2_bzDecompressEnd (context->bz_stream);
+		g_free (context->bz_stream);
 	}
+	xcf_buffer_clear (&context->buffer);
+	xcf_image_unprepare (context);
+	xcf_stats_emit (context->stats, NULL);
 	g_free (context);
 
 	return retval;
@@ -1530,27 +4350,13 @@ xcf_image_load_increment (gpointer data,
 	}
 
 	if (context->type == FILETYPE_UNKNOWN) { // first chunk
-		if (!strncmp (buf, "gimp xcf ", 9)) {
-			context->type = FILETYPE_XCF;
-		} else if (!strncmp (buf, "BZh", 3)) {
-			context->type = FILETYPE_XCF_BZ2;
-		} else if (!strncmp (buf, "\x1f\x8b", 2)) {
-			context->type = FILETYPE_XCF_GZ;
-		}
+		context->type = xcf_file_type (buf, size);
 
 #if GIO_2_23
-		if (context->type == FILETYPE_XCF_GZ ||
-		    context->type == FILETYPE_XCF_BZ2) {
-			GConverter *decompressor;
-
-			if (context->type == FILETYPE_XCF_BZ2)
-				decompressor = G_CONVERTER (yelp_bz2_decompressor_new ());
-			else
-				decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
-
-			context->input = g_memory_input_stream_new ();
-			context->stream = (GInputStream *) g_converter_input_stream_new (context->input, decompressor);
-			g_object_unref (decompressor);
+		if (context->type != FILETYPE_XCF && context->type != FILETYPE_UNKNOWN) {
+			context->decompressor = xcf_decompressor_new (context->type, error);
+			if (!context->decompressor)
+				return FALSE;
 		}
 #else
 		if (context->type == FILETYPE_XCF_BZ2) {
@@ -1570,23 +4376,41 @@ xcf_image_load_increment (gpointer data,
 		}
 #endif
 		LOG ("File type %d\n", context->type);
+		if (context->stats)
+			context->stats->file_type = context->type;
 	}
 
+	if (context->stats)
+		context->stats->input_bytes += size;
+	gint64 t = xcf_stats_time (context->stats, STAGE_NONE, 0);
+
 	switch (context->type) {
 #if GIO_2_23
 	case FILETYPE_XCF_GZ:
 	case FILETYPE_XCF_BZ2:
-		g_memory_input_stream_add_data (G_MEMORY_INPUT_STREAM (context->input),
-								       buf, size, NULL);
+	case FILETYPE_XCF_XZ:
+	case FILETYPE_XCF_ZST: {
+		//decompress as the data comes in
+		gboolean finished = FALSE;
+		if (!xcf_buffer_append_converted (&context->buffer, context->decompressor, buf, size,
+						  G_CONVERTER_NO_FLAGS, &finished, error))
+			return FALSE;
+		if (finished)
+			context->type = FILETYPE_STREAMCLOSED;
+		xcf_stats_time (context->stats, STAGE_DECOMPRESS, t);
 		break;
+	}
 #else
 	case FILETYPE_XCF_BZ2:
-		gchar *outbuf;
-		outbuf = g_new (gchar, 65536);
 		context->bz_stream->next_in = (gchar*)buf;
 		context->bz_stream->avail_in = size;
-		while (context->bz_stream->avail_in > 0) {
-			context->bz_stream->next_out = outbuf;
+		while (context->bz_stream->avail_in > 0 && context->type != FILETYPE_STREAMCLOSED) {
+			//decompress straight into the buffer
+			gchar outbuf[65536];
+			guchar *dest;
+			if (!xcf_buffer_reserve (&context->buffer, 65536, &dest, error))
+				return FALSE;
+			context->bz_stream->next_out = dest ? (gchar*)dest : outbuf;
 			context->bz_stream->avail_out = 65536;
 			int ret = BZ2_bzDecompress (context->bz_stream);
 			switch (ret) {
@@ -1594,64 +4418,63 @@ xcf_image_load_increment (gpointer data,
 				break;
 			case BZ_STREAM_END:
 				LOG ("End of bz stream\n");
-				BZ2_bzDecompressEnd (context->bz_stream);
 				context->type = FILETYPE_STREAMCLOSED;
 				break;
 			default:
 				BZ2_bzDecompressEnd (context->bz_stream);
 				context->type = FILETYPE_STREAMCLOSED;
 				g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decompress");
-				g_free(outbuf);
-				context->bz_stream->next_out = NULL;
-				outbuf = NULL;
 				g_free(context->bz_stream);
 				context->bz_stream = NULL;
 				return FALSE;
 			}
 
 			int total_out = 65536 - context->bz_stream->avail_out;
-			LOG ("Wrote %d to file %s\n", total_out, context->tempname);
-			if (fwrite (outbuf, sizeof (guchar), total_out, context->file) != total_out) {
-				gint save_errno = errno;
-				g_set_error (error,
-						     G_FILE_ERROR,
-						     g_file_error_from_errno (save_errno),
-						     "Failed to write to temporary file when loading Xcf image");
-				g_free(outbuf);
-				context->bz_stream->next_out = NULL;
-				outbuf = NULL;
-				g_free(context->bz_stream);
-				context->bz_stream = NULL;
+			if (dest)
+				xcf_buffer_commit (&context->buffer, total_out);
+			else if (!xcf_buffer_append (&context->buffer, outbuf, total_out, error))
 				return FALSE;
-			}
-		}
-		g_free(outbuf);
-		context->bz_stream->next_out = NULL;
-		outbuf = NULL;
-		if (context->type == FILETYPE_STREAMCLOSED)
-		{
-		   g_free(context->bz_stream);
-		   context->bz_stream = NULL;
 		}
+		xcf_stats_time (context->stats, STAGE_DECOMPRESS, t);
 		break;
 #endif
 	case FILETYPE_XCF:
 	default:
-		if (fwrite (buf, sizeof (guchar), size, context->file) != size) {
-			gint save_errno = errno;
-			g_set_error (error,
-					     G_FILE_ERROR,
-					     g_file_error_from_errno (save_errno),
-					     "Failed to write to temporary file when loading Xcf image");
+		if (!xcf_buffer_append (&context->buffer, buf, size, error))
 			return FALSE;
-		}
 		break;
 	}
 
-	return TRUE;
+	return xcf_image_progress (context, error);
 }
 
 
+/*
+ * Region of interest loader, not part of the gdk-pixbuf module interface:
+ * look it up with g_module_symbol (). Renders the (x, y, width, height)
+ * area of the canvas of an xcf file, compressed or not, into a width x height
+ * pixbuf, decoding only the tiles intersecting it. The parts of the area
+ * outside of the canvas are transparent.
+ */
+G_MODULE_EXPORT GdkPixbuf*
+xcf_image_load_region (FILE *f, int x, int y, int width, int height, GError **error)
+{
+	XcfContext context;
+
+	if (width <= 0 || height <= 0) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Empty region");
+		return NULL;
+	}
+
+	memset (&context, 0, sizeof (XcfContext));
+	context.viewport_x = x;
+	context.viewport_y = y;
+	context.viewport_width = width;
+	context.viewport_height = height;
+
+	return xcf_image_load_with_context (f, &context, error);
+}
+
 #define MODULE_ENTRY(function) G_MODULE_EXPORT void function
 MODULE_ENTRY (fill_vtable) (GdkPixbufModule *module)
 {
@@ -1668,6 +4491,12 @@ MODULE_ENTRY (fill_info) (GdkPixbufFormat *info)
 		{ "BZh", NULL, 80 },
 #if GIO_2_23
 		{ "\x1f\x8b", NULL, 80 },
+#endif
+#if HAVE_LZMA
+		{ "\xfd" "7zXZ", NULL, 80 },
+#endif
+#if HAVE_ZSTD
+		{ "\x28\xb5\x2f\xfd", NULL, 80 },
 #endif
                 { NULL, NULL, 0 }
         };
@@ -1681,6 +4510,12 @@ MODULE_ENTRY (fill_info) (GdkPixbufFormat *info)
 		"xcf.bz2",
 #if GIO_2_23
 		"xcf.gz",
+#endif
+#if HAVE_LZMA
+		"xcf.xz",
+#endif
+#if HAVE_ZSTD
+		"xcf.zst",
 #endif
 		NULL
 	};
@@ -0,0 +1,754 @@
+/*
+ * Benchmark for the xcf pixbuf loader
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Generates a synthetic corpus of xcf files, loads each of them a number of
+ * times, and reports the latency percentiles and the throughput (canvas
+ * megapixels per second, at the median) of every stage of the loader.
+ *
+ * usage: xcf-bench [iterations [case]]
+ *
+ * The loader is built in, so the stages can be timed on their own:
+ *   decompress	bz2, gz, xz or zstd to memory (compressed cases only)
+ *   parse	header, layers, masks and tile index
+ *   decode	RLE decoding (inflating, or raw reads) of every tile
+ *   to_rgba	raw pixels to rgba (RLE planes are interleaved row by row in
+ *		composite, and high bit depth tiles are converted to 16 bits
+ *		row by row there)
+ *   mask	layer mask decoding (masks are applied row by row in composite)
+ *   composite	interleaving and masking of the rows, clipping, opacity and
+ *		blending on the premultiplied canvas, and its conversion to
+ *		straight alpha
+ *   load	the static loader, end to end
+ *   progressive	the progressive loader, fed 64KB at a time
+ * decode, to_rgba, mask and composite are measured on a single thread, load
+ * and progressive use IO_XCF_THREADS threads.
+ */
+
+#include "io-xcf.c"
+
+#include <time.h>
+
+#define BENCH_ITERATIONS	5
+#define BENCH_CHUNK		65536
+
+enum {
+	BENCH_DECOMPRESS,
+	BENCH_PARSE,
+	BENCH_DECODE,
+	BENCH_TO_RGBA,
+	BENCH_MASK,
+	BENCH_COMPOSITE,
+	BENCH_LOAD,
+	BENCH_PROGRESSIVE,
+	BENCH_STAGES
+};
+
+static const gchar *bench_stage_names[BENCH_STAGES] = {
+	"decompress",
+	"parse",
+	"decode",
+	"to_rgba",
+	"mask",
+	"composite",
+	"load",
+	"progressive",
+};
+
+typedef struct _BenchCase BenchCase;
+struct _BenchCase {
+	const gchar *name;
+	guint32 width;
+	guint32 height;
+	int layers;
+	gboolean modes;		//cycle through the blend modes, instead of normal only
+	gboolean masks;
+	gchar compression;	//tile compression
+	guint type;		//file compression
+	gboolean flattened;	//the top layer is an opaque copy of the canvas, hiding the others
+	guint32 version;	//0 for a "file" one, 64 bits pointers from 11
+	guint32 precision;	//in v004+ files
+	gboolean indexed;	//indexed color mode, with a 256 colors palette
+};
+
+static const BenchCase cases[] = {
+	{ "small-rle",		 256,  256,  4, FALSE, FALSE, COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "small-raw",		 256,  256,  4, FALSE, FALSE, COMPRESSION_NONE, FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "medium-rle",		1024,  768,  8, FALSE, FALSE, COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "medium-raw",		1024,  768,  8, FALSE, FALSE, COMPRESSION_NONE, FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "medium-zlib",	1024,  768,  8, FALSE, FALSE, COMPRESSION_ZLIB, FILETYPE_XCF,     FALSE, 11, 150, FALSE },
+	{ "medium-modes",	1024,  768, 21, TRUE,  FALSE, COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "medium-masks",	1024,  768,  8, FALSE, TRUE,  COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "medium-bz2",		1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF_BZ2, FALSE,  0,   0, FALSE },
+#if GIO_2_23
+	{ "medium-gz",		1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF_GZ,  FALSE,  0,   0, FALSE },
+#endif
+#if HAVE_LZMA
+	{ "medium-xz",		1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF_XZ,  FALSE,  0,   0, FALSE },
+#endif
+#if HAVE_ZSTD
+	{ "medium-zst",		1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF_ZST, FALSE,  0,   0, FALSE },
+#endif
+	{ "medium-flattened",	1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF,     TRUE,   0,   0, FALSE },
+	{ "medium-u16",		1024,  768,  8, TRUE,  TRUE,  COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  7, 200, FALSE },
+	{ "medium-float",	1024,  768,  8, TRUE,  TRUE,  COMPRESSION_NONE, FILETYPE_XCF,     FALSE,  7, 600, FALSE },
+	{ "medium-indexed",	1024,  768,  8, FALSE, TRUE,  COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  1,   0, TRUE  },
+	{ "tall-32-layers",	 512, 4096, 32, TRUE,  FALSE, COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "large-rle",		4096, 3072,  4, FALSE, TRUE,  COMPRESSION_RLE,  FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+	{ "large-raw",		4096, 3072,  2, FALSE, FALSE, COMPRESSION_NONE, FILETYPE_XCF,     FALSE,  0,   0, FALSE },
+};
+
+//every mode but behind
+static const guint32 bench_modes[] = {
+	LAYERMODE_NORMAL, LAYERMODE_DISSOLVE, LAYERMODE_MULTIPLY, LAYERMODE_SCREEN,
+	LAYERMODE_OVERLAY, LAYERMODE_DIFFERENCE, LAYERMODE_ADDITION, LAYERMODE_SUBTRACT,
+	LAYERMODE_DARKENONLY, LAYERMODE_LIGHTENONLY, LAYERMODE_HUE, LAYERMODE_SATURATION,
+	LAYERMODE_COLOR, LAYERMODE_VALUE, LAYERMODE_DIVIDE, LAYERMODE_DODGE,
+	LAYERMODE_BURN, LAYERMODE_HARDLIGHT, LAYERMODE_SOFTLIGHT, LAYERMODE_GRAINEXTRACT,
+	LAYERMODE_GRAINMERGE,
+};
+
+static gint64
+bench_now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Corpus */
+
+static void
+put32 (GByteArray *out, guint32 value)
+{
+	value = GUINT32_TO_BE (value);
+	g_byte_array_append (out, (guint8*)&value, sizeof(guint32));
+}
+
+static void
+set32 (GByteArray *out, gsize offset, guint32 value)
+{
+	value = GUINT32_TO_BE (value);
+	memcpy (out->data + offset, &value, sizeof(guint32));
+}
+
+//a file offset, 64 bits from v011
+static void
+put_pointer (GByteArray *out, const BenchCase *bench, guint64 value)
+{
+	if (bench->version < 11) {
+		put32 (out, value);
+		return;
+	}
+	value = GUINT64_TO_BE (value);
+	g_byte_array_append (out, (guint8*)&value, sizeof(guint64));
+}
+
+static void
+set_pointer (GByteArray *out, const BenchCase *bench, gsize offset, guint64 value)
+{
+	if (bench->version < 11) {
+		set32 (out, offset, value);
+		return;
+	}
+	value = GUINT64_TO_BE (value);
+	memcpy (out->data + offset, &value, sizeof(guint64));
+}
+
+static int
+pointer_size (const BenchCase *bench)
+{
+	return bench->version < 11 ? sizeof(guint32) : sizeof(guint64);
+}
+
+static void
+put8 (GByteArray *out, guint8 value)
+{
+	g_byte_array_append (out, &value, 1);
+}
+
+static void
+put_property (GByteArray *out, guint32 property, guint32 value)
+{
+	put32 (out, property);
+	put32 (out, sizeof(guint32));
+	put32 (out, value);
+}
+
+static void
+put_string (GByteArray *out, const gchar *string)
+{
+	put32 (out, strlen (string) + 1);
+	g_byte_array_append (out, (const guint8*)string, strlen (string) + 1);
+}
+
+static void
+rle_encode (GByteArray *out, const guchar *plane, int count)
+{
+	int i = 0;
+
+	while (i < count) {
+		int run = 1;
+		while (i + run < count && run < 65535 && plane[i + run] == plane[i])
+			run++;
+
+		if (run >= 3) {
+			if (run <= 127)
+				put8 (out, run - 1);
+			else {
+				put8 (out, 127);
+				put8 (out, run >> 8);
+				put8 (out, run & 0xff);
+			}
+			put8 (out, plane[i]);
+			i += run;
+			continue;
+		}
+
+		//literal, up to the next run of 3
+		int start = i;
+		while (i < count && i - start < 127 &&
+		       !(i + 2 < count && plane[i] == plane[i + 1] && plane[i] == plane[i + 2]))
+			i++;
+		put8 (out, 256 - (i - start));
+		g_byte_array_append (out, plane + start, i - start);
+	}
+}
+
+//a mix of flat, gradient, noisy and transparent 32x32 blocks
+static guchar
+bench_pixel (int layer, int x, int y, int channel, int channels)
+{
+	guint32 block = ((x >> 5) * 73856093u) ^ ((y >> 5) * 19349663u) ^ (layer * 83492791u);
+	guint32 noise = (x * 2654435761u) ^ (y * 40503u) ^ (channel * 7919u);
+
+	if (channel == channels - 1 && channels % 2 == 0) { //alpha
+		switch (block % 4) {
+		case 0: return 0;
+		case 1: return (x + y) & 0xff;
+		default: return 0xff;
+		}
+	}
+
+	switch ((block >> 3) % 3) {
+	case 0: return (block >> (8 * channel)) & 0xff;
+	case 1: return (x * (channel + 1) + y) & 0xff;
+	default: return (noise >> 11) & 0xff;
+	}
+}
+
+//the bytes of an 8 bits value in a file of precision, big endian
+static int
+bench_component (guchar value, guint32 precision, guchar *bytes)
+{
+	if (precision / 100 == 2) { //u16
+		bytes[0] = bytes[1] = value;
+		return 2;
+	}
+	if (precision / 100 == 6) { //float
+		float f = value / 255.0f;
+		guint32 bits;
+		memcpy (&bits, &f, sizeof (float));
+		bits = GUINT32_TO_BE (bits);
+		memcpy (bytes, &bits, sizeof (guint32));
+		return 4;
+	}
+	bytes[0] = value;
+	return 1;
+}
+
+//tiles of a level, the pixel of (x, y) being pixel (x, y, channel)
+static void
+put_level (GByteArray *out, const BenchCase *bench, guint32 width, guint32 height, int layer, int channels, gboolean mask)
+{
+	int columns = (width + 63) / 64;
+	int count = columns * ((height + 63) / 64);
+	guchar planes[TILE_BUFFER_SIZE]; //a plane per byte of each channel
+	int tile, i, j, c, b;
+
+	put32 (out, width);
+	put32 (out, height);
+	gsize pointers = out->len;
+	for (tile = 0; tile <= count; tile++)
+		put_pointer (out, bench, 0);
+
+	for (tile = 0; tile < count; tile++) {
+		int ox = 64 * (tile % columns);
+		int oy = 64 * (tile / columns);
+		int tw = MIN (64, width - ox);
+		int th = MIN (64, height - oy);
+
+		set_pointer (out, bench, pointers + tile * pointer_size (bench), out->len);
+		int size = 1;
+		for (c = 0; c < channels; c++)
+			for (j = 0; j < th; j++)
+				for (i = 0; i < tw; i++) {
+					guchar bytes[4];
+					size = bench_component (mask ? (ox + i) * 255 / width : bench_pixel (layer, ox + i, oy + j, c, channels), bench->precision, bytes);
+					for (b = 0; b < size; b++)
+						planes[(c * size + b) * tw * th + j * tw + i] = bytes[b];
+				}
+
+		if (bench->compression == COMPRESSION_RLE) {
+			for (c = 0; c < channels * size; c++)
+				rle_encode (out, planes + c * tw * th, tw * th);
+			continue;
+		}
+
+		//interleaved
+		guchar pixels[TILE_BUFFER_SIZE];
+		for (i = 0; i < tw * th; i++)
+			for (c = 0; c < channels * size; c++)
+				pixels[i * channels * size + c] = planes[c * tw * th + i];
+		if (bench->compression == COMPRESSION_ZLIB) {
+			uLongf len = compressBound (tw * th * channels * size);
+			gsize start = out->len;
+			g_byte_array_set_size (out, start + len);
+			if (compress2 (out->data + start, &len, pixels, tw * th * channels * size, 6) != Z_OK)
+				g_error ("zlib compression failed");
+			g_byte_array_set_size (out, start + len);
+		} else
+			g_byte_array_append (out, pixels, tw * th * channels * size);
+	}
+}
+
+static void
+put_hierarchy (GByteArray *out, const BenchCase *bench, guint32 width, guint32 height, int layer, int channels, gboolean mask)
+{
+	guchar bytes[4];
+
+	put32 (out, width);
+	put32 (out, height);
+	put32 (out, channels * bench_component (0, bench->precision, bytes));
+	gsize level = out->len;
+	put_pointer (out, bench, 0);
+	put_pointer (out, bench, 0);
+	set_pointer (out, bench, level, out->len);
+	put_level (out, bench, width, height, layer, channels, mask);
+}
+
+static GByteArray*
+bench_write_xcf (const BenchCase *bench)
+{
+	GByteArray *out = g_byte_array_new ();
+	int layer;
+
+	gchar magic[14];
+	if (bench->version)
+		g_snprintf (magic, sizeof (magic), "gimp xcf v%03u", bench->version);
+	else
+		strcpy (magic, "gimp xcf file");
+	g_byte_array_append (out, (const guint8*)magic, sizeof (magic));
+	put32 (out, bench->width);
+	put32 (out, bench->height);
+	put32 (out, bench->indexed ? 2 : 0); //indexed or RGB
+	if (bench->version >= 4)
+		put32 (out, bench->precision);
+
+	put32 (out, PROP_COMPRESSION);
+	put32 (out, 1);
+	put8 (out, bench->compression);
+	if (bench->indexed) {
+		int i;
+		put32 (out, PROP_COLORMAP);
+		put32 (out, sizeof(guint32) + 3 * 256);
+		put32 (out, 256);
+		for (i = 0; i < 256; i++) {
+			put8 (out, i * 37);
+			put8 (out, i * 91);
+			put8 (out, i * 151);
+		}
+	}
+	put32 (out, PROP_END);
+	put32 (out, 0);
+
+	gsize pointers = out->len;
+	for (layer = 0; layer <= bench->layers; layer++)
+		put_pointer (out, bench, 0);
+	put_pointer (out, bench, 0); //no channels
+
+	//top-most layer first
+	for (layer = bench->layers - 1; layer >= 0; layer--) {
+		//the bottom layer covers the canvas, the others are smaller and offset
+		gboolean covering = !layer || (bench->flattened && layer == bench->layers - 1);
+		gint32 dx = covering ? 0 : (layer * 37) % 200 - 50;
+		gint32 dy = covering ? 0 : (layer * 91) % 200 - 50;
+		guint32 width = covering ? bench->width : bench->width - bench->width / 8;
+		guint32 height = covering ? bench->height : bench->height - bench->height / 8;
+		guint32 type = covering ? LAYERTYPE_RGB : (layer % 5 == 4 ? LAYERTYPE_GRAYSCALEA : LAYERTYPE_RGBA);
+		if (bench->indexed)
+			type = covering ? LAYERTYPE_INDEXED : LAYERTYPE_INDEXEDA;
+		gboolean mask = bench->masks && layer % 2 && !covering;
+		gboolean opaque = covering && layer;
+
+		set_pointer (out, bench, pointers + (bench->layers - 1 - layer) * pointer_size (bench), out->len);
+		put32 (out, width);
+		put32 (out, height);
+		put32 (out, type);
+		put_string (out, "layer");
+
+		put_property (out, PROP_OPACITY, opaque || layer % 3 ? 0xff : 0xc0);
+		put_property (out, PROP_MODE, bench->modes && !opaque ? bench_modes[layer % G_N_ELEMENTS (bench_modes)] : LAYERMODE_NORMAL);
+		put_property (out, PROP_VISIBLE, 1);
+		put_property (out, PROP_APPLY_MASK, mask);
+		put32 (out, PROP_OFFSETS);
+		put32 (out, 2 * sizeof(guint32));
+		put32 (out, dx);
+		put32 (out, dy);
+		put32 (out, PROP_END);
+		put32 (out, 0);
+
+		gsize hptr = out->len;
+		put_pointer (out, bench, 0);
+		put_pointer (out, bench, 0);
+		set_pointer (out, bench, hptr, out->len);
+		put_hierarchy (out, bench, width, height, layer, layer_channels (type), FALSE);
+
+		if (!mask)
+			continue;
+		set_pointer (out, bench, hptr + pointer_size (bench), out->len);
+		put32 (out, width);
+		put32 (out, height);
+		put_string (out, "mask");
+		put32 (out, PROP_END);
+		put32 (out, 0);
+		put_pointer (out, bench, out->len + pointer_size (bench));
+		put_hierarchy (out, bench, width, height, layer, 1, TRUE);
+	}
+
+	return out;
+}
+
+static GByteArray*
+bench_compress (GByteArray *xcf, guint type)
+{
+	GByteArray *out = g_byte_array_new ();
+
+	if (type == FILETYPE_XCF_BZ2) {
+		unsigned int len = xcf->len + xcf->len / 100 + 600;
+		g_byte_array_set_size (out, len);
+		if (BZ2_bzBuffToBuffCompress ((char*)out->data, &len, (char*)xcf->data, xcf->len, 9, 0, 0) != BZ_OK)
+			g_error ("bz2 compression failed");
+		g_byte_array_set_size (out, len);
+	}
+#if GIO_2_23
+	if (type == FILETYPE_XCF_GZ) {
+		GConverter *compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, 6));
+		gsize read = 0;
+		GConverterResult result;
+		do {
+			guchar buf[65536];
+			gsize bytes_read, bytes_written;
+			result = g_converter_convert (compressor, xcf->data + read, xcf->len - read, buf, sizeof (buf),
+						      G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, NULL);
+			if (result == G_CONVERTER_ERROR)
+				g_error ("gz compression failed");
+			read += bytes_read;
+			g_byte_array_append (out, buf, bytes_written);
+		} while (result != G_CONVERTER_FINISHED);
+		g_object_unref (compressor);
+	}
+#endif
+#if HAVE_LZMA
+	if (type == FILETYPE_XCF_XZ) {
+		size_t len = 0;
+		g_byte_array_set_size (out, lzma_stream_buffer_bound (xcf->len));
+		if (lzma_easy_buffer_encode (6, LZMA_CHECK_CRC64, NULL, xcf->data, xcf->len, out->data, &len, out->len) != LZMA_OK)
+			g_error ("xz compression failed");
+		g_byte_array_set_size (out, len);
+	}
+#endif
+#if HAVE_ZSTD
+	if (type == FILETYPE_XCF_ZST) {
+		g_byte_array_set_size (out, ZSTD_compressBound (xcf->len));
+		size_t len = ZSTD_compress (out->data, out->len, xcf->data, xcf->len, 3);
+		if (ZSTD_isError (len))
+			g_error ("zstd compression failed");
+		g_byte_array_set_size (out, len);
+	}
+#endif
+
+	return out;
+}
+
+/* Stages */
+
+static void
+bench_decompress (const gchar *path, guint type, gint64 *ns)
+{
+	XcfBuffer buffer;
+	GError *error = NULL;
+	FILE *f = fopen (path, "rb");
+
+	gint64 t0 = bench_now ();
+	xcf_buffer_init (&buffer, 65536);
+	if (!xcf_decompress_file (f, type, &buffer, &error))
+		g_error ("%s", error->message);
+	xcf_buffer_clear (&buffer);
+	ns[BENCH_DECOMPRESS] = bench_now () - t0;
+
+	fclose (f);
+}
+
+/*
+ * The rendering pipeline on the whole canvas, one tile after the other,
+ * timing each step.
+ */
+static void
+bench_render (GByteArray *xcf, XcfImage *image, gint64 *ns)
+{
+	XcfReader reader;
+	XcfScratch scratch;
+	guint16 *canvas = g_new0 (guint16, 4 * image->width * image->height);
+	GList *current;
+
+	xcf_scratch_init (&scratch, FALSE);
+	gchar *pixels = (gchar*)scratch.pixels;
+	guchar *planes = scratch.planes;
+	guchar *mask = scratch.mask;
+
+	xcf_reader_init_memory (&reader, xcf->data, xcf->len);
+	for (current = g_list_first (image->layers); current; current = g_list_next (current)) {
+		XcfLayer *layer = current->data;
+		int columns = (layer->width + 63) / 64;
+		int tile_id;
+		XcfComposite composite;
+
+		composite_init (&composite, layer, layer->layer_mask != NULL);
+
+		for (tile_id = 0; tile_id < layer->tiles.count; tile_id++) {
+			int ox = 64 * (tile_id % columns);
+			int oy = 64 * (tile_id / columns);
+			int bpp = layer_channels (layer->type) * precision_size (image->precision);
+			XcfTile tile = { MIN (64, layer->width - ox), MIN (64, layer->height - oy), layer->type, NULL, (guchar*)pixels, NULL,
+					 image->precision, image->linear, image->compression != COMPRESSION_RLE };
+			int count = tile.width * tile.height;
+			gint64 t0, t1, t2, t3, t4;
+
+			xcf_reader_seek (&reader, layer->tiles.offsets[tile_id]);
+			t0 = bench_now ();
+			if (image->compression == COMPRESSION_RLE && image->color_mode == 2) {
+				//expanded to rgba while decoding
+				rle_decode_indexed_tile (&reader, image->colormap, tile.pixels, count, layer->type == LAYERTYPE_INDEXEDA, xcf_tile_length (&layer->tiles, tile_id, reader.length));
+				t1 = bench_now ();
+			} else if (image->compression == COMPRESSION_RLE) {
+				rle_decode_tile (&reader, planes, count, bpp, xcf_tile_length (&layer->tiles, tile_id, reader.length));
+				t1 = bench_now ();
+				tile.planes = planes;
+			} else {
+				guchar *raw = image->precision != PRECISION_U8 ? planes : tile.pixels;
+				if (image->compression == COMPRESSION_ZLIB)
+					zlib_decode_tile (&reader, raw, count*bpp, xcf_tile_length (&layer->tiles, tile_id, reader.length));
+				else
+					xcf_reader_read (&reader, raw, count*bpp);
+				t1 = bench_now ();
+				if (image->precision != PRECISION_U8)
+					tile.planes = planes;
+				else
+					to_rgba (pixels, count, layer->type, image->colormap);
+			}
+			t2 = bench_now ();
+			if (layer->layer_mask) {
+				if (!decode_mask (&reader, image->compression, image->precision, layer->layer_mask, tile_id, count, mask, scratch.wide))
+					memset (mask, 0xff, count * (image->precision != PRECISION_U8 ? sizeof (guint16) : 1));
+				tile.mask = mask;
+			}
+			t3 = bench_now ();
+
+			composite_tile (canvas, 4 * image->width, image->width, image->height, 0, 0, &tile, ox + layer->dx, oy + layer->dy, &composite);
+			t4 = bench_now ();
+
+			ns[BENCH_DECODE] += t1 - t0;
+			ns[BENCH_TO_RGBA] += t2 - t1;
+			ns[BENCH_MASK] += t3 - t2;
+			ns[BENCH_COMPOSITE] += t4 - t3;
+		}
+	}
+
+	gint64 t0 = bench_now ();
+	guchar *rgba = g_malloc (4 * image->width);
+	guint32 y;
+	for (y = 0; y < image->height; y++)
+		unpremultiply_row (canvas + 4 * image->width * y, rgba, image->width);
+	g_free (rgba);
+	ns[BENCH_COMPOSITE] += bench_now () - t0;
+
+	if (reader.error)
+		g_error ("corrupt corpus file");
+	xcf_reader_clear (&reader);
+	xcf_scratch_clear (&scratch);
+	g_free (canvas);
+}
+
+static void
+bench_prepared (GdkPixbuf *pixbuf, GdkPixbufAnimation *anim, gpointer user_data)
+{
+	*(GdkPixbuf**)user_data = g_object_ref (pixbuf);
+}
+
+static void
+bench_updated (GdkPixbuf *pixbuf, int x, int y, int width, int height, gpointer user_data)
+{
+}
+
+static void
+bench_progressive (const gchar *path, gint64 *ns)
+{
+	GdkPixbuf *pixbuf = NULL;
+	GError *error = NULL;
+	gchar *data;
+	gsize len, pos;
+
+	if (!g_file_get_contents (path, &data, &len, &error))
+		g_error ("%s", error->message);
+
+	gint64 t0 = bench_now ();
+	gpointer context = xcf_image_begin_load (NULL, bench_prepared, bench_updated, &pixbuf, &error);
+	for (pos = 0; pos < len; pos += BENCH_CHUNK)
+		if (!xcf_image_load_increment (context, data + pos, MIN (BENCH_CHUNK, len - pos), &error))
+			g_error ("%s", error->message);
+	if (!xcf_image_stop_load (context, &error))
+		g_error ("%s", error->message);
+	ns[BENCH_PROGRESSIVE] = bench_now () - t0;
+
+	g_object_unref (pixbuf);
+	g_free (data);
+}
+
+static int
+bench_compare (const void *a, const void *b)
+{
+	gint64 x = *(const gint64*)a;
+	gint64 y = *(const gint64*)b;
+	return x < y ? -1 : x > y;
+}
+
+//nearest rank percentile of sorted samples
+static gint64
+bench_percentile (const gint64 *samples, int count, int percent)
+{
+	int rank = (percent * count + 99) / 100;
+	return samples[MAX (rank, 1) - 1];
+}
+
+static void
+bench_run (const BenchCase *bench, const gchar *dir, int iterations)
+{
+	GError *error = NULL;
+	gint64 *samples[BENCH_STAGES];
+	int i, stage;
+
+	GByteArray *xcf = bench_write_xcf (bench);
+	GByteArray *file = bench->type == FILETYPE_XCF ? xcf : bench_compress (xcf, bench->type);
+	gchar *path = g_build_filename (dir, bench->name, NULL);
+	if (!g_file_set_contents (path, (gchar*)file->data, file->len, &error))
+		g_error ("%s", error->message);
+
+	for (stage = 0; stage < BENCH_STAGES; stage++)
+		samples[stage] = g_new0 (gint64, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		gint64 ns[BENCH_STAGES] = { 0 };
+		XcfReader reader;
+		XcfImage image;
+
+		if (bench->type != FILETYPE_XCF)
+			bench_decompress (path, bench->type, ns);
+
+		xcf_reader_init_memory (&reader, xcf->data, xcf->len);
+		gint64 t0 = bench_now ();
+		if (!xcf_image_parse (&reader, &image, &error))
+			g_error ("%s", error->message);
+		ns[BENCH_PARSE] = bench_now () - t0;
+
+		bench_render (xcf, &image, ns);
+		xcf_image_clear (&image);
+
+		FILE *f = fopen (path, "rb");
+		t0 = bench_now ();
+		GdkPixbuf *pixbuf = xcf_image_load (f, &error);
+		ns[BENCH_LOAD] = bench_now () - t0;
+		if (!pixbuf)
+			g_error ("%s", error->message);
+		g_object_unref (pixbuf);
+		fclose (f);
+
+		bench_progressive (path, ns);
+
+		for (stage = 0; stage < BENCH_STAGES; stage++)
+			samples[stage][i] = ns[stage];
+	}
+
+	double megapixels = bench->width * bench->height / 1e6;
+	g_print ("%s: %ux%u, %d layers, %s, %.1f MB\n", bench->name, bench->width, bench->height, bench->layers,
+		 bench->compression == COMPRESSION_RLE ? "rle" : bench->compression == COMPRESSION_ZLIB ? "zlib" : "raw", file->len / 1e6);
+	for (stage = 0; stage < BENCH_STAGES; stage++) {
+		if (stage == BENCH_DECOMPRESS && bench->type == FILETYPE_XCF)
+			continue;
+		if (stage == BENCH_MASK && !bench->masks)
+			continue;
+		qsort (samples[stage], iterations, sizeof (gint64), bench_compare);
+		double p50 = bench_percentile (samples[stage], iterations, 50) / 1e6;
+		g_print ("  %-12s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  %9.1f MP/s\n", bench_stage_names[stage], p50,
+			 bench_percentile (samples[stage], iterations, 90) / 1e6,
+			 bench_percentile (samples[stage], iterations, 99) / 1e6,
+			 p50 > 0 ? megapixels / (p50 / 1e3) : 0);
+	}
+
+	for (stage = 0; stage < BENCH_STAGES; stage++)
+		g_free (samples[stage]);
+	g_unlink (path);
+	g_free (path);
+	if (file != xcf)
+		g_byte_array_free (file, TRUE);
+	g_byte_array_free (xcf, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+	GError *error = NULL;
+	int iterations = argc > 1 ? atoi (argv[1]) : BENCH_ITERATIONS;
+	const gchar *filter = argc > 2 ? argv[2] : NULL;
+	int i;
+
+	if (iterations <= 0) {
+		g_printerr ("usage: %s [iterations [case]]\n", argv[0]);
+		return 1;
+	}
+
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+	g_type_init ();
+#endif
+	xcf_simd_init ();
+
+	gchar *dir = g_dir_make_tmp ("xcf-bench-XXXXXX", &error);
+	if (!dir)
+		g_error ("%s", error->message);
+
+	for (i = 0; i < G_N_ELEMENTS (cases); i++)
+		if (!filter || strstr (cases[i].name, filter))
+			bench_run (&cases[i], dir, iterations);
+
+	g_rmdir (dir);
+	g_free (dir);
+	return 0;
+}
@@ -0,0 +1,613 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Multi-threaded bzip2 decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A bzip2 stream is a "BZh" + level header, followed by independently
+ * compressed blocks of up to level * 100k, each one starting with a 48 bits
+ * magic number and the CRC of the block, and an end of stream magic number
+ * followed by the combined CRC of the blocks. None of those is byte aligned.
+ *
+ * The input is scanned for the magic numbers. Each block is copied into a
+ * standalone single block stream, which is decompressed by libbz2 on a pool
+ * of threads, and the output is handed out in order. Concatenated streams,
+ * as written by parallel compressors, are decompressed as one.
+ *
+ * A block magic number can also show up by chance inside a block. Both
+ * halves fail to decompress then, and are merged back and decompressed
+ * again. So can an end of stream magic number: unless a stream header
+ * follows it, it's only taken as the end of the stream once the block
+ * before it has decompressed, and merged with what follows otherwise.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gi18n.h>
+
+#include "xcf-bz2-decompressor.h"
+
+#define BLOCK_MAGIC        G_GUINT64_CONSTANT (0x314159265359)
+#define END_MAGIC          G_GUINT64_CONSTANT (0x177245385090)
+#define MAGIC_BITS         48
+#define INPUT_CHUNK        262144      /* input scanned at a time */
+
+typedef struct _Bz2Block Bz2Block;
+struct _Bz2Block
+{
+    guchar *bits;       /* the block, starting at its magic number */
+    gint64 nbits;
+    int level;
+    guint32 crc;        /* of the block, or of the stream for end markers */
+    gboolean end;       /* end of stream marker, no data */
+    gboolean merge;     /* end marker without a stream header after it, or
+                         * the data after such a marker, which is only ever
+                         * decompressed merged with the block before */
+
+    gboolean done;      /* decompressed, only accessed by the converting thread */
+    gboolean failed;
+    guchar *out;
+    gsize out_len;
+    gsize out_pos;      /* handed out so far */
+};
+
+static void xcf_bz2_decompressor_iface_init          (GConverterIface *iface);
+
+struct _XcfBz2Decompressor
+{
+    GObject parent_instance;
+
+    guint threads;
+    GThreadPool *pool;
+    GAsyncQueue *done;  /* blocks decompressed by the pool */
+    GQueue blocks;      /* dispatched and not handed out yet, in order */
+
+    GByteArray *input;  /* input not dispatched yet */
+    gint64 scan;        /* next bit to scan for a magic number */
+    gint64 start;       /* current block, -1 if none */
+    int level;          /* of the current stream, 0 between streams */
+    gboolean after_end; /* the current block follows an end marker to merge */
+    gboolean at_end;    /* all the input is there */
+    gboolean trailing;  /* garbage after the last stream, ignored */
+    guint32 crc;        /* combined crc of the blocks handed out */
+};
+
+G_DEFINE_TYPE_WITH_CODE (XcfBz2Decompressor, xcf_bz2_decompressor, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                xcf_bz2_decompressor_iface_init))
+
+/* Bit strings, most significant bit first */
+
+static guint32
+get_bits (const guchar *data, gint64 pos, int n)
+{
+    guint32 value = 0;
+    int i;
+
+    for (i = 0; i < n; i++, pos++)
+        value = (value << 1) | ((data[pos >> 3] >> (7 - (pos & 7))) & 1);
+    return value;
+}
+
+/* or n bits of src, from bit from, into dest at bit to */
+static void
+copy_bits (guchar *dest, gint64 to, const guchar *src, gint64 from, gint64 n)
+{
+    while (n > 0) {
+        int take = MIN (8, n);
+        int s = from & 7;
+        int d = to & 7;
+        guint w = src[from >> 3] << 8;
+        if (s + take > 8)
+            w |= src[(from >> 3) + 1];
+        guint v = (w >> (16 - s - take)) & ((1 << take) - 1);
+        guint x = v << (16 - d - take);
+        dest[to >> 3] |= x >> 8;
+        if (d + take > 8)
+            dest[(to >> 3) + 1] |= x & 0xff;
+        from += take;
+        to += take;
+        n -= take;
+    }
+}
+
+/* The first block or end of stream magic number starting at or after bit
+ * from and fully in the len bytes of data, -1 if there's none */
+static gint64
+find_magic (const guchar *data, gsize len, gint64 from, gboolean *end)
+{
+    const guint64 mask = (G_GUINT64_CONSTANT (1) << MAGIC_BITS) - 1;
+    guint64 reg = 0;
+    gsize i;
+    int k;
+
+    for (i = from >> 3; i < len; i++) {
+        reg = (reg << 8) | data[i];
+        /* the magic numbers ending in byte i, leftmost first */
+        for (k = 7; k >= 0; k--) {
+            gint64 pos = (gint64)i * 8 + 8 - k - MAGIC_BITS;
+            guint64 v = (reg >> k) & mask;
+            if (pos < from || (v != BLOCK_MAGIC && v != END_MAGIC))
+                continue;
+            *end = v == END_MAGIC;
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/* Blocks */
+
+static void
+bz2_block_free (Bz2Block *block)
+{
+    g_free (block->bits);
+    g_free (block->out);
+    g_free (block);
+}
+
+/* decompress block as a standalone stream: header, block, end of stream
+ * magic and crc (the combined crc of a single block is its crc) */
+static void
+bz2_block_decompress (Bz2Block *block)
+{
+    guchar tail[10];
+    bz_stream bzstream;
+    gsize len = 4 + (block->nbits + 80 + 7) / 8;
+    guchar *stream = g_malloc0 (len);
+    gsize size = block->level * 100000;
+    int res = BZ_OK;
+    int i;
+
+    memcpy (stream, "BZh", 3);
+    stream[3] = '0' + block->level;
+    copy_bits (stream, 32, block->bits, 0, block->nbits);
+    for (i = 0; i < 6; i++)
+        tail[i] = END_MAGIC >> (40 - 8 * i);
+    for (i = 0; i < 4; i++)
+        tail[6 + i] = block->crc >> (24 - 8 * i);
+    copy_bits (stream, 32 + block->nbits, tail, 0, 80);
+
+    memset (&bzstream, 0, sizeof (bz_stream));
+    block->failed = TRUE;
+    if (BZ2_bzDecompressInit (&bzstream, 0, FALSE) != BZ_OK) {
+        g_free (stream);
+        return;
+    }
+
+    block->out = g_malloc (size);
+    bzstream.next_in = (char *)stream;
+    bzstream.avail_in = len;
+    while (res == BZ_OK) {
+        if (block->out_len == size) {
+            size *= 2;
+            block->out = g_realloc (block->out, size);
+        }
+        bzstream.next_out = (char *)block->out + block->out_len;
+        bzstream.avail_out = size - block->out_len;
+        res = BZ2_bzDecompress (&bzstream);
+        block->out_len = size - bzstream.avail_out;
+        if (res == BZ_OK && bzstream.avail_in == 0 && bzstream.avail_out > 0)
+            break; /* truncated */
+    }
+    block->failed = res != BZ_STREAM_END;
+
+    BZ2_bzDecompressEnd (&bzstream);
+    g_free (stream);
+}
+
+static void
+bz2_block_worker (gpointer data, gpointer user_data)
+{
+    XcfBz2Decompressor *decompressor = user_data;
+    Bz2Block *block = data;
+
+    bz2_block_decompress (block);
+    g_async_queue_push (decompressor->done, block);
+}
+
+/* block until block is decompressed */
+static void
+wait_block (XcfBz2Decompressor *decompressor, Bz2Block *block)
+{
+    while (!block->done) {
+        Bz2Block *done = g_async_queue_pop (decompressor->done);
+        done->done = TRUE;
+    }
+}
+
+static Bz2Block *
+copy_block (XcfBz2Decompressor *decompressor, gint64 start, gint64 end)
+{
+    Bz2Block *block = g_new0 (Bz2Block, 1);
+
+    block->nbits = end - start;
+    block->bits = g_malloc0 ((block->nbits + 7) / 8 + 1);
+    copy_bits (block->bits, 0, decompressor->input->data, start, block->nbits);
+    block->level = decompressor->level;
+    g_queue_push_tail (&decompressor->blocks, block);
+    return block;
+}
+
+static void
+dispatch_block (XcfBz2Decompressor *decompressor, gint64 start, gint64 end)
+{
+    Bz2Block *block = copy_block (decompressor, start, end);
+
+    /* the data after an end marker doesn't start with a block */
+    if (decompressor->after_end) {
+        block->merge = TRUE;
+        block->failed = TRUE;
+        block->done = TRUE;
+        decompressor->after_end = FALSE;
+        return;
+    }
+    block->crc = get_bits (decompressor->input->data, start + MAGIC_BITS, 32);
+    g_thread_pool_push (decompressor->pool, block, NULL);
+}
+
+/* drop the input before byte offset */
+static void
+drop_input (XcfBz2Decompressor *decompressor, gsize offset)
+{
+    g_byte_array_remove_range (decompressor->input, 0, offset);
+    decompressor->scan -= 8 * offset;
+    if (decompressor->start >= 0)
+        decompressor->start -= 8 * offset;
+}
+
+/* dispatch the complete blocks of the input */
+static void
+scan_input (XcfBz2Decompressor *decompressor)
+{
+    GByteArray *input = decompressor->input;
+
+    while (!decompressor->trailing) {
+        gboolean end;
+        gint64 pos;
+
+        if (!decompressor->level) {
+            /* stream header */
+            if (input->len < 4)
+                return;
+            if (memcmp (input->data, "BZh", 3) || input->data[3] < '1' || input->data[3] > '9') {
+                decompressor->trailing = TRUE;
+                return;
+            }
+            decompressor->level = input->data[3] - '0';
+            decompressor->scan = 32;
+            decompressor->start = -1;
+        }
+
+        pos = find_magic (input->data, input->len, decompressor->scan, &end);
+        if (pos < 0) {
+            decompressor->scan = MAX (decompressor->scan, 8 * (gint64)input->len - MAGIC_BITS + 1);
+            /* the rest of the input follows an end marker */
+            if (decompressor->at_end && decompressor->after_end) {
+                dispatch_block (decompressor, decompressor->start, 8 * (gint64)input->len);
+                decompressor->start = -1;
+            }
+            return;
+        }
+
+        if (!end) {
+            if (decompressor->start >= 0)
+                dispatch_block (decompressor, decompressor->start, pos);
+            decompressor->start = pos;
+            decompressor->scan = pos + MAGIC_BITS;
+            drop_input (decompressor, pos / 8);
+            continue;
+        }
+
+        /* end of stream, wait for its crc and what follows on the next
+         * byte: the header of the next stream, or the end of the input */
+        gsize next = (pos + MAGIC_BITS + 32 + 7) / 8;
+        if (next > input->len || (next + 4 > input->len && !decompressor->at_end)) {
+            decompressor->scan = pos;
+            return;
+        }
+        if (decompressor->start >= 0)
+            dispatch_block (decompressor, decompressor->start, pos);
+        decompressor->start = -1;
+
+        Bz2Block *marker = copy_block (decompressor, pos, 8 * (gint64)next);
+        marker->end = TRUE;
+        marker->done = TRUE;
+        marker->crc = get_bits (input->data, pos + MAGIC_BITS, 32);
+        drop_input (decompressor, next);
+
+        if (input->len >= 4 && !memcmp (input->data, "BZh", 3) && input->data[3] >= '1' && input->data[3] <= '9') {
+            decompressor->level = 0;
+            continue;
+        }
+
+        /* garbage after the last stream, or a chance end magic number
+         * inside a block: keep the data that follows, up to the next
+         * magic number, in case it has to be merged */
+        marker->merge = TRUE;
+        decompressor->after_end = TRUE;
+        decompressor->start = 0;
+        decompressor->scan = 0;
+    }
+}
+
+/* the end marker at the head of the queue is the end of the stream, drop
+ * whatever was scanned after it */
+static void
+end_stream (XcfBz2Decompressor *decompressor, Bz2Block *marker)
+{
+    Bz2Block *block;
+
+    g_queue_pop_head (&decompressor->blocks);
+    if (marker->merge) {
+        while ((block = g_queue_pop_head (&decompressor->blocks))) {
+            wait_block (decompressor, block);
+            bz2_block_free (block);
+        }
+        g_byte_array_set_size (decompressor->input, 0);
+        decompressor->trailing = TRUE;
+        decompressor->after_end = FALSE;
+        decompressor->start = -1;
+        decompressor->scan = 0;
+        decompressor->level = 0;
+    }
+    bz2_block_free (marker);
+}
+
+/* Hand out the decompressed blocks, in order, to outbuf. Returns FALSE on
+ * error, and sets *blocked if the head block isn't ready yet */
+static gboolean
+emit_blocks (XcfBz2Decompressor *decompressor, guchar *outbuf, gsize outbuf_size,
+             gsize *bytes_written, gboolean *blocked, GError **error)
+{
+    Bz2Block *block, *next, *done;
+    int i;
+
+    *blocked = FALSE;
+    while ((block = g_queue_peek_head (&decompressor->blocks))) {
+        while ((done = g_async_queue_try_pop (decompressor->done)))
+            done->done = TRUE;
+
+        /* the blocks before it have decompressed, it's the end of the stream */
+        if (block->end) {
+            if (block->crc != decompressor->crc)
+                goto invalid;
+            decompressor->crc = 0;
+            end_stream (decompressor, block);
+            continue;
+        }
+
+        if (!block->done) {
+            *blocked = TRUE;
+            return TRUE;
+        }
+
+        if (block->failed) {
+            /* merge with the next block, in case a block or end of stream
+             * magic number showed up by chance, along with the data after
+             * the end marker */
+            int merged = 1;
+            next = g_queue_peek_nth (&decompressor->blocks, 1);
+            if (next && next->end && next->merge)
+                merged = 2;
+            if (!g_queue_peek_nth (&decompressor->blocks, merged)) {
+                *blocked = TRUE;
+                return TRUE;
+            }
+            if (next->end && !next->merge)
+                goto invalid;
+
+            gint64 nbits = block->nbits;
+            for (i = 1; i <= merged; i++)
+                nbits += ((Bz2Block *) g_queue_peek_nth (&decompressor->blocks, i))->nbits;
+            if (nbits > 8 * 2 * 100000 * (gint64)block->level)
+                goto invalid;
+
+            guchar *bits = g_malloc0 ((nbits + 7) / 8 + 1);
+            copy_bits (bits, 0, block->bits, 0, block->nbits);
+            for (i = 1; i <= merged; i++) {
+                next = g_queue_pop_nth (&decompressor->blocks, 1);
+                wait_block (decompressor, next);
+                copy_bits (bits, block->nbits, next->bits, 0, next->nbits);
+                block->nbits += next->nbits;
+                bz2_block_free (next);
+            }
+            g_free (block->bits);
+            g_free (block->out);
+            block->bits = bits;
+            block->out = NULL;
+            block->out_len = 0;
+            bz2_block_decompress (block);
+            continue;
+        }
+
+        gsize n = MIN (block->out_len - block->out_pos, outbuf_size - *bytes_written);
+        memcpy (outbuf + *bytes_written, block->out + block->out_pos, n);
+        *bytes_written += n;
+        block->out_pos += n;
+        if (block->out_pos < block->out_len)
+            return TRUE;
+
+        decompressor->crc = ((decompressor->crc << 1) | (decompressor->crc >> 31)) ^ block->crc;
+        bz2_block_free (g_queue_pop_head (&decompressor->blocks));
+    }
+    return TRUE;
+
+invalid:
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         _("Invalid compressed data"));
+    return FALSE;
+}
+
+/* GObject */
+
+static void
+xcf_bz2_decompressor_clear (XcfBz2Decompressor *decompressor)
+{
+    Bz2Block *block;
+
+    if (decompressor->pool)
+        g_thread_pool_free (decompressor->pool, TRUE, TRUE);
+    decompressor->pool = NULL;
+    while ((block = g_queue_pop_head (&decompressor->blocks)))
+        bz2_block_free (block);
+    if (decompressor->done)
+        g_async_queue_unref (decompressor->done);
+    decompressor->done = NULL;
+    if (decompressor->input)
+        g_byte_array_free (decompressor->input, TRUE);
+    decompressor->input = NULL;
+}
+
+static void
+xcf_bz2_decompressor_finalize (GObject *object)
+{
+    xcf_bz2_decompressor_clear (XCF_BZ2_DECOMPRESSOR (object));
+
+    G_OBJECT_CLASS (xcf_bz2_decompressor_parent_class)->finalize (object);
+}
+
+static void
+xcf_bz2_decompressor_init (XcfBz2Decompressor *decompressor)
+{
+    g_queue_init (&decompressor->blocks);
+    decompressor->threads = 1;
+}
+
+static void
+xcf_bz2_decompressor_class_init (XcfBz2DecompressorClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->finalize = xcf_bz2_decompressor_finalize;
+}
+
+XcfBz2Decompressor *
+xcf_bz2_decompressor_new (guint threads)
+{
+    XcfBz2Decompressor *decompressor;
+
+    decompressor = g_object_new (XCF_TYPE_BZ2_DECOMPRESSOR, NULL);
+    decompressor->threads = MAX (threads, 1);
+
+    return decompressor;
+}
+
+/* GConverter */
+
+static void
+xcf_bz2_decompressor_reset (GConverter *converter)
+{
+    XcfBz2Decompressor *decompressor = XCF_BZ2_DECOMPRESSOR (converter);
+
+    xcf_bz2_decompressor_clear (decompressor);
+    decompressor->scan = 0;
+    decompressor->start = -1;
+    decompressor->level = 0;
+    decompressor->after_end = FALSE;
+    decompressor->at_end = FALSE;
+    decompressor->trailing = FALSE;
+    decompressor->crc = 0;
+}
+
+static GConverterResult
+xcf_bz2_decompressor_convert (GConverter *converter,
+                              const void *inbuf,
+                              gsize       inbuf_size,
+                              void       *outbuf,
+                              gsize       outbuf_size,
+                              GConverterFlags flags,
+                              gsize      *bytes_read,
+                              gsize      *bytes_written,
+                              GError    **error)
+{
+    XcfBz2Decompressor *decompressor = XCF_BZ2_DECOMPRESSOR (converter);
+    gboolean at_end = (flags & G_CONVERTER_INPUT_AT_END) != 0;
+    gboolean blocked;
+
+    if (!decompressor->pool) {
+        decompressor->done = g_async_queue_new ();
+        decompressor->input = g_byte_array_new ();
+        decompressor->start = -1;
+        decompressor->pool = g_thread_pool_new (bz2_block_worker, decompressor,
+                                                decompressor->threads, FALSE, NULL);
+    }
+
+    *bytes_read = 0;
+    *bytes_written = 0;
+    while (TRUE) {
+        if (!emit_blocks (decompressor, outbuf, outbuf_size, bytes_written, &blocked, error))
+            return G_CONVERTER_ERROR;
+        if (*bytes_written == outbuf_size)
+            return G_CONVERTER_CONVERTED;
+
+        /* keep at most 2 blocks per thread in memory, unless the head
+         * block waits for the next one to be merged with */
+        Bz2Block *head = g_queue_peek_head (&decompressor->blocks);
+        if (*bytes_read < inbuf_size &&
+            (g_queue_get_length (&decompressor->blocks) < 2 * decompressor->threads || (blocked && head->done))) {
+            gsize n = MIN (inbuf_size - *bytes_read, INPUT_CHUNK);
+            if (!decompressor->trailing)
+                g_byte_array_append (decompressor->input, (const guint8 *)inbuf + *bytes_read, n);
+            *bytes_read += n;
+            scan_input (decompressor);
+            continue;
+        }
+
+        /* nothing comes after the input left, scan it to the end */
+        if (at_end && *bytes_read == inbuf_size && !decompressor->at_end) {
+            decompressor->at_end = TRUE;
+            scan_input (decompressor);
+            continue;
+        }
+
+        if (g_queue_is_empty (&decompressor->blocks) && *bytes_read == inbuf_size &&
+            !decompressor->level && (decompressor->trailing || (at_end && decompressor->input->len < 4)))
+            return G_CONVERTER_FINISHED;
+
+        if (*bytes_read || *bytes_written)
+            return G_CONVERTER_CONVERTED;
+
+        /* nothing else to do, wait for the head block */
+        if (blocked && !head->done) {
+            wait_block (decompressor, head);
+            continue;
+        }
+
+        if (at_end) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                 _("Invalid compressed data"));
+            return G_CONVERTER_ERROR;
+        }
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                             _("Need more input"));
+        return G_CONVERTER_ERROR;
+    }
+}
+
+static void
+xcf_bz2_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = xcf_bz2_decompressor_convert;
+  iface->reset = xcf_bz2_decompressor_reset;
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Multi-threaded bzip2 decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __XCF_BZ2_DECOMPRESSOR_H__
+#define __XCF_BZ2_DECOMPRESSOR_H__
+
+#include <gio/gio.h>
+#include <bzlib.h>
+
+G_BEGIN_DECLS
+
+#define XCF_TYPE_BZ2_DECOMPRESSOR         (xcf_bz2_decompressor_get_type ())
+#define XCF_BZ2_DECOMPRESSOR(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), XCF_TYPE_BZ2_DECOMPRESSOR, XcfBz2Decompressor))
+#define XCF_BZ2_DECOMPRESSOR_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), XCF_TYPE_BZ2_DECOMPRESSOR, XcfBz2DecompressorClass))
+#define XCF_IS_BZ2_DECOMPRESSOR(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), XCF_TYPE_BZ2_DECOMPRESSOR))
+#define XCF_IS_BZ2_DECOMPRESSOR_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), XCF_TYPE_BZ2_DECOMPRESSOR))
+#define XCF_BZ2_DECOMPRESSOR_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), XCF_TYPE_BZ2_DECOMPRESSOR, XcfBz2DecompressorClass))
+
+typedef struct _XcfBz2Decompressor        XcfBz2Decompressor;
+typedef struct _XcfBz2DecompressorClass   XcfBz2DecompressorClass;
+
+struct _XcfBz2DecompressorClass
+{
+    GObjectClass parent_class;
+};
+
+GType               xcf_bz2_decompressor_get_type (void);
+
+/* A drop-in replacement for YelpBz2Decompressor, decompressing the
+ * blocks of the stream on threads threads */
+XcfBz2Decompressor *xcf_bz2_decompressor_new (guint threads);
+
+G_END_DECLS
+
+#endif /* __XCF_BZ2_DECOMPRESSOR_H__ */
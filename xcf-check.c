@@ -0,0 +1,1080 @@
+/*
+ * Tests for the xcf pixbuf loader
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Run by make check. The loader is built in, so its internals can be
+ * checked on their own:
+ *   kernels	every row compositing function, of 8 and 16 bits src pixels,
+ *		of every instruction set the cpu supports, against the scalar
+ *		one, on random rows of every length up to a few vectors
+ *   variants	the masked and opaque variants of every row compositing
+ *		function, against the plain one on the same pixels
+ *   hsv	the hue, saturation, color and value rows of every instruction
+ *		set, against a double precision model
+ *   dissolve	a dissolve tile composited by every instruction set, and in
+ *		two regions, for a fixed layer and position, and a file with
+ *		a dissolve layer rendered on 1 and on several threads
+ *   compressed	a file compressed whole, and truncated, which must fail to
+ *		load instead of loading as if it were complete
+ *   depth	16 bits and float files of two blended gradient layers,
+ *		against a double precision model: narrowing the layers to 8
+ *		bits before compositing them bands the gradients
+ *
+ * usage: xcf-check [check]
+ * Exits with 1 if any check fails.
+ */
+
+#include "io-xcf.c"
+
+#define CHECK_ROWS		4	//random rows per length
+#define CHECK_MAX_COUNT		150	//longest row, past two 64 pixels chunks
+
+typedef composite_row_func CheckRowFuncs[LAYERMODE_GRAINMERGE + 1][2][2];
+typedef composite_row16_func CheckRow16Funcs[LAYERMODE_GRAINMERGE + 1][2][2];
+
+//the row functions of an instruction set
+typedef struct _CheckIsa CheckIsa;
+struct _CheckIsa {
+	const gchar *name;
+	CheckRowFuncs funcs;
+	CheckRow16Funcs funcs16;
+	unpremultiply_row_func unpremultiply;
+	interleave16_func interleave16;
+};
+
+static CheckIsa check_isas[3];
+static int check_isa_count;
+static int check_failures;
+
+static void
+check_fail (const gchar *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	gchar *message = g_strdup_vprintf (format, args);
+	va_end (args);
+	g_printerr ("  FAIL: %s\n", message);
+	g_free (message);
+	check_failures++;
+}
+
+/*
+ * The scalar tables, and the vector ones the cpu supports. This has to run
+ * before xcf_simd_init () replaces the scalar functions.
+ */
+static void
+check_init_isas (void)
+{
+	CheckIsa *isa = &check_isas[check_isa_count++];
+
+	isa->name = "scalar";
+	memcpy (isa->funcs, composite_row_funcs, sizeof (CheckRowFuncs));
+	memcpy (isa->funcs16, composite_row16_funcs, sizeof (CheckRow16Funcs));
+	isa->unpremultiply = unpremultiply_row_scalar;
+	isa->interleave16 = interleave16_scalar;
+
+#if HAVE_X86_SIMD
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse2")) {
+		isa = &check_isas[check_isa_count++];
+		isa->name = "sse2";
+		memcpy (isa->funcs, composite_row_funcs, sizeof (CheckRowFuncs));
+		composite_row_funcs_sse2 (isa->funcs);
+		memcpy (isa->funcs16, composite_row16_funcs, sizeof (CheckRow16Funcs));
+		composite_row16_funcs_sse2 (isa->funcs16);
+		isa->unpremultiply = unpremultiply_row_sse2;
+		isa->interleave16 = interleave16_sse2;
+	}
+	if (__builtin_cpu_supports ("avx2")) {
+		isa = &check_isas[check_isa_count++];
+		isa->name = "avx2";
+		memcpy (isa->funcs, composite_row_funcs, sizeof (CheckRowFuncs));
+		composite_row_funcs_avx2 (isa->funcs);
+		memcpy (isa->funcs16, composite_row16_funcs, sizeof (CheckRow16Funcs));
+		composite_row16_funcs_avx2 (isa->funcs16);
+		isa->unpremultiply = unpremultiply_row_avx2;
+		isa->interleave16 = interleave16_avx2;
+	}
+#endif
+}
+
+/* Kernels */
+
+//a random byte, with the extremes more likely
+static guchar
+check_byte (GRand *rand)
+{
+	switch (g_rand_int_range (rand, 0, 8)) {
+	case 0: return 0;
+	case 1: return 255;
+	default: return g_rand_int (rand);
+	}
+}
+
+//a random row of premultiplied working buffer pixels
+static void
+check_dest_row (GRand *rand, guint16 *dest, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		guint16 a = check_byte (rand) == 255 ? 0xffff : g_rand_int_range (rand, 0, 0x10000);
+		dest[4*i] = g_rand_int_range (rand, 0, a + 1);
+		dest[4*i + 1] = g_rand_int_range (rand, 0, a + 1);
+		dest[4*i + 2] = g_rand_int_range (rand, 0, a + 1);
+		dest[4*i + 3] = a;
+	}
+}
+
+static void
+check_bytes (GRand *rand, guchar *bytes, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		bytes[i] = check_byte (rand);
+}
+
+//random 16 bits values, with the extremes more likely
+static void
+check_words (GRand *rand, guint16 *words, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		switch (g_rand_int_range (rand, 0, 8)) {
+		case 0: words[i] = 0; break;
+		case 1: words[i] = 0xffff; break;
+		default: words[i] = g_rand_int (rand);
+		}
+}
+
+//the first pixel where rows a and b differ, -1 if they don't
+static int
+check_compare16 (const guint16 *a, const guint16 *b, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (memcmp (a + 4*i, b + 4*i, 4 * sizeof (guint16)))
+			return i;
+	return -1;
+}
+
+static void
+check_kernels (void)
+{
+	static guint16 dest[4 * CHECK_MAX_COUNT], expected[4 * CHECK_MAX_COUNT], result[4 * CHECK_MAX_COUNT];
+	static guchar src[4 * CHECK_MAX_COUNT], copy[4 * CHECK_MAX_COUNT], mask[CHECK_MAX_COUNT];
+	static guchar pixels[4 * CHECK_MAX_COUNT], expected_pixels[4 * CHECK_MAX_COUNT];
+	static guint16 src16[4 * CHECK_MAX_COUNT], mask16[CHECK_MAX_COUNT];
+	static guchar planes[8 * CHECK_MAX_COUNT];
+	GRand *rand = g_rand_new_with_seed (4);
+	guint32 mode;
+	int isa, masked, opaque, count, row, i;
+
+	g_print ("kernels:");
+	for (isa = 0; isa < check_isa_count; isa++)
+		g_print (" %s", check_isas[isa].name);
+	g_print ("\n");
+
+	for (mode = 0; mode <= LAYERMODE_GRAINMERGE; mode++)
+		for (masked = 0; masked < 2; masked++)
+			for (opaque = 0; opaque < 2; opaque++)
+				for (count = 1; count <= CHECK_MAX_COUNT; count++)
+					for (row = 0; row < CHECK_ROWS; row++) {
+						guint32 opacity = opaque ? 255 : check_byte (rand);
+						guint32 key = g_rand_int (rand);
+						check_dest_row (rand, dest, count);
+						check_bytes (rand, src, 4 * count);
+						check_bytes (rand, mask, count);
+
+						//the scalar function may alter src
+						memcpy (expected, dest, sizeof (guint16) * 4 * count);
+						memcpy (copy, src, 4 * count);
+						check_isas[0].funcs[mode][masked][opaque] (expected, copy, mask, count, opacity, key);
+						for (isa = 1; isa < check_isa_count; isa++) {
+							memcpy (result, dest, sizeof (guint16) * 4 * count);
+							memcpy (copy, src, 4 * count);
+							check_isas[isa].funcs[mode][masked][opaque] (result, copy, mask, count, opacity, key);
+							if ((i = check_compare16 (expected, result, count)) >= 0)
+								check_fail ("%s %s row, masked %d, opaque %d, %d pixels: pixel %d differs from scalar",
+									    check_isas[isa].name, layer_mode_names[mode], masked, opaque, count, i);
+						}
+					}
+
+	for (mode = 0; mode <= LAYERMODE_GRAINMERGE; mode++)
+		for (masked = 0; masked < 2; masked++)
+			for (opaque = 0; opaque < 2; opaque++)
+				for (count = 1; count <= CHECK_MAX_COUNT; count++)
+					for (row = 0; row < CHECK_ROWS; row++) {
+						guint32 opacity = opaque ? 255 : check_byte (rand);
+						guint32 key = g_rand_int (rand);
+						check_dest_row (rand, dest, count);
+						check_words (rand, src16, 4 * count);
+						check_words (rand, mask16, count);
+
+						memcpy (expected, dest, sizeof (guint16) * 4 * count);
+						check_isas[0].funcs16[mode][masked][opaque] (expected, src16, mask16, count, opacity, key);
+						for (isa = 1; isa < check_isa_count; isa++) {
+							memcpy (result, dest, sizeof (guint16) * 4 * count);
+							check_isas[isa].funcs16[mode][masked][opaque] (result, src16, mask16, count, opacity, key);
+							if ((i = check_compare16 (expected, result, count)) >= 0)
+								check_fail ("%s %s 16 bits row, masked %d, opaque %d, %d pixels: pixel %d differs from scalar",
+									    check_isas[isa].name, layer_mode_names[mode], masked, opaque, count, i);
+						}
+					}
+
+	//4 planes of high bytes, then 4 of low ones, count bytes apart
+	for (count = 1; count <= CHECK_MAX_COUNT; count++)
+		for (row = 0; row < CHECK_ROWS; row++) {
+			check_bytes (rand, planes, 8 * count);
+			check_isas[0].interleave16 (planes, planes + count, planes + 2 * count, planes + 3 * count, 4 * count, expected, count);
+			for (isa = 1; isa < check_isa_count; isa++) {
+				check_isas[isa].interleave16 (planes, planes + count, planes + 2 * count, planes + 3 * count, 4 * count, result, count);
+				if ((i = check_compare16 (expected, result, count)) >= 0)
+					check_fail ("%s interleave16, %d pixels: pixel %d differs from scalar", check_isas[isa].name, count, i);
+			}
+		}
+
+	for (count = 1; count <= CHECK_MAX_COUNT; count++)
+		for (row = 0; row < CHECK_ROWS; row++) {
+			check_dest_row (rand, dest, count);
+			check_isas[0].unpremultiply (dest, expected_pixels, count);
+			for (isa = 1; isa < check_isa_count; isa++) {
+				check_isas[isa].unpremultiply (dest, pixels, count);
+				if (memcmp (expected_pixels, pixels, 4 * count))
+					check_fail ("%s unpremultiply, %d pixels: differs from scalar", check_isas[isa].name, count);
+			}
+		}
+
+	g_rand_free (rand);
+}
+
+/*
+ * A masked variant composites the src alpha times the mask, an opaque one
+ * ignores the opacity: both have to match the plain variant given the
+ * masked src, and an opacity of 255.
+ */
+static void
+check_variants (void)
+{
+	static guint16 dest[4 * CHECK_MAX_COUNT], expected[4 * CHECK_MAX_COUNT], result[4 * CHECK_MAX_COUNT];
+	static guchar src[4 * CHECK_MAX_COUNT], masked_src[4 * CHECK_MAX_COUNT], copy[4 * CHECK_MAX_COUNT];
+	static guchar mask[CHECK_MAX_COUNT];
+	static guint16 src16[4 * CHECK_MAX_COUNT], masked_src16[4 * CHECK_MAX_COUNT], mask16[CHECK_MAX_COUNT];
+	GRand *rand = g_rand_new_with_seed (24);
+	guint32 mode;
+	int isa, masked, opaque, count, row, i;
+
+	g_print ("variants: masked and opaque rows against plain ones\n");
+	for (isa = 0; isa < check_isa_count; isa++)
+		for (mode = 0; mode <= LAYERMODE_GRAINMERGE; mode++)
+			for (count = 1; count <= CHECK_MAX_COUNT; count++)
+				for (row = 0; row < CHECK_ROWS; row++) {
+					composite_row_func (*funcs)[2] = check_isas[isa].funcs[mode];
+					guint32 opacity = check_byte (rand);
+					guint32 key = g_rand_int (rand);
+					check_dest_row (rand, dest, count);
+					check_bytes (rand, src, 4 * count);
+					check_bytes (rand, mask, count);
+					memcpy (masked_src, src, 4 * count);
+					apply_mask (masked_src, mask, count);
+
+					for (masked = 0; masked < 2; masked++)
+						for (opaque = 0; opaque < 2; opaque++) {
+							if (!masked && !opaque)
+								continue;
+							memcpy (expected, dest, sizeof (guint16) * 4 * count);
+							memcpy (copy, masked ? masked_src : src, 4 * count);
+							funcs[0][0] (expected, copy, NULL, count, opaque ? 255 : opacity, key);
+
+							memcpy (result, dest, sizeof (guint16) * 4 * count);
+							memcpy (copy, src, 4 * count);
+							funcs[masked][opaque] (result, copy, mask, count, opacity, key);
+							if ((i = check_compare16 (expected, result, count)) >= 0)
+								check_fail ("%s %s row, masked %d, opaque %d, %d pixels: pixel %d differs from the plain row",
+									    check_isas[isa].name, layer_mode_names[mode], masked, opaque, count, i);
+						}
+				}
+
+	for (isa = 0; isa < check_isa_count; isa++)
+		for (mode = 0; mode <= LAYERMODE_GRAINMERGE; mode++)
+			for (count = 1; count <= CHECK_MAX_COUNT; count++)
+				for (row = 0; row < CHECK_ROWS; row++) {
+					composite_row16_func (*funcs)[2] = check_isas[isa].funcs16[mode];
+					guint32 opacity = check_byte (rand);
+					guint32 key = g_rand_int (rand);
+					check_dest_row (rand, dest, count);
+					check_words (rand, src16, 4 * count);
+					check_words (rand, mask16, count);
+					memcpy (masked_src16, src16, sizeof (guint16) * 4 * count);
+					apply_mask16 (masked_src16, mask16, count);
+
+					for (masked = 0; masked < 2; masked++)
+						for (opaque = 0; opaque < 2; opaque++) {
+							if (!masked && !opaque)
+								continue;
+							memcpy (expected, dest, sizeof (guint16) * 4 * count);
+							funcs[0][0] (expected, masked ? masked_src16 : src16, NULL, count, opaque ? 255 : opacity, key);
+
+							memcpy (result, dest, sizeof (guint16) * 4 * count);
+							funcs[masked][opaque] (result, src16, mask16, count, opacity, key);
+							if ((i = check_compare16 (expected, result, count)) >= 0)
+								check_fail ("%s %s 16 bits row, masked %d, opaque %d, %d pixels: pixel %d differs from the plain row",
+									    check_isas[isa].name, layer_mode_names[mode], masked, opaque, count, i);
+						}
+				}
+
+	g_rand_free (rand);
+}
+
+/* HSV modes */
+
+/*
+ * The hsv modes, against a double precision model: the pixels go to hsv
+ * (or hsl, for color) and back, as in gimp. Opaque pixels go through the
+ * working buffer unchanged, so the rows are checked end to end.
+ */
+
+static void
+model_to_hsv (const guchar *rgb, double *hsv, gboolean hsl)
+{
+	double min = MIN3 (rgb), max = MAX3 (rgb), range = max - min;
+
+	if (range == 0)
+		hsv[0] = 0;
+	else if (rgb[0] == max)
+		hsv[0] = (rgb[1] - rgb[2]) / range + (rgb[1] < rgb[2] ? 6 : 0);
+	else if (rgb[1] == max)
+		hsv[0] = (rgb[2] - rgb[0]) / range + 2;
+	else
+		hsv[0] = (rgb[0] - rgb[1]) / range + 4;
+	if (hsl) {
+		hsv[2] = (min + max) / 2;
+		hsv[1] = range == 0 ? 0 : range / (255 - fabs (min + max - 255));
+	} else {
+		hsv[2] = max;
+		hsv[1] = max == 0 ? 0 : range / max;
+	}
+}
+
+static void
+model_to_rgb (const double *hsv, double *rgb, gboolean hsl)
+{
+	double chroma = hsl ? hsv[1] * (255 - fabs (2 * hsv[2] - 255)) : hsv[1] * hsv[2];
+	double max = hsl ? hsv[2] + chroma / 2 : hsv[2];
+	double x = chroma * (1 - fabs (fmod (hsv[0], 2) - 1));
+	//channels in decreasing order for each sextant of the hue
+	static const int order[6][3] = { { 0, 1, 2 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 1, 0 }, { 2, 0, 1 }, { 0, 2, 1 } };
+	const int *o = order[(int)hsv[0] % 6];
+
+	rgb[o[0]] = max;
+	rgb[o[1]] = max - chroma + x;
+	rgb[o[2]] = max - chroma;
+}
+
+static void
+model_composite (guint32 mode, const guchar *rgb0, const guchar *rgb1, double *out)
+{
+	double hsv0[3], hsv1[3];
+	gboolean hsl = mode == LAYERMODE_COLOR;
+
+	model_to_hsv (rgb0, hsv0, hsl);
+	model_to_hsv (rgb1, hsv1, hsl);
+	switch (mode) {
+	case LAYERMODE_HUE:
+		if (hsv1[1] != 0)
+			hsv0[0] = hsv1[0];
+		break;
+	case LAYERMODE_SATURATION:
+		hsv0[1] = hsv1[1];
+		break;
+	case LAYERMODE_COLOR:
+		hsv0[0] = hsv1[0];
+		hsv0[1] = hsv1[1];
+		break;
+	case LAYERMODE_VALUE:
+		hsv0[2] = hsv1[2];
+		break;
+	}
+	model_to_rgb (hsv0, out, hsl);
+}
+
+static void
+check_hsv (void)
+{
+	static const guint32 modes[] = { LAYERMODE_HUE, LAYERMODE_SATURATION, LAYERMODE_COLOR, LAYERMODE_VALUE };
+	//the corners and the middle of the cube, then random pixels
+	static const guchar values[] = { 0, 1, 127, 128, 254, 255 };
+	static const int digits[] = { 1, 6, 36, 216, 1296, 7776 };
+	const int corners = 6 * 6 * 6 * 6 * 6 * 6, count = corners + (1 << 20);
+	guint16 dest[4 * 64];
+	guchar src[4 * 64], rgb0[4 * 64], rgb1[4 * 64], out[4 * 64];
+	int i, isa, j, k, c;
+
+	g_print ("hsv: %d pixel pairs against a double precision model\n", count);
+	for (i = 0; i < G_N_ELEMENTS (modes); i++)
+		for (isa = 0; isa < check_isa_count; isa++) {
+			composite_row_func row = check_isas[isa].funcs[modes[i]][FALSE][TRUE];
+			GRand *rand = g_rand_new_with_seed (i);
+			double error, max_error = 0, sum = 0;
+			for (j = 0; j < count; j += 64) {
+				int n = MIN (64, count - j);
+				for (k = 0; k < n; k++)
+					for (c = 0; c < 3; c++) {
+						rgb0[4*k + c] = j + k < corners ? values[(j + k) / digits[c] % 6] : g_rand_int (rand);
+						rgb1[4*k + c] = j + k < corners ? values[(j + k) / digits[c + 3] % 6] : g_rand_int (rand);
+						src[4*k + c] = rgb1[4*k + c];
+						dest[4*k + c] = rgb0[4*k + c] * 257;
+						dest[4*k + 3] = 0xffff;
+						src[4*k + 3] = 0xff;
+					}
+				//the scalar rows work in src
+				row (dest, src, NULL, n, 0xff, 0);
+				unpremultiply_row_scalar (dest, out, n);
+				for (k = 0; k < n; k++) {
+					double expected[3];
+					model_composite (modes[i], rgb0 + 4*k, rgb1 + 4*k, expected);
+					for (c = 0; c < 3; c++) {
+						error = fabs (out[4*k + c] - expected[c]);
+						max_error = MAX (max_error, error);
+						sum += error;
+					}
+				}
+			}
+			g_print ("  %-12s %-6s max error %6.3f  mean error %6.3f\n", layer_mode_names[modes[i]],
+				 check_isas[isa].name, max_error, sum / (3.0 * count));
+			//half a level for the rounding, and another one for the intermediate rounding of saturation
+			if (max_error > 1)
+				check_fail ("%s %s rows are off by %.3f", check_isas[isa].name, layer_mode_names[modes[i]], max_error);
+			g_rand_free (rand);
+		}
+}
+
+/* Dissolve */
+
+static void
+put32 (GByteArray *out, guint32 value)
+{
+	value = GUINT32_TO_BE (value);
+	g_byte_array_append (out, (guint8*)&value, sizeof(guint32));
+}
+
+static void
+set32 (GByteArray *out, gsize offset, guint32 value)
+{
+	value = GUINT32_TO_BE (value);
+	memcpy (out->data + offset, &value, sizeof(guint32));
+}
+
+static void
+put_property (GByteArray *out, guint32 property, guint32 value)
+{
+	put32 (out, property);
+	put32 (out, sizeof(guint32));
+	put32 (out, value);
+}
+
+static void
+put_string (GByteArray *out, const gchar *string)
+{
+	put32 (out, strlen (string) + 1);
+	g_byte_array_append (out, (const guint8*)string, strlen (string) + 1);
+}
+
+//a hierarchy of uncompressed tiles, with noisy channels and an alpha gradient
+static void
+put_hierarchy (GByteArray *out, guint32 width, guint32 height, int channels, guint32 seed)
+{
+	int columns = (width + 63) / 64;
+	int count = columns * ((height + 63) / 64);
+	int tile, i, j, c;
+
+	put32 (out, width);
+	put32 (out, height);
+	put32 (out, channels);
+	put32 (out, out->len + 2 * sizeof(guint32));
+	put32 (out, 0);
+
+	put32 (out, width);
+	put32 (out, height);
+	gsize pointers = out->len;
+	for (tile = 0; tile <= count; tile++)
+		put32 (out, 0);
+	for (tile = 0; tile < count; tile++) {
+		int ox = 64 * (tile % columns);
+		int oy = 64 * (tile / columns);
+		set32 (out, pointers + tile * sizeof(guint32), out->len);
+		for (j = 0; j < MIN (64, height - oy); j++)
+			for (i = 0; i < MIN (64, width - ox); i++)
+				for (c = 0; c < channels; c++) {
+					guint8 value = hash32 (seed + ((oy + j) * width + ox + i) * channels + c);
+					if (c == 3 || channels == 1)
+						value = (ox + i + oy + j) * 255 / (width + height);
+					g_byte_array_append (out, &value, 1);
+				}
+	}
+}
+
+//an rgb layer under an rgba dissolve layer with a mask, offset and clipped
+static GByteArray*
+check_write_dissolve (void)
+{
+	GByteArray *out = g_byte_array_new ();
+	const guint32 width = 300, height = 200;
+	int layer;
+
+	g_byte_array_append (out, (const guint8*)"gimp xcf file", 14);
+	put32 (out, width);
+	put32 (out, height);
+	put32 (out, 0); //RGB
+	put32 (out, PROP_COMPRESSION);
+	put32 (out, 1);
+	g_byte_array_append (out, (const guint8*)"\0", 1); //COMPRESSION_NONE
+	put32 (out, PROP_END);
+	put32 (out, 0);
+
+	gsize pointers = out->len;
+	put32 (out, 0);
+	put32 (out, 0);
+	put32 (out, 0);
+	put32 (out, 0); //no channels
+
+	for (layer = 0; layer < 2; layer++) {
+		gboolean dissolve = layer == 0;
+		guint32 w = dissolve ? width - 40 : width;
+		guint32 h = dissolve ? height - 20 : height;
+
+		set32 (out, pointers + layer * sizeof(guint32), out->len);
+		put32 (out, w);
+		put32 (out, h);
+		put32 (out, dissolve ? LAYERTYPE_RGBA : LAYERTYPE_RGB);
+		put_string (out, "layer");
+		put_property (out, PROP_OPACITY, dissolve ? 0xc0 : 0xff);
+		put_property (out, PROP_MODE, dissolve ? LAYERMODE_DISSOLVE : LAYERMODE_NORMAL);
+		put_property (out, PROP_VISIBLE, 1);
+		put_property (out, PROP_APPLY_MASK, dissolve);
+		put32 (out, PROP_OFFSETS);
+		put32 (out, 2 * sizeof(guint32));
+		put32 (out, dissolve ? -13 : 0);
+		put32 (out, dissolve ? 30 : 0);
+		put32 (out, PROP_END);
+		put32 (out, 0);
+
+		gsize hptr = out->len;
+		put32 (out, 0);
+		put32 (out, 0);
+		set32 (out, hptr, out->len);
+		put_hierarchy (out, w, h, dissolve ? 4 : 3, layer);
+		if (!dissolve)
+			continue;
+
+		set32 (out, hptr + sizeof(guint32), out->len);
+		put32 (out, w);
+		put32 (out, h);
+		put_string (out, "mask");
+		put32 (out, PROP_END);
+		put32 (out, 0);
+		put32 (out, out->len + sizeof(guint32));
+		put_hierarchy (out, w, h, 1, 2);
+	}
+
+	return out;
+}
+
+//write len bytes of data to a new temporary file, and return its path
+static gchar*
+check_write_file (const guchar *data, gsize len)
+{
+	GError *error = NULL;
+	gchar *path;
+	int fd = g_file_open_tmp ("xcf-check-XXXXXX.xcf", &path, &error);
+	if (fd < 0)
+		g_error ("%s", error->message);
+	if (write (fd, data, len) != len)
+		g_error ("can't write %s", path);
+	close (fd);
+	return path;
+}
+
+static GdkPixbuf*
+check_try_load (const gchar *path, const gchar *threads, GError **error)
+{
+	GdkPixbuf *pixbuf;
+
+	g_setenv ("IO_XCF_THREADS", threads, TRUE);
+	FILE *f = fopen (path, "rb");
+	if (!f)
+		g_error ("can't open %s", path);
+	pixbuf = xcf_image_load (f, error);
+	fclose (f);
+	g_unsetenv ("IO_XCF_THREADS");
+	return pixbuf;
+}
+
+static GdkPixbuf*
+check_load (const gchar *path, const gchar *threads)
+{
+	GError *error = NULL;
+	GdkPixbuf *pixbuf = check_try_load (path, threads, &error);
+
+	if (!pixbuf)
+		g_error ("%s", error->message);
+	return pixbuf;
+}
+
+//the first differing row of two pixbufs of the same size, or -1
+static int
+check_compare_pixbufs (GdkPixbuf *a, GdkPixbuf *b)
+{
+	int rowstride = gdk_pixbuf_get_rowstride (a);
+	int j;
+
+	for (j = 0; j < gdk_pixbuf_get_height (a); j++)
+		if (memcmp (gdk_pixbuf_get_pixels (a) + j * rowstride, gdk_pixbuf_get_pixels (b) + j * rowstride,
+			    4 * gdk_pixbuf_get_width (a)))
+			return j;
+	return -1;
+}
+
+static void
+check_dissolve (void)
+{
+	static guint16 dest[64 * WORK_STRIDE], expected[64 * WORK_STRIDE], result[64 * WORK_STRIDE];
+	static guchar pixels[4 * 64 * 64], copy[4 * 64 * 64], mask[64 * 64];
+	static const guint32 opacities[] = { 0xc0, 0xff };
+	GRand *rand = g_rand_new_with_seed (22);
+	CheckRowFuncs funcs;
+	XcfLayer layer;
+	XcfTile tile;
+	XcfComposite composite;
+	int isa, masked, o, j;
+
+	g_print ("dissolve: tiles on every instruction set and in two regions, files on 1 and 4 threads\n");
+	memcpy (funcs, composite_row_funcs, sizeof (CheckRowFuncs));
+	memset (&layer, 0, sizeof (XcfLayer));
+	layer.mode = LAYERMODE_DISSOLVE;
+	layer.lptr = G_GINT64_CONSTANT (0x123456789);
+	tile.width = tile.height = 64;
+	tile.type = LAYERTYPE_RGBA;
+	tile.planes = NULL;
+	tile.precision = PRECISION_U8;
+	for (j = 0; j < 64; j++)
+		check_dest_row (rand, dest + j * WORK_STRIDE, 64);
+	check_bytes (rand, pixels, sizeof (pixels));
+	check_bytes (rand, mask, sizeof (mask));
+
+	for (o = 0; o < G_N_ELEMENTS (opacities); o++)
+		for (masked = 0; masked < 2; masked++) {
+			layer.opacity = opacities[o];
+			tile.mask = masked ? mask : NULL;
+
+			//the tile at (1000, 777) of the canvas, clipped to the region
+			for (isa = 0; isa < check_isa_count; isa++) {
+				guint16 *work = isa ? result : expected;
+				memcpy (composite_row_funcs, check_isas[isa].funcs, sizeof (CheckRowFuncs));
+				composite_init (&composite, &layer, masked);
+				memcpy (work, dest, sizeof (dest));
+				memcpy (copy, pixels, sizeof (pixels));
+				tile.pixels = copy;
+				composite_tile (work, WORK_STRIDE, 64, 64, 1000, 777, &tile, -13, 5, &composite);
+				if (isa && (j = check_compare16 (expected, result, 64 * REGION_SIZE)) >= 0)
+					check_fail ("%s dissolve tile, masked %d, opacity %u: pixel %d differs from scalar",
+						    check_isas[isa].name, masked, opacities[o], j);
+			}
+
+			//the same tile over the two regions from (1000, 777) and (1032, 777)
+			memcpy (result, dest, sizeof (dest));
+			memcpy (copy, pixels, sizeof (pixels));
+			tile.pixels = copy;
+			composite_tile (result, WORK_STRIDE, 32, 64, 1000, 777, &tile, -13, 5, &composite);
+			composite_tile (result + 4 * 32, WORK_STRIDE, 32, 64, 1032, 777, &tile, -45, 5, &composite);
+			if ((j = check_compare16 (expected, result, 64 * REGION_SIZE)) >= 0)
+				check_fail ("dissolve tile, masked %d, opacity %u: pixel %d differs when split in two regions",
+					    masked, opacities[o], j);
+		}
+	memcpy (composite_row_funcs, funcs, sizeof (CheckRowFuncs));
+	g_rand_free (rand);
+
+	//a whole file, on 1 and on several threads
+	GByteArray *xcf = check_write_dissolve ();
+	gchar *path = check_write_file (xcf->data, xcf->len);
+	g_byte_array_free (xcf, TRUE);
+
+	GdkPixbuf *single = check_load (path, "1");
+	GdkPixbuf *threaded = check_load (path, "4");
+	if ((j = check_compare_pixbufs (single, threaded)) >= 0)
+		check_fail ("dissolve file: row %d differs between 1 and 4 threads", j);
+	g_object_unref (single);
+	g_object_unref (threaded);
+	g_unlink (path);
+	g_free (path);
+}
+
+/* Compressed files */
+
+static GByteArray*
+check_bzip2 (const guchar *data, gsize len)
+{
+	GByteArray *out = g_byte_array_new ();
+	unsigned int size = len + len / 100 + 600;
+
+	g_byte_array_set_size (out, size);
+	if (BZ2_bzBuffToBuffCompress ((char*)out->data, &size, (char*)data, len, 9, 0, 0) != BZ_OK)
+		g_error ("can't bzip2 %" G_GSIZE_FORMAT " bytes", len);
+	g_byte_array_set_size (out, size);
+	return out;
+}
+
+static GByteArray*
+check_gzip (const guchar *data, gsize len)
+{
+	GByteArray *out = g_byte_array_new ();
+	z_stream z;
+
+	memset (&z, 0, sizeof (z_stream));
+	if (deflateInit2 (&z, Z_BEST_SPEED, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		g_error ("can't initialize zlib");
+	g_byte_array_set_size (out, deflateBound (&z, len));
+	z.next_in = (Bytef*)data;
+	z.avail_in = len;
+	z.next_out = out->data;
+	z.avail_out = out->len;
+	if (deflate (&z, Z_FINISH) != Z_STREAM_END)
+		g_error ("can't gzip %" G_GSIZE_FORMAT " bytes", len);
+	g_byte_array_set_size (out, z.total_out);
+	deflateEnd (&z);
+	return out;
+}
+
+static void
+check_compressed (void)
+{
+	static const struct {
+		const gchar *name;
+		GByteArray* (*compress) (const guchar *data, gsize len);
+		gboolean loads;
+	} formats[] = {
+		{ "bz2", check_bzip2, TRUE },
+#if GIO_2_23
+		{ "gz", check_gzip, TRUE },
+#else
+		{ "gz", check_gzip, FALSE },
+#endif
+	};
+	int f, cut, j;
+
+	g_print ("compressed: whole and truncated .xcf.bz2 and .xcf.gz files\n");
+	GByteArray *xcf = check_write_dissolve ();
+	gchar *path = check_write_file (xcf->data, xcf->len);
+	GdkPixbuf *expected = check_load (path, "1");
+	g_unlink (path);
+	g_free (path);
+
+	for (f = 0; f < G_N_ELEMENTS (formats); f++) {
+		GByteArray *compressed = formats[f].compress (xcf->data, xcf->len);
+		//the whole file, then cut in the data and in the trailer
+		gsize lengths[] = { compressed->len, compressed->len / 2, compressed->len - 4 };
+
+		for (cut = 0; cut < G_N_ELEMENTS (lengths); cut++) {
+			GError *error = NULL;
+			path = check_write_file (compressed->data, lengths[cut]);
+			GdkPixbuf *pixbuf = check_try_load (path, "1", &error);
+			if (cut == 0 && formats[f].loads) {
+				if (!pixbuf)
+					check_fail ("%s file: %s", formats[f].name, error->message);
+				else if ((j = check_compare_pixbufs (expected, pixbuf)) >= 0)
+					check_fail ("%s file: row %d differs from the uncompressed file", formats[f].name, j);
+			} else if (cut > 0 && pixbuf)
+				check_fail ("%s file truncated to %" G_GSIZE_FORMAT " of %u bytes: loaded",
+					    formats[f].name, lengths[cut], compressed->len);
+			if (pixbuf)
+				g_object_unref (pixbuf);
+			g_clear_error (&error);
+			g_unlink (path);
+			g_free (path);
+		}
+		g_byte_array_free (compressed, TRUE);
+	}
+	g_object_unref (expected);
+	g_byte_array_free (xcf, TRUE);
+}
+
+/* High bit depth */
+
+#define CHECK_DEPTH_WIDTH	300
+#define CHECK_DEPTH_HEIGHT	70
+
+//a precision of the files, and how their tiles are stored
+typedef struct _CheckDepth CheckDepth;
+struct _CheckDepth {
+	const gchar *name;
+	guint32 precision;	//as in v007 files
+	int size;		//bytes per component
+	gboolean linear;
+	gchar compression;
+};
+
+/*
+ * The straight rgba of layer (0 on top) at (x, y), in gamma space. The
+ * gradients span a few 8 bits levels over the whole canvas, and the top one
+ * has an alpha gradient as well.
+ */
+static void
+check_depth_color (int layer, int x, int y, double *rgba)
+{
+	double u = x / (CHECK_DEPTH_WIDTH - 1.0), v = y / (CHECK_DEPTH_HEIGHT - 1.0);
+
+	if (layer == 0) {
+		rgba[0] = 0.60 - 0.04 * u;
+		rgba[1] = 0.30 + 0.03 * v;
+		rgba[2] = 0.45 + 0.02 * u * v;
+		rgba[3] = 0.35 + 0.05 * u;
+	} else {
+		rgba[0] = 0.25 + 0.05 * u;
+		rgba[1] = 0.70 - 0.04 * u;
+		rgba[2] = 0.50 + 0.03 * v;
+		rgba[3] = 1.0;
+	}
+}
+
+/*
+ * Store value, a color component in gamma space unless alpha, to the size
+ * big endian bytes of depth at bytes. Returns the value the file holds, in
+ * gamma space.
+ */
+static double
+check_depth_store (const CheckDepth *depth, double value, gboolean alpha, guchar *bytes)
+{
+	if (depth->size == 2) {
+		guint16 v = value * 0xffff + 0.5;
+		bytes[0] = v >> 8;
+		bytes[1] = v;
+		return v / (double)0xffff;
+	}
+
+	//float, in linear light for the colors
+	if (depth->linear && !alpha)
+		value = value <= 0.04045 ? value / 12.92 : pow ((value + 0.055) / 1.055, 2.4);
+	float f = value;
+	guint32 bits;
+	memcpy (&bits, &f, sizeof (float));
+	bytes[0] = bits >> 24;
+	bytes[1] = bits >> 16;
+	bytes[2] = bits >> 8;
+	bytes[3] = bits;
+	value = f;
+	if (depth->linear && !alpha)
+		value = value <= 0.0031308 ? 12.92 * value : 1.055 * pow (value, 1 / 2.4) - 0.055;
+	return value;
+}
+
+//the hierarchy of layer, RLE tiles as a long literal per plane
+static void
+put_depth_hierarchy (GByteArray *out, const CheckDepth *depth, int layer)
+{
+	const guint32 width = CHECK_DEPTH_WIDTH, height = CHECK_DEPTH_HEIGHT;
+	int channels = layer == 0 ? 4 : 3;
+	int bpp = channels * depth->size;
+	int columns = (width + 63) / 64;
+	int count = columns * ((height + 63) / 64);
+	guchar pixels[64 * 64 * 16], planes[64 * 64 * 16];
+	int tile, i, j, k, b;
+
+	put32 (out, width);
+	put32 (out, height);
+	put32 (out, bpp);
+	put32 (out, out->len + 2 * sizeof(guint32));
+	put32 (out, 0);
+
+	put32 (out, width);
+	put32 (out, height);
+	gsize pointers = out->len;
+	for (tile = 0; tile <= count; tile++)
+		put32 (out, 0);
+	for (tile = 0; tile < count; tile++) {
+		int ox = 64 * (tile % columns);
+		int oy = 64 * (tile / columns);
+		int w = MIN (64, width - ox), h = MIN (64, height - oy);
+		set32 (out, pointers + tile * sizeof(guint32), out->len);
+		for (j = 0, k = 0; j < h; j++)
+			for (i = 0; i < w; i++, k++) {
+				double rgba[4];
+				int c;
+				check_depth_color (layer, ox + i, oy + j, rgba);
+				for (c = 0; c < channels; c++)
+					check_depth_store (depth, rgba[c], c == 3, pixels + k * bpp + c * depth->size);
+			}
+		if (depth->compression == COMPRESSION_NONE) {
+			g_byte_array_append (out, pixels, w * h * bpp);
+			continue;
+		}
+		for (b = 0; b < bpp; b++) {
+			for (k = 0; k < w * h; k++)
+				planes[k] = pixels[k * bpp + b];
+			guchar op[3] = { 128, (w * h) >> 8, w * h };
+			g_byte_array_append (out, op, 3);
+			g_byte_array_append (out, planes, w * h);
+		}
+	}
+}
+
+//an opaque rgb gradient under an rgba one in mode, at opacity
+static GByteArray*
+check_write_depth (const CheckDepth *depth, guint32 mode, guint32 opacity)
+{
+	GByteArray *out = g_byte_array_new ();
+	int layer;
+
+	g_byte_array_append (out, (const guint8*)"gimp xcf v007", 14);
+	put32 (out, CHECK_DEPTH_WIDTH);
+	put32 (out, CHECK_DEPTH_HEIGHT);
+	put32 (out, 0); //RGB
+	put32 (out, depth->precision);
+	put32 (out, PROP_COMPRESSION);
+	put32 (out, 1);
+	g_byte_array_append (out, (const guint8*)&depth->compression, 1);
+	put32 (out, PROP_END);
+	put32 (out, 0);
+
+	gsize pointers = out->len;
+	put32 (out, 0);
+	put32 (out, 0);
+	put32 (out, 0);
+	put32 (out, 0); //no channels
+
+	for (layer = 0; layer < 2; layer++) {
+		set32 (out, pointers + layer * sizeof(guint32), out->len);
+		put32 (out, CHECK_DEPTH_WIDTH);
+		put32 (out, CHECK_DEPTH_HEIGHT);
+		put32 (out, layer == 0 ? LAYERTYPE_RGBA : LAYERTYPE_RGB);
+		put_string (out, "layer");
+		put_property (out, PROP_OPACITY, layer == 0 ? opacity : 0xff);
+		put_property (out, PROP_MODE, layer == 0 ? mode : LAYERMODE_NORMAL);
+		put_property (out, PROP_VISIBLE, 1);
+		put32 (out, PROP_END);
+		put32 (out, 0);
+
+		gsize hptr = out->len;
+		put32 (out, 0);
+		put32 (out, 0); //no mask
+		set32 (out, hptr, out->len);
+		put_depth_hierarchy (out, depth, layer);
+	}
+
+	return out;
+}
+
+/*
+ * The components of the pixbuf have to be the rounded ones of the model, or
+ * the other integer next to it if the model is within a tenth of a level of
+ * the half.
+ */
+static void
+check_depth (void)
+{
+	static const CheckDepth depths[] = {
+		{ "16 bits rle", 250, 2, FALSE, COMPRESSION_RLE },
+		{ "16 bits", 250, 2, FALSE, COMPRESSION_NONE },
+		{ "float linear", 600, 4, TRUE, COMPRESSION_NONE },
+	};
+	static const guint32 modes[] = { LAYERMODE_NORMAL, LAYERMODE_MULTIPLY };
+	const guint32 opacity = 0xc0;
+	guchar bytes[4];
+	int d, m, x, y, c;
+
+	g_print ("depth: 16 bits and float gradients of two blended layers against a double precision model\n");
+	for (d = 0; d < G_N_ELEMENTS (depths); d++)
+		for (m = 0; m < G_N_ELEMENTS (modes); m++) {
+			GByteArray *xcf = check_write_depth (&depths[d], modes[m], opacity);
+			gchar *path = check_write_file (xcf->data, xcf->len);
+			GdkPixbuf *pixbuf = check_load (path, "1");
+			guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+			int rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+			int banded = 0, first_x = 0, first_y = 0;
+			double error, max_error = 0;
+
+			for (y = 0; y < CHECK_DEPTH_HEIGHT; y++)
+				for (x = 0; x < CHECK_DEPTH_WIDTH; x++) {
+					double top[4], bottom[4], expected[4];
+					check_depth_color (0, x, y, top);
+					check_depth_color (1, x, y, bottom);
+					for (c = 0; c < 4; c++) {
+						top[c] = check_depth_store (&depths[d], top[c], c == 3, bytes);
+						bottom[c] = c < 3 ? check_depth_store (&depths[d], bottom[c], FALSE, bytes) : 1;
+					}
+					//the bottom layer is opaque, its alpha and the blend factor are the top one
+					double a = top[3] * opacity / 255;
+					for (c = 0; c < 3; c++) {
+						double blended = modes[m] == LAYERMODE_MULTIPLY ? bottom[c] * top[c] : top[c];
+						expected[c] = bottom[c] + a * (blended - bottom[c]);
+					}
+					expected[3] = 1;
+					for (c = 0; c < 4; c++) {
+						error = fabs (pixels[y * rowstride + 4*x + c] - 255 * expected[c]);
+						max_error = MAX (max_error, error);
+						if (error > 0.6 && !banded++) {
+							first_x = x;
+							first_y = y;
+						}
+					}
+				}
+			g_print ("  %-12s %-8s max error %6.3f\n", depths[d].name, layer_mode_names[modes[m]], max_error);
+			if (banded)
+				check_fail ("%s %s file: %d components off the model, the first at (%d, %d)",
+					    depths[d].name, layer_mode_names[modes[m]], banded, first_x, first_y);
+
+			g_object_unref (pixbuf);
+			g_unlink (path);
+			g_free (path);
+			g_byte_array_free (xcf, TRUE);
+		}
+}
+
+int
+main (int argc, char **argv)
+{
+	const gchar *filter = argc > 1 ? argv[1] : NULL;
+
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+	g_type_init ();
+#endif
+	check_init_isas ();
+
+	if (!filter || strstr ("kernels", filter))
+		check_kernels ();
+	if (!filter || strstr ("variants", filter))
+		check_variants ();
+	if (!filter || strstr ("hsv", filter))
+		check_hsv ();
+	if (!filter || strstr ("dissolve", filter))
+		check_dissolve ();
+	if (!filter || strstr ("compressed", filter))
+		check_compressed ();
+	if (!filter || strstr ("depth", filter))
+		check_depth ();
+
+	if (check_failures)
+		g_printerr ("%d failures\n", check_failures);
+	return check_failures ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * xz decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gi18n.h>
+
+#include "xcf-xz-decompressor.h"
+
+static void xcf_xz_decompressor_iface_init          (GConverterIface *iface);
+
+struct _XcfXzDecompressor
+{
+    GObject parent_instance;
+
+    lzma_stream lzstream;
+};
+
+G_DEFINE_TYPE_WITH_CODE (XcfXzDecompressor, xcf_xz_decompressor, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                xcf_xz_decompressor_iface_init))
+
+static void
+xcf_xz_decompressor_start (XcfXzDecompressor *decompressor)
+{
+    lzma_stream init = LZMA_STREAM_INIT;
+    lzma_ret res;
+
+    decompressor->lzstream = init;
+    /* no memory limit, and concatenated streams are decompressed as one */
+    res = lzma_stream_decoder (&decompressor->lzstream, UINT64_MAX, LZMA_CONCATENATED);
+
+    if (res == LZMA_MEM_ERROR)
+        g_error ("XcfXzDecompressor: Not enough memory for xz use");
+
+    if (res != LZMA_OK)
+        g_error ("XcfXzDecompressor: Unexpected xz error");
+}
+
+static void
+xcf_xz_decompressor_finalize (GObject *object)
+{
+    XcfXzDecompressor *decompressor;
+
+    decompressor = XCF_XZ_DECOMPRESSOR (object);
+
+    lzma_end (&decompressor->lzstream);
+
+    G_OBJECT_CLASS (xcf_xz_decompressor_parent_class)->finalize (object);
+}
+
+static void
+xcf_xz_decompressor_init (XcfXzDecompressor *decompressor)
+{
+}
+
+static void
+xcf_xz_decompressor_constructed (GObject *object)
+{
+    xcf_xz_decompressor_start (XCF_XZ_DECOMPRESSOR (object));
+}
+
+static void
+xcf_xz_decompressor_class_init (XcfXzDecompressorClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->finalize = xcf_xz_decompressor_finalize;
+    gobject_class->constructed = xcf_xz_decompressor_constructed;
+}
+
+XcfXzDecompressor *
+xcf_xz_decompressor_new (void)
+{
+    XcfXzDecompressor *decompressor;
+
+    decompressor = g_object_new (XCF_TYPE_XZ_DECOMPRESSOR, NULL);
+
+    return decompressor;
+}
+
+static void
+xcf_xz_decompressor_reset (GConverter *converter)
+{
+    XcfXzDecompressor *decompressor = XCF_XZ_DECOMPRESSOR (converter);
+
+    lzma_end (&decompressor->lzstream);
+    xcf_xz_decompressor_start (decompressor);
+}
+
+static GConverterResult
+xcf_xz_decompressor_convert (GConverter *converter,
+                             const void *inbuf,
+                             gsize       inbuf_size,
+                             void       *outbuf,
+                             gsize       outbuf_size,
+                             GConverterFlags flags,
+                             gsize      *bytes_read,
+                             gsize      *bytes_written,
+                             GError    **error)
+{
+    XcfXzDecompressor *decompressor;
+    lzma_ret res;
+
+    decompressor = XCF_XZ_DECOMPRESSOR (converter);
+
+    decompressor->lzstream.next_in = inbuf;
+    decompressor->lzstream.avail_in = inbuf_size;
+
+    decompressor->lzstream.next_out = outbuf;
+    decompressor->lzstream.avail_out = outbuf_size;
+
+    /* with LZMA_CONCATENATED, the end of the input is the end of the data */
+    res = lzma_code (&decompressor->lzstream,
+                     flags & G_CONVERTER_INPUT_AT_END ? LZMA_FINISH : LZMA_RUN);
+
+    if (res == LZMA_BUF_ERROR) {
+        /* no progress possible */
+        if (flags & G_CONVERTER_INPUT_AT_END) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                 _("Invalid compressed data"));
+            return G_CONVERTER_ERROR;
+        }
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                             _("Need more input"));
+        return G_CONVERTER_ERROR;
+    }
+
+    if (res == LZMA_DATA_ERROR || res == LZMA_FORMAT_ERROR ||
+        res == LZMA_OPTIONS_ERROR) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             _("Invalid compressed data"));
+        return G_CONVERTER_ERROR;
+    }
+
+    if (res == LZMA_MEM_ERROR || res == LZMA_MEMLIMIT_ERROR) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Not enough memory"));
+        return G_CONVERTER_ERROR;
+    }
+
+    if (res == LZMA_OK || res == LZMA_STREAM_END) {
+        *bytes_read = inbuf_size - decompressor->lzstream.avail_in;
+        *bytes_written = outbuf_size - decompressor->lzstream.avail_out;
+
+        if (res == LZMA_STREAM_END)
+            return G_CONVERTER_FINISHED;
+        return G_CONVERTER_CONVERTED;
+    }
+
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Unexpected xz error"));
+    return G_CONVERTER_ERROR;
+}
+
+static void
+xcf_xz_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = xcf_xz_decompressor_convert;
+  iface->reset = xcf_xz_decompressor_reset;
+}
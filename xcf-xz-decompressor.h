@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * xz decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __XCF_XZ_DECOMPRESSOR_H__
+#define __XCF_XZ_DECOMPRESSOR_H__
+
+#include <gio/gio.h>
+#include <lzma.h>
+
+G_BEGIN_DECLS
+
+#define XCF_TYPE_XZ_DECOMPRESSOR         (xcf_xz_decompressor_get_type ())
+#define XCF_XZ_DECOMPRESSOR(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), XCF_TYPE_XZ_DECOMPRESSOR, XcfXzDecompressor))
+#define XCF_XZ_DECOMPRESSOR_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), XCF_TYPE_XZ_DECOMPRESSOR, XcfXzDecompressorClass))
+#define XCF_IS_XZ_DECOMPRESSOR(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), XCF_TYPE_XZ_DECOMPRESSOR))
+#define XCF_IS_XZ_DECOMPRESSOR_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), XCF_TYPE_XZ_DECOMPRESSOR))
+#define XCF_XZ_DECOMPRESSOR_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), XCF_TYPE_XZ_DECOMPRESSOR, XcfXzDecompressorClass))
+
+typedef struct _XcfXzDecompressor        XcfXzDecompressor;
+typedef struct _XcfXzDecompressorClass   XcfXzDecompressorClass;
+
+struct _XcfXzDecompressorClass
+{
+    GObjectClass parent_class;
+};
+
+GType               xcf_xz_decompressor_get_type (void);
+
+/* Decompresses .xz files, concatenated streams included */
+XcfXzDecompressor *xcf_xz_decompressor_new (void);
+
+G_END_DECLS
+
+#endif /* __XCF_XZ_DECOMPRESSOR_H__ */
@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Zstandard decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gi18n.h>
+
+#include "xcf-zstd-decompressor.h"
+
+static void xcf_zstd_decompressor_iface_init          (GConverterIface *iface);
+
+struct _XcfZstdDecompressor
+{
+    GObject parent_instance;
+
+    ZSTD_DStream *zstream;
+    gboolean frame_done;        /* the last frame is complete and flushed */
+};
+
+G_DEFINE_TYPE_WITH_CODE (XcfZstdDecompressor, xcf_zstd_decompressor, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                xcf_zstd_decompressor_iface_init))
+
+static void
+xcf_zstd_decompressor_finalize (GObject *object)
+{
+    XcfZstdDecompressor *decompressor;
+
+    decompressor = XCF_ZSTD_DECOMPRESSOR (object);
+
+    ZSTD_freeDStream (decompressor->zstream);
+
+    G_OBJECT_CLASS (xcf_zstd_decompressor_parent_class)->finalize (object);
+}
+
+static void
+xcf_zstd_decompressor_init (XcfZstdDecompressor *decompressor)
+{
+}
+
+static void
+xcf_zstd_decompressor_constructed (GObject *object)
+{
+    XcfZstdDecompressor *decompressor;
+
+    decompressor = XCF_ZSTD_DECOMPRESSOR (object);
+
+    decompressor->zstream = ZSTD_createDStream ();
+
+    if (!decompressor->zstream)
+        g_error ("XcfZstdDecompressor: Not enough memory for zstd use");
+
+    if (ZSTD_isError (ZSTD_initDStream (decompressor->zstream)))
+        g_error ("XcfZstdDecompressor: Unexpected zstd error");
+}
+
+static void
+xcf_zstd_decompressor_class_init (XcfZstdDecompressorClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->finalize = xcf_zstd_decompressor_finalize;
+    gobject_class->constructed = xcf_zstd_decompressor_constructed;
+}
+
+XcfZstdDecompressor *
+xcf_zstd_decompressor_new (void)
+{
+    XcfZstdDecompressor *decompressor;
+
+    decompressor = g_object_new (XCF_TYPE_ZSTD_DECOMPRESSOR, NULL);
+
+    return decompressor;
+}
+
+static void
+xcf_zstd_decompressor_reset (GConverter *converter)
+{
+    XcfZstdDecompressor *decompressor = XCF_ZSTD_DECOMPRESSOR (converter);
+
+    if (ZSTD_isError (ZSTD_initDStream (decompressor->zstream)))
+        g_error ("XcfZstdDecompressor: Unexpected zstd error");
+    decompressor->frame_done = FALSE;
+}
+
+static GConverterResult
+xcf_zstd_decompressor_convert (GConverter *converter,
+                               const void *inbuf,
+                               gsize       inbuf_size,
+                               void       *outbuf,
+                               gsize       outbuf_size,
+                               GConverterFlags flags,
+                               gsize      *bytes_read,
+                               gsize      *bytes_written,
+                               GError    **error)
+{
+    XcfZstdDecompressor *decompressor;
+    ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+    ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+    size_t res;
+
+    decompressor = XCF_ZSTD_DECOMPRESSOR (converter);
+
+    /* frames can follow each other, the data ends with the input */
+    if (inbuf_size == 0 && decompressor->frame_done &&
+        (flags & G_CONVERTER_INPUT_AT_END)) {
+        *bytes_read = 0;
+        *bytes_written = 0;
+        return G_CONVERTER_FINISHED;
+    }
+
+    res = ZSTD_decompressStream (decompressor->zstream, &out, &in);
+
+    if (ZSTD_isError (res)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             _("Invalid compressed data"));
+        return G_CONVERTER_ERROR;
+    }
+
+    if (in.pos == 0 && out.pos == 0) {
+        /* no progress possible */
+        if (flags & G_CONVERTER_INPUT_AT_END) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                 _("Invalid compressed data"));
+            return G_CONVERTER_ERROR;
+        }
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                             _("Need more input"));
+        return G_CONVERTER_ERROR;
+    }
+
+    *bytes_read = in.pos;
+    *bytes_written = out.pos;
+    decompressor->frame_done = res == 0;
+
+    if (decompressor->frame_done && in.pos == in.size &&
+        (flags & G_CONVERTER_INPUT_AT_END))
+        return G_CONVERTER_FINISHED;
+    return G_CONVERTER_CONVERTED;
+}
+
+static void
+xcf_zstd_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = xcf_zstd_decompressor_convert;
+  iface->reset = xcf_zstd_decompressor_reset;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Zstandard decompressor
+ *
+ * Copyright (C) 2009 Novell, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __XCF_ZSTD_DECOMPRESSOR_H__
+#define __XCF_ZSTD_DECOMPRESSOR_H__
+
+#include <gio/gio.h>
+#include <zstd.h>
+
+G_BEGIN_DECLS
+
+#define XCF_TYPE_ZSTD_DECOMPRESSOR         (xcf_zstd_decompressor_get_type ())
+#define XCF_ZSTD_DECOMPRESSOR(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), XCF_TYPE_ZSTD_DECOMPRESSOR, XcfZstdDecompressor))
+#define XCF_ZSTD_DECOMPRESSOR_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), XCF_TYPE_ZSTD_DECOMPRESSOR, XcfZstdDecompressorClass))
+#define XCF_IS_ZSTD_DECOMPRESSOR(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), XCF_TYPE_ZSTD_DECOMPRESSOR))
+#define XCF_IS_ZSTD_DECOMPRESSOR_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), XCF_TYPE_ZSTD_DECOMPRESSOR))
+#define XCF_ZSTD_DECOMPRESSOR_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), XCF_TYPE_ZSTD_DECOMPRESSOR, XcfZstdDecompressorClass))
+
+typedef struct _XcfZstdDecompressor        XcfZstdDecompressor;
+typedef struct _XcfZstdDecompressorClass   XcfZstdDecompressorClass;
+
+struct _XcfZstdDecompressorClass
+{
+    GObjectClass parent_class;
+};
+
+GType               xcf_zstd_decompressor_get_type (void);
+
+/* Decompresses Zstandard files, multiple frames included */
+XcfZstdDecompressor *xcf_zstd_decompressor_new (void);
+
+G_END_DECLS
+
+#endif /* __XCF_ZSTD_DECOMPRESSOR_H__ */